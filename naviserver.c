@@ -24,26 +24,146 @@
  */
 
 #define USE_TCL8X
+#define CAML_INTERNALS
 
 #include <caml/alloc.h>
 #include <caml/callback.h>
 #include <caml/memory.h>
 #include <caml/mlvalues.h>
+#include <caml/custom.h>
+#include <caml/address_class.h>
+#include <caml/bigarray.h>
 #include "ns.h"
 #include "nsd.h"
+#include "nsdb.h"
+#include "nsocaml.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 static Ns_ThreadArgProc ThreadArgProc;
 
+/*
+ * Connection and interpreter of the request handed off to OCaml worker
+ * thread, see NsOCamlSetConn
+ */
+
+static Ns_Tls connTls;
+static Ns_Tls interpTls;
+
+/*
+ * Per thread cache of ns_fmttime results, see Ns_FmtTime_OCaml
+ */
+
+static Ns_Tls fmtTimeTls;
+
+/*
+ * Opt-in tracing, every stub records a span with its enter and exit times
+ * into the per thread ring buffer while the thread runs an OCaml request,
+ * see NsOCamlTraceBegin. Spans of stubs which raise an OCaml exception are
+ * lost, the exception jumps over the cleanup.
+ */
+
+typedef struct TraceEvent {
+    const char *name;
+    const char *cat;
+    Tcl_WideInt start;
+    Tcl_WideInt end;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    bool active;                /* Inside NsOCamlTraceBegin/End */
+    int depth;                  /* Nested executions of the request */
+    unsigned long count;        /* Events recorded, older ones are overwritten */
+    TraceEvent events[1];
+} TraceBuffer;
+
+typedef struct TraceSpan {
+    const char *name;
+    Tcl_WideInt start;          /* 0 when not tracing */
+} TraceSpan;
+
+static struct {
+    const char *dir;            /* Output directory, NULL when tracing is off */
+    int size;                   /* Ring buffer size in events */
+} trace;
+
+static Ns_Tls traceTls;
+
+static TraceSpan TraceEnter(const char *name);
+static void TraceExit(TraceSpan *spanPtr);
+
+#ifdef __GNUC__
+#define TRACE_STUB TraceSpan traceSpan __attribute__((cleanup(TraceExit))) = TraceEnter(__func__)
+#else
+#define TRACE_STUB
+#endif
+
 static value
 copy_string2(const char *str)
 {
    return copy_string(str ? str : "");
 }
 
+void
+NsOCamlLibInit(void)
+{
+   static int initialized = 0;
+
+   if(initialized) return;
+   Ns_TlsAlloc(&connTls,0);
+   Ns_TlsAlloc(&interpTls,0);
+   Ns_TlsAlloc(&fmtTimeTls,ns_free);
+   Ns_TlsAlloc(&traceTls,ns_free);
+   initialized = 1;
+}
+
+/*
+ * Tcl interp of the stubs when there is no connection interp to use, in
+ * worker threads and outside connections(scheduled procs, jobs, channel
+ * callbacks). One interp serves the whole OCaml execution, so handles
+ * kept in the interp like the ones of ns_http live until it ends.
+ * Released by nsocaml.c when the thread leaves the OCaml runtime.
+ */
+
+void
+NsOCamlReleaseInterp(void)
+{
+   Tcl_Interp *interp = Ns_TlsGet(&interpTls);
+
+   if(interp) {
+     Ns_TclDeAllocateInterp(interp);
+     Ns_TlsSet(&interpTls,0);
+   }
+}
+
+/*
+ * Make the connection current for the calling thread, used by OCaml
+ * worker threads which run requests on behalf of connection threads.
+ * Tcl interps are bound to threads, so the worker gets its own interp
+ * for the request instead of the connection one.
+ */
+
+void
+NsOCamlSetConn(Ns_Conn *conn)
+{
+   NsOCamlReleaseInterp();
+   Ns_TlsSet(&connTls,conn);
+}
+
+static Ns_Conn *
+GetConn()
+{
+   Ns_Conn *conn = Ns_TlsGet(&connTls);
+
+   return conn ? conn : Ns_GetConn();
+}
+
 static const char *
 GetServer()
 {
-   Ns_Conn *conn = Ns_GetConn();
+   Ns_Conn *conn = GetConn();
 
    if(conn) return Ns_ConnServer(conn);
    return nsconf.servers.string;
@@ -52,9 +172,17 @@ GetServer()
 static NsInterp *
 GetInterp()
 {
-   Ns_Conn *conn = Ns_GetConn();
-   if(conn) return NsGetInterpData(Ns_GetConnInterp(conn));
-   return NsGetInterpData(Ns_TclAllocateInterp(GetServer()));
+   NsInterp *itPtr;
+   Tcl_Interp *interp;
+   Ns_Conn *conn = Ns_TlsGet(&connTls);
+
+   if(!conn && (conn = Ns_GetConn())) return NsGetInterpData(Ns_GetConnInterp(conn));
+   if(!(interp = Ns_TlsGet(&interpTls))) {
+     interp = Ns_TclAllocateInterp(GetServer());
+     if(conn && (itPtr = NsGetInterpData(interp))) itPtr->nsconn.flags = 0;
+     Ns_TlsSet(&interpTls,interp);
+   }
+   return NsGetInterpData(interp);
 }
 
 static void
@@ -66,6 +194,7 @@ ThreadArgProc(Tcl_DString *dsPtr, Ns_ThreadProc proc, const void *arg)
 CAMLprim value
 Ns_Eval_OCaml(value oscript)
 {
+    TRACE_STUB;
     CAMLparam1(oscript);
     CAMLlocal1(retval);
     const char *result = "";
@@ -78,13 +207,13 @@ Ns_Eval_OCaml(value oscript)
         result = (char *)Tcl_GetStringResult(itPtr->interp);
     }
     retval = copy_string(result);
-    if(itPtr) Ns_TclDeAllocateInterp(itPtr->interp);
     CAMLreturn(retval);
 }
 
 CAMLprim value
 Ns_Log_OCaml(value olevel,value ostr)
 {
+    TRACE_STUB;
     CAMLparam2(olevel, ostr);
     int clevel = 0;
     char *level = String_val(olevel);
@@ -94,14 +223,72 @@ Ns_Log_OCaml(value olevel,value ostr)
     if(!strcasecmp(level,"Error")) clevel = Error; else
     if(!strcasecmp(level,"Notice")) clevel = Notice; else
     if(!strcasecmp(level,"Warning")) clevel = Warning; else
-    if(!strcasecmp(level,"Fatal")) clevel = Fatal;
+    if(!strcasecmp(level,"Fatal")) clevel = Fatal; else
+    if(!strcasecmp(level,"Bug")) clevel = Bug; else
+    if(!strcasecmp(level,"Dev")) clevel = Dev;
     Ns_Log(clevel, "%s", str);
     CAMLreturn(Val_unit);
 }
 
+/*
+ * Severity variant from naviserver.ml has the same order as Ns_LogSeverity
+ */
+
+CAMLprim value
+Ns_LogEnabled_OCaml(value osev)
+{
+    TRACE_STUB;
+    return Val_bool(Ns_LogSeverityEnabled(Int_val(osev)));
+}
+
+CAMLprim value
+Ns_LogSev_OCaml(value osev,value ostr)
+{
+    TRACE_STUB;
+    CAMLparam2(osev,ostr);
+    Ns_Log(Int_val(osev),"%s",String_val(ostr));
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Message followed by key=value pairs, values with spaces, quotes or =
+ * are quoted. Nothing is formatted when the severity is disabled.
+ */
+
+CAMLprim value
+Ns_LogKv_OCaml(value osev,value ostr,value olist)
+{
+    TRACE_STUB;
+    CAMLparam3(osev,ostr,olist);
+    Ns_DString ds;
+    const char *v;
+
+    if(!Ns_LogSeverityEnabled(Int_val(osev))) CAMLreturn(Val_unit);
+    Ns_DStringInit(&ds);
+    Ns_DStringAppend(&ds,String_val(ostr));
+    for(;olist != Val_emptylist;olist = Field(olist,1)) {
+      v = String_val(Field(Field(olist,0),1));
+      Ns_DStringVarAppend(&ds," ",String_val(Field(Field(olist,0),0)),"=",NULL);
+      if(*v && !strpbrk(v," \t\"=")) {
+        Ns_DStringAppend(&ds,v);
+        continue;
+      }
+      Ns_DStringNAppend(&ds,"\"",1);
+      for(;*v;v++) {
+        if(*v == '"' || *v == '\\') Ns_DStringNAppend(&ds,"\\",1);
+        Ns_DStringNAppend(&ds,v,1);
+      }
+      Ns_DStringNAppend(&ds,"\"",1);
+    }
+    Ns_Log(Int_val(osev),"%s",ds.string);
+    Ns_DStringFree(&ds);
+    CAMLreturn(Val_unit);
+}
+
 CAMLprim value
 Ns_Info_OCaml(value oname)
 {
+    TRACE_STUB;
     CAMLparam1(oname);
     CAMLlocal1(retval);
     Tcl_DString ds;
@@ -456,6 +643,7 @@ ServerListAllCmd(Tcl_DString *dsPtr, Tcl_Interp *interp, int objc, Tcl_Obj *cons
 CAMLprim value
 Ns_Server_OCaml(value oname)
 {
+    TRACE_STUB;
     CAMLparam1(oname);
     CAMLlocal1(retval);
     static CONST char *cmds[] = {
@@ -543,6 +731,7 @@ Ns_Server_OCaml(value oname)
 CAMLprim value
 Ns_Conn_OCaml(value oname)
 {
+    TRACE_STUB;
     CAMLparam1(oname);
     CAMLlocal1(retval);
     int idx;
@@ -580,7 +769,7 @@ Ns_Conn_OCaml(value oname)
     for(opt = 0;cmds[opt];opt++)
       if(!strcmp(cmds[opt],String_val(oname))) break;
 
-    conn = Ns_GetConn();
+    conn = GetConn();
     connPtr = (Conn*)conn;
 
     if(opt != CIsConnectedIdx && !connPtr) CAMLreturn(copy_string(result));
@@ -780,8 +969,9 @@ Ns_Conn_OCaml(value oname)
 CAMLprim value
 Ns_ReturnRedirect_OCaml(value ourl)
 {
+    TRACE_STUB;
     CAMLparam1(ourl);
-    Ns_Conn *conn = Ns_GetConn();
+    Ns_Conn *conn = GetConn();
     if(conn) Ns_ConnReturnRedirect(conn,String_val(ourl));
     CAMLreturn(Val_unit);
 }
@@ -789,8 +979,9 @@ Ns_ReturnRedirect_OCaml(value ourl)
 CAMLprim value
 Ns_ReturnNotFound_OCaml()
 {
+    TRACE_STUB;
     CAMLparam0();
-    Ns_Conn *conn = Ns_GetConn();
+    Ns_Conn *conn = GetConn();
     if(conn) Ns_ConnReturnNotFound(conn);
     CAMLreturn(Val_unit);
 }
@@ -798,8 +989,9 @@ Ns_ReturnNotFound_OCaml()
 CAMLprim value
 Ns_ReturnForbidden_OCaml()
 {
+    TRACE_STUB;
     CAMLparam0();
-    Ns_Conn *conn = Ns_GetConn();
+    Ns_Conn *conn = GetConn();
     if(conn) Ns_ConnReturnForbidden(conn);
     CAMLreturn(Val_unit);
 }
@@ -807,8 +999,9 @@ Ns_ReturnForbidden_OCaml()
 CAMLprim value
 Ns_ReturnUnauthorized_OCaml()
 {
+    TRACE_STUB;
     CAMLparam0();
-    Ns_Conn *conn = Ns_GetConn();
+    Ns_Conn *conn = GetConn();
     if(conn) Ns_ConnReturnUnauthorized(conn);
     CAMLreturn(Val_unit);
 }
@@ -816,26 +1009,403 @@ Ns_ReturnUnauthorized_OCaml()
 CAMLprim value
 Ns_ReturnInternalError_OCaml()
 {
+    TRACE_STUB;
     CAMLparam0();
-    Ns_Conn *conn = Ns_GetConn();
+    Ns_Conn *conn = GetConn();
     if(conn) Ns_ConnReturnInternalError(conn);
     CAMLreturn(Val_unit);
 }
 
+/*
+ * Response compression, NaviServer gzips text sent with the char data
+ * calls when the level of the connection is above 0 and the client
+ * accepts gzip, data sent as binary is never compressed. OCaml handlers
+ * start with the module level, responses shorter than minsize are sent
+ * as is. Precompressed responses are cached by key along with the MD5
+ * of the data they were made from, so changed data is compressed again.
+ */
+
+#define DIGEST_SIZE 33          /* MD5 in hex with the terminating null */
+
+typedef struct Gzipped {
+    size_t srclen;
+    char digest[DIGEST_SIZE];   /* Of the uncompressed data */
+    size_t length;
+    char data[1];
+} Gzipped;
+
+static struct {
+    int level;
+    size_t minsize;
+    Ns_Cache *cache;
+} compress;
+
+void
+NsOCamlCompressInit(int level,size_t minsize,size_t cachesize)
+{
+    compress.level = level;
+    compress.minsize = minsize;
+    if(cachesize > 0) compress.cache = Ns_CacheCreateSz("nsocaml:gzip",TCL_STRING_KEYS,cachesize,ns_free);
+}
+
+void
+NsOCamlCompressConn(Ns_Conn *conn)
+{
+    if(compress.level > 0) Ns_ConnSetCompression(conn,compress.level);
+}
+
+static void
+CompressLength(Ns_Conn *conn,size_t length)
+{
+    if(length < compress.minsize) Ns_ConnSetCompression(conn,0);
+}
+
+static void
+Digest(const char *data,size_t length,char *hex)
+{
+    Ns_CtxMD5 ctx;
+    unsigned char md5[16];
+    int i;
+
+    Ns_CtxMD5Init(&ctx);
+    Ns_CtxMD5Update(&ctx,(const unsigned char*)data,length);
+    Ns_CtxMD5Final(&ctx,md5);
+    for(i = 0;i < 16;i++) snprintf(hex + i * 2,3,"%02x",md5[i]);
+}
+
+/*
+ * Response capture for the response cache of nsocaml.c. The first complete
+ * response of a captured connection is kept with its ETag, which is also
+ * sent to the client, and a matching If-None-Match gets 304 instead of
+ * the body. Anything else sent or ns_response_nocache leaves nothing
+ * to cache.
+ */
+
+typedef struct Capture {
+    bool enabled;
+    NsOCamlResponse *respPtr;
+} Capture;
+
+static struct {
+    Ns_Mutex lock;
+    Tcl_HashTable table;        /* Captures by connection */
+    int initialized;
+} captures;
+
+static Capture *
+GetCapture(Ns_Conn *conn)
+{
+    Tcl_HashEntry *hPtr = 0;
+
+    Ns_MutexLock(&captures.lock);
+    if(captures.initialized && captures.table.numEntries > 0) hPtr = Tcl_FindHashEntry(&captures.table,(char*)conn);
+    Ns_MutexUnlock(&captures.lock);
+    return hPtr ? Tcl_GetHashValue(hPtr) : 0;
+}
+
+void
+NsOCamlFreeResponse(void *arg)
+{
+    NsOCamlResponse *respPtr = arg;
+
+    if(!respPtr) return;
+    ns_free(respPtr->type);
+    if(respPtr->headers) Ns_SetFree(respPtr->headers);
+    ns_free(respPtr);
+}
+
+void
+NsOCamlCaptureBegin(Ns_Conn *conn)
+{
+    Capture *capPtr = ns_calloc(1,sizeof(Capture));
+    Tcl_HashEntry *hPtr;
+    int new;
+
+    capPtr->enabled = NS_TRUE;
+    Ns_MutexLock(&captures.lock);
+    if(!captures.initialized) {
+      Tcl_InitHashTable(&captures.table,TCL_ONE_WORD_KEYS);
+      captures.initialized = 1;
+    }
+    hPtr = Tcl_CreateHashEntry(&captures.table,(char*)conn,&new);
+    Tcl_SetHashValue(hPtr,capPtr);
+    Ns_MutexUnlock(&captures.lock);
+}
+
+NsOCamlResponse *
+NsOCamlCaptureEnd(Ns_Conn *conn)
+{
+    NsOCamlResponse *respPtr = 0;
+    Tcl_HashEntry *hPtr = 0;
+    Capture *capPtr;
+
+    Ns_MutexLock(&captures.lock);
+    if(captures.initialized && (hPtr = Tcl_FindHashEntry(&captures.table,(char*)conn))) {
+      capPtr = Tcl_GetHashValue(hPtr);
+      Tcl_DeleteHashEntry(hPtr);
+    }
+    Ns_MutexUnlock(&captures.lock);
+    if(!hPtr) return 0;
+    if(capPtr->enabled && capPtr->respPtr && capPtr->respPtr->status == 200) {
+      respPtr = capPtr->respPtr;
+    } else {
+      NsOCamlFreeResponse(capPtr->respPtr);
+    }
+    ns_free(capPtr);
+    return respPtr;
+}
+
+static bool
+NotModified(Ns_Conn *conn,const char *etag)
+{
+    const char *match = Ns_SetIGet(conn->headers,"If-None-Match");
+
+    return match && (!strcmp(match,"*") || strstr(match,etag));
+}
+
+/*
+ * Responses setting cookies or marked private or no-store by the page
+ * must not be served to other clients
+ */
+
+static bool
+Cacheable(const Ns_Set *headers)
+{
+    const char *key, *v;
+    size_t i;
+
+    for(i = 0;i < Ns_SetSize(headers);i++) {
+      key = Ns_SetKey(headers,i);
+      if(!strcasecmp(key,"Set-Cookie")) return NS_FALSE;
+      if(strcasecmp(key,"Cache-Control")) continue;
+      for(v = Ns_SetValue(headers,i);v && *v;v++) {
+        if(!strncasecmp(v,"private",7) || !strncasecmp(v,"no-store",8)) return NS_FALSE;
+      }
+    }
+    return NS_TRUE;
+}
+
+/*
+ * Called by the return stubs before sending, returns NS_TRUE when 304
+ * has been sent instead
+ */
+
+static bool
+CaptureResponse(Ns_Conn *conn,int status,const char *type,struct iovec *iov,int n)
+{
+    Capture *capPtr = GetCapture(conn);
+    NsOCamlResponse *respPtr;
+    size_t length = 0;
+    char *p, digest[DIGEST_SIZE];
+    int i;
+
+    if(!capPtr || !capPtr->enabled) return NS_FALSE;
+    if(capPtr->respPtr || !Cacheable(conn->outputheaders)) {
+      capPtr->enabled = NS_FALSE;
+      return NS_FALSE;
+    }
+    for(i = 0;i < n;i++) length += iov[i].iov_len;
+    respPtr = ns_malloc(sizeof(NsOCamlResponse) + length);
+    respPtr->status = status;
+    respPtr->type = ns_strdup(type);
+    respPtr->headers = Ns_SetCopy(conn->outputheaders);
+    respPtr->length = length;
+    for(i = 0,p = respPtr->data;i < n;p += iov[i].iov_len,i++) memcpy(p,iov[i].iov_base,iov[i].iov_len);
+    Digest(respPtr->data,length,digest);
+    snprintf(respPtr->etag,sizeof(respPtr->etag),"\"%s\"",digest);
+    capPtr->respPtr = respPtr;
+
+    Ns_ConnSetHeaders(conn,"ETag",respPtr->etag);
+    if(status != 200 || !NotModified(conn,respPtr->etag)) return NS_FALSE;
+    Ns_ConnReturnNotModified(conn);
+    return NS_TRUE;
+}
+
+/*
+ * Sends the cached response, 304 when the client has it already
+ */
+
+Ns_ReturnCode
+NsOCamlReturnResponse(Ns_Conn *conn,const NsOCamlResponse *respPtr)
+{
+    size_t i;
+
+    for(i = 0;i < Ns_SetSize(respPtr->headers);i++)
+      Ns_ConnSetHeaders(conn,Ns_SetKey(respPtr->headers,i),Ns_SetValue(respPtr->headers,i));
+    Ns_ConnSetHeaders(conn,"ETag",respPtr->etag);
+    if(NotModified(conn,respPtr->etag)) return Ns_ConnReturnNotModified(conn);
+    NsOCamlCompressConn(conn);
+    CompressLength(conn,respPtr->length);
+    return Ns_ConnReturnCharData(conn,respPtr->status,respPtr->data,(ssize_t)respPtr->length,respPtr->type);
+}
+
+/*
+ * Keeps the current response out of the response cache
+ */
+
+CAMLprim value
+Ns_ResponseNoCache_OCaml(value unit)
+{
+    TRACE_STUB;
+    CAMLparam1(unit);
+    Ns_Conn *conn = GetConn();
+    Capture *capPtr = conn ? GetCapture(conn) : 0;
+
+    if(capPtr) capPtr->enabled = NS_FALSE;
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Drops cached responses of the page url, all of them for empty url
+ */
+
+CAMLprim value
+Ns_ResponseCacheFlush_OCaml(value ourl)
+{
+    TRACE_STUB;
+    CAMLparam1(ourl);
+    NsOCamlResponseFlush(String_val(ourl));
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Compression level of the current response, 0 sends it uncompressed
+ */
+
+CAMLprim value
+Ns_Compress_OCaml(value olevel)
+{
+    TRACE_STUB;
+    CAMLparam1(olevel);
+    Ns_Conn *conn = GetConn();
+    int level = Int_val(olevel);
+
+    if(level < 0 || level > 9) caml_invalid_argument("ns_compress: level must be 0..9");
+    if(conn) Ns_ConnSetCompression(conn,level);
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Returns data gzipped from the cache when the client accepts gzip,
+ * compression runs only when the data for the key has changed
+ */
+
+CAMLprim value
+Ns_ReturnPrecompressed_OCaml(value okey,value ostatus,value otype,value odata)
+{
+    TRACE_STUB;
+    CAMLparam4(okey,ostatus,otype,odata);
+    Ns_Conn *conn = GetConn();
+    size_t length = caml_string_length(odata);
+    char digest[DIGEST_SIZE];
+    struct iovec iov;
+    Gzipped *gzPtr;
+    Ns_Entry *entry;
+    Ns_DString ds;
+    int new, level;
+
+    if(!conn) CAMLreturn(Val_unit);
+    iov.iov_base = (void*)String_val(odata);
+    iov.iov_len = length;
+    if(CaptureResponse(conn,Int_val(ostatus),String_val(otype),&iov,1)) CAMLreturn(Val_unit);
+    Ns_ConnSetHeaders(conn,"Vary","Accept-Encoding");
+    if(!compress.cache || length < compress.minsize || !(conn->flags & NS_CONN_ZIPACCEPTED)) {
+      CompressLength(conn,length);
+      Ns_ConnReturnCharData(conn,Int_val(ostatus),String_val(odata),(ssize_t)length,String_val(otype));
+      CAMLreturn(Val_unit);
+    }
+    Digest(String_val(odata),length,digest);
+    Ns_DStringInit(&ds);
+    Ns_CacheLock(compress.cache);
+    if((entry = Ns_CacheFindEntry(compress.cache,String_val(okey))) &&
+       (gzPtr = Ns_CacheGetValue(entry)) && gzPtr->srclen == length && !strcmp(gzPtr->digest,digest)) {
+      Ns_DStringNAppend(&ds,gzPtr->data,(int)gzPtr->length);
+    }
+    Ns_CacheUnlock(compress.cache);
+
+    if(ds.length == 0) {
+      level = Ns_ConnGetCompression(conn) > 0 ? Ns_ConnGetCompression(conn) : 6;
+      if(Ns_CompressGzip(String_val(odata),(int)length,&ds,level) != NS_OK) {
+        Ns_DStringFree(&ds);
+        caml_failwith("ns_return_precompressed: compression failed");
+      }
+      gzPtr = ns_malloc(sizeof(Gzipped) + (size_t)ds.length);
+      gzPtr->srclen = length;
+      memcpy(gzPtr->digest,digest,DIGEST_SIZE);
+      gzPtr->length = (size_t)ds.length;
+      memcpy(gzPtr->data,ds.string,gzPtr->length);
+      Ns_CacheLock(compress.cache);
+      entry = Ns_CacheCreateEntry(compress.cache,String_val(okey),&new);
+      Ns_CacheSetValueSz(entry,gzPtr,sizeof(Gzipped) + gzPtr->length);
+      Ns_CacheUnlock(compress.cache);
+    }
+    Ns_ConnSetCompression(conn,0);
+    Ns_ConnSetHeaders(conn,"Content-Encoding","gzip");
+    Ns_ConnReturnData(conn,Int_val(ostatus),ds.string,ds.length,String_val(otype));
+    Ns_DStringFree(&ds);
+    CAMLreturn(Val_unit);
+}
+
 CAMLprim value
 Ns_Return_OCaml(value ostatus,value otype,value odata)
 {
+    TRACE_STUB;
     CAMLparam3(ostatus,otype,odata);
-    Ns_Conn *conn = Ns_GetConn();
-    if(conn) Ns_ConnReturnData(conn,Int_val(ostatus),String_val(odata),strlen(String_val(odata)),String_val(otype));
+    Ns_Conn *conn = GetConn();
+    struct iovec iov;
+
+    if(conn) {
+      iov.iov_base = (void*)String_val(odata);
+      iov.iov_len = strlen(String_val(odata));
+      if(CaptureResponse(conn,Int_val(ostatus),String_val(otype),&iov,1)) CAMLreturn(Val_unit);
+      CompressLength(conn,iov.iov_len);
+      Ns_ConnReturnCharData(conn,Int_val(ostatus),iov.iov_base,(ssize_t)iov.iov_len,String_val(otype));
+    }
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Sends the response made of several strings in one vectored write,
+ * nothing is concatenated or copied. Content-Length is set by the write
+ * from what is actually sent, which is less when compressed.
+ */
+
+CAMLprim value
+Ns_ReturnV_OCaml(value ostatus,value otype,value oparts)
+{
+    TRACE_STUB;
+    CAMLparam3(ostatus,otype,oparts);
+    struct iovec vbuf[32], *iov = vbuf;
+    int i, n = Wosize_val(oparts);
+    size_t length = 0;
+    Ns_Conn *conn = GetConn();
+
+    if(!conn) CAMLreturn(Val_unit);
+    if(n > 32) iov = ns_malloc(n * sizeof(struct iovec));
+    for(i = 0;i < n;i++) {
+      iov[i].iov_base = String_val(Field(oparts,i));
+      iov[i].iov_len = caml_string_length(Field(oparts,i));
+      length += iov[i].iov_len;
+    }
+    if(CaptureResponse(conn,Int_val(ostatus),String_val(otype),iov,n)) {
+      if(iov != vbuf) ns_free(iov);
+      CAMLreturn(Val_unit);
+    }
+    Ns_ConnSetTypeHeader(conn,String_val(otype));
+    Ns_ConnSetResponseStatus(conn,Int_val(ostatus));
+    CompressLength(conn,length);
+    Ns_ConnWriteVChars(conn,iov,n,0);
+    Ns_ConnClose(conn);
+    if(iov != vbuf) ns_free(iov);
     CAMLreturn(Val_unit);
 }
 
 CAMLprim value
 Ns_ReturnFile_OCaml(value ostatus,value otype,value ofile)
 {
+    TRACE_STUB;
     CAMLparam3(ostatus,otype,ofile);
-    Ns_Conn *conn = Ns_GetConn();
+    Ns_Conn *conn = GetConn();
     if(conn) Ns_ConnReturnFile(conn,Int_val(ostatus),String_val(otype),String_val(ofile));
     CAMLreturn(Val_unit);
 }
@@ -843,18 +1413,70 @@ Ns_ReturnFile_OCaml(value ostatus,value otype,value ofile)
 CAMLprim value
 Ns_Write_OCaml(value ostr)
 {
+    TRACE_STUB;
     CAMLparam1(ostr);
-    Ns_Conn *conn = Ns_GetConn();
+    Ns_Conn *conn = GetConn();
     if(conn) Ns_ConnPuts(conn,String_val(ostr));
     CAMLreturn(Val_unit);
 }
 
+/*
+ * Streamed responses, headers go out with the first write without
+ * Content-Length, so HTTP/1.1 clients get chunked encoding, and every
+ * write is sent right away, gzipped and flushed chunk by chunk when
+ * compressed. False means the client has gone.
+ */
+
+CAMLprim value
+Ns_StreamStart_OCaml(value ostatus,value otype,value oheaders)
+{
+    TRACE_STUB;
+    CAMLparam3(ostatus,otype,oheaders);
+    Ns_Conn *conn = GetConn();
+
+    if(!conn) CAMLreturn(Val_false);
+    for(;oheaders != Val_emptylist;oheaders = Field(oheaders,1))
+      Ns_ConnSetHeaders(conn,String_val(Field(Field(oheaders,0),0)),String_val(Field(Field(oheaders,0),1)));
+    Ns_ConnSetTypeHeader(conn,String_val(otype));
+    Ns_ConnSetResponseStatus(conn,Int_val(ostatus));
+    CAMLreturn(Val_bool(Ns_ConnWriteVChars(conn,0,0,NS_CONN_STREAM) == NS_OK));
+}
+
+CAMLprim value
+Ns_StreamWrite_OCaml(value odata)
+{
+    TRACE_STUB;
+    CAMLparam1(odata);
+    struct iovec iov;
+    Ns_Conn *conn = GetConn();
+
+    if(!conn) CAMLreturn(Val_false);
+    iov.iov_base = (void*)String_val(odata);
+    iov.iov_len = caml_string_length(odata);
+    CAMLreturn(Val_bool(Ns_ConnWriteVChars(conn,&iov,1,NS_CONN_STREAM) == NS_OK));
+}
+
+/*
+ * True once the response has been sent or its headers went out
+ */
+
+CAMLprim value
+Ns_ConnSent_OCaml(value unit)
+{
+    TRACE_STUB;
+    CAMLparam1(unit);
+    Ns_Conn *conn = GetConn();
+
+    CAMLreturn(Val_bool(!conn || (conn->flags & (NS_CONN_CLOSED|NS_CONN_SENTHDRS))));
+}
+
 CAMLprim value
 Ns_QueryExists_OCaml(value ostr)
 {
+    TRACE_STUB;
     CAMLparam1(ostr);
     int result = -1;
-    Ns_Conn *conn = Ns_GetConn();
+    Ns_Conn *conn = GetConn();
     Ns_Set *form = conn ? Ns_ConnGetQuery(NULL, conn, NULL, NULL) : 0;
     if(form) result = Ns_SetIFind(form,String_val(ostr));
     CAMLreturn(Val_int((result >= 0)));
@@ -863,10 +1485,11 @@ Ns_QueryExists_OCaml(value ostr)
 CAMLprim value
 Ns_QueryGet_OCaml(value ostr)
 {
+    TRACE_STUB;
     CAMLparam1(ostr);
     CAMLlocal1(retval);
     char *result = "";
-    Ns_Conn *conn = Ns_GetConn();
+    Ns_Conn *conn = GetConn();
     Ns_Set *form = conn ? Ns_ConnGetQuery(NULL, conn, NULL, NULL) : 0;
     if(form) result = Ns_SetIGet(form,String_val(ostr));
     retval = copy_string2(result);
@@ -876,10 +1499,11 @@ Ns_QueryGet_OCaml(value ostr)
 CAMLprim value
 Ns_QueryGetAll_OCaml(value ostr)
 {
+    TRACE_STUB;
     CAMLparam1(ostr);
     CAMLlocal3(result,nrec,orec);
     int i;
-    Ns_Conn *conn = Ns_GetConn();
+    Ns_Conn *conn = GetConn();
     Ns_Set *form = conn ? Ns_ConnGetQuery(NULL, conn, NULL, NULL) : 0;
 
     result = Val_int(0); /* [] */
@@ -895,13 +1519,74 @@ Ns_QueryGetAll_OCaml(value ostr)
     CAMLreturn(result);
 }
 
+/*
+ * Url encoding, letters, digits and -._ are never escaped so strings made
+ * only of them are returned without any copy. They are recognized 16
+ * bytes at a time with SSE2, which is the common case for ids and names.
+ */
+
+static const unsigned char urlClean[256] = {
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1, ['J'] = 1,
+    ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1,
+    ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1, ['j'] = 1,
+    ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1,
+    ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+    ['-'] = 1, ['.'] = 1, ['_'] = 1
+};
+
+static int
+UrlClean(value ostr)
+{
+    const unsigned char *s = (const unsigned char*)String_val(ostr);
+    size_t i = 0, len = caml_string_length(ostr);
+#ifdef __SSE2__
+    __m128i b, l, m;
+
+    for(;i + 16 <= len;i += 16) {
+      b = _mm_loadu_si128((const __m128i*)(s + i));
+      // Bytes over 0x7f are negative and fail both range checks
+      m = _mm_and_si128(_mm_cmpgt_epi8(b,_mm_set1_epi8('0' - 1)),_mm_cmplt_epi8(b,_mm_set1_epi8('9' + 1)));
+      l = _mm_or_si128(b,_mm_set1_epi8(0x20));
+      m = _mm_or_si128(m,_mm_and_si128(_mm_cmpgt_epi8(l,_mm_set1_epi8('a' - 1)),_mm_cmplt_epi8(l,_mm_set1_epi8('z' + 1))));
+      m = _mm_or_si128(m,_mm_cmpeq_epi8(b,_mm_set1_epi8('-')));
+      m = _mm_or_si128(m,_mm_cmpeq_epi8(b,_mm_set1_epi8('.')));
+      m = _mm_or_si128(m,_mm_cmpeq_epi8(b,_mm_set1_epi8('_')));
+      if(_mm_movemask_epi8(m) != 0xffff) return 0;
+    }
+#endif
+    while(i < len && urlClean[s[i]]) i++;
+    return i == len;
+}
+
+static void
+UrlEncode(Ns_DString *dsPtr,value ostr)
+{
+    if(UrlClean(ostr)) {
+      Ns_DStringNAppend(dsPtr,String_val(ostr),caml_string_length(ostr));
+    } else {
+      Ns_UrlQueryEncode(dsPtr,String_val(ostr),NS_utf8Encoding);
+    }
+}
+
+static int
+UrlDecodeClean(value ostr)
+{
+    size_t len = caml_string_length(ostr);
+
+    return !memchr(String_val(ostr),'%',len) && !memchr(String_val(ostr),'+',len);
+}
+
 CAMLprim value
 Ns_UrlEncode_OCaml(value ostr)
 {
+    TRACE_STUB;
     CAMLparam1(ostr);
     CAMLlocal1(retval);
     Ns_DString ds;
 
+    if(UrlClean(ostr)) CAMLreturn(ostr);
     Ns_DStringInit(&ds);
 
     Ns_UrlQueryEncode(&ds, String_val(ostr), NS_utf8Encoding);
@@ -913,10 +1598,12 @@ Ns_UrlEncode_OCaml(value ostr)
 CAMLprim value
 Ns_UrlDecode_OCaml(value ostr)
 {
+    TRACE_STUB;
     CAMLparam1(ostr);
     CAMLlocal1(retval);
     Ns_DString ds;
 
+    if(UrlDecodeClean(ostr)) CAMLreturn(ostr);
     Ns_DStringInit(&ds);
     Ns_UrlQueryDecode(&ds,String_val(ostr),NS_utf8Encoding);
     retval = copy_string(ds.string);
@@ -924,29 +1611,261 @@ Ns_UrlDecode_OCaml(value ostr)
     CAMLreturn(retval);
 }
 
-CAMLprim value
-Ns_Config_OCaml(value osection,value okey)
+/*
+ * Encodes or decodes all strings of the array in one call, clean strings
+ * are shared with the argument
+ */
+
+static value
+UrlCodeArray(value oarray,int encode)
 {
-    CAMLparam2(osection,okey);
-    CAMLlocal1(retval);
-    const char *result = Ns_ConfigGetValue(String_val(osection),String_val(okey));
-    retval = copy_string2(result);
+    CAMLparam1(oarray);
+    CAMLlocal2(retval,ostr);
+    mlsize_t i, n = Wosize_val(oarray);
+    Ns_DString ds;
+
+    Ns_DStringInit(&ds);
+    retval = caml_alloc(n,0);
+    for(i = 0;i < n;i++) {
+      ostr = Field(oarray,i);
+      if(encode ? !UrlClean(ostr) : !UrlDecodeClean(ostr)) {
+        Ns_DStringSetLength(&ds,0);
+        if(encode) {
+          Ns_UrlQueryEncode(&ds,String_val(ostr),NS_utf8Encoding);
+        } else {
+          Ns_UrlQueryDecode(&ds,String_val(ostr),NS_utf8Encoding);
+        }
+        ostr = copy_string(ds.string);
+      }
+      Store_field(retval,i,ostr);
+    }
+    Ns_DStringFree(&ds);
     CAMLreturn(retval);
 }
 
 CAMLprim value
-Ns_GuessType_OCaml(value otype)
+Ns_UrlEncodeArray_OCaml(value oarray)
 {
-    CAMLparam1(otype);
-    CAMLlocal1(retval);
+    TRACE_STUB;
+    return UrlCodeArray(oarray,1);
+}
+
+CAMLprim value
+Ns_UrlDecodeArray_OCaml(value oarray)
+{
+    TRACE_STUB;
+    return UrlCodeArray(oarray,0);
+}
+
+/*
+ * Builds the whole query string key=value&... from the list of pairs
+ */
+
+CAMLprim value
+Ns_UrlEncodeQuery_OCaml(value olist)
+{
+    TRACE_STUB;
+    CAMLparam1(olist);
+    CAMLlocal1(retval);
+    Ns_DString ds;
+
+    Ns_DStringInit(&ds);
+    for(;olist != Val_emptylist;olist = Field(olist,1)) {
+      if(ds.length) Ns_DStringNAppend(&ds,"&",1);
+      UrlEncode(&ds,Field(Field(olist,0),0));
+      Ns_DStringNAppend(&ds,"=",1);
+      UrlEncode(&ds,Field(Field(olist,0),1));
+    }
+    retval = copy_string(ds.string);
+    Ns_DStringFree(&ds);
+    CAMLreturn(retval);
+}
+
+/*
+ * Writes encoded string to the connection without creating OCaml string
+ */
+
+CAMLprim value
+Ns_WriteUrlEncode_OCaml(value ostr)
+{
+    TRACE_STUB;
+    CAMLparam1(ostr);
+    Ns_DString ds;
+    Ns_Conn *conn = GetConn();
+
+    if(!conn) CAMLreturn(Val_unit);
+    if(UrlClean(ostr)) {
+      Ns_ConnWriteData(conn,String_val(ostr),caml_string_length(ostr),0);
+    } else {
+      Ns_DStringInit(&ds);
+      Ns_UrlQueryEncode(&ds,String_val(ostr),NS_utf8Encoding);
+      Ns_ConnWriteData(conn,ds.string,ds.length,0);
+      Ns_DStringFree(&ds);
+    }
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+Ns_Config_OCaml(value osection,value okey)
+{
+    TRACE_STUB;
+    CAMLparam2(osection,okey);
+    CAMLlocal1(retval);
+    const char *result = Ns_ConfigGetValue(String_val(osection),String_val(okey));
+    retval = copy_string2(result);
+    CAMLreturn(retval);
+}
+
+CAMLprim value
+Ns_GuessType_OCaml(value otype)
+{
+    TRACE_STUB;
+    CAMLparam1(otype);
+    CAMLlocal1(retval);
     const char *result = Ns_GetMimeType(String_val(otype));
     retval = copy_string2(result);
     CAMLreturn(retval);
 }
 
+/*
+ * HTML quoting and stripping, spans without special characters are
+ * skipped 16 bytes at a time when SSE2 is available and copied in bulk.
+ * Both run twice, first to get the result length, then to fill the
+ * OCaml string allocated for it.
+ */
+
+static const unsigned char quoteTable[256] = {
+    ['<'] = 1, ['>'] = 1, ['&'] = 1, ['\''] = 1, ['"'] = 1
+};
+
+static const unsigned char stripTable[256] = {
+    ['<'] = 1, ['>'] = 1, ['&'] = 1, [';'] = 1
+};
+
+static size_t
+HtmlSpan(const unsigned char *s,size_t len,const char *chars,const unsigned char *table)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i c[8], b, m;
+    int k, n, mask;
+
+    for(n = 0;chars[n];n++) c[n] = _mm_set1_epi8(chars[n]);
+    for(;i + 16 <= len;i += 16) {
+      b = _mm_loadu_si128((const __m128i*)(s + i));
+      m = _mm_cmpeq_epi8(b,c[0]);
+      for(k = 1;k < n;k++) m = _mm_or_si128(m,_mm_cmpeq_epi8(b,c[k]));
+      if((mask = _mm_movemask_epi8(m))) return i + __builtin_ctz(mask);
+    }
+#endif
+    while(i < len && !table[s[i]]) i++;
+    return i;
+}
+
+static size_t
+QuoteHtml(const unsigned char *s,size_t len,char *out)
+{
+    size_t i = 0, n = 0, span, elen;
+    const char *entity;
+
+    while(i < len) {
+      span = HtmlSpan(s + i,len - i,"<>&'\"",quoteTable);
+      if(out) memcpy(out + n,s + i,span);
+      n += span;
+      if((i += span) == len) break;
+      switch(s[i++]) {
+       case '<': entity = "&lt;"; break;
+       case '>': entity = "&gt;"; break;
+       case '&': entity = "&amp;"; break;
+       case '\'': entity = "&#39;"; break;
+       default: entity = "&#34;"; break;
+      }
+      elen = strlen(entity);
+      if(out) memcpy(out + n,entity,elen);
+      n += elen;
+    }
+    return n;
+}
+
+static size_t
+StripHtml(const unsigned char *s,size_t len,char *out)
+{
+    int inTag = 0, inSpec = 0;
+    size_t i = 0, n = 0, span, e;
+
+    while(i < len) {
+      // Only these characters change the state, the rest is copied or dropped
+      span = HtmlSpan(s + i,len - i,"<>&;",stripTable);
+      if(!inTag && !inSpec) {
+        if(out) memcpy(out + n,s + i,span);
+        n += span;
+      }
+      if((i += span) == len) break;
+      if(s[i] == '<') {
+        inTag = 1;
+      } else
+      if(inTag && s[i] == '>') {
+        inTag = 0;
+      } else
+      if(inSpec && s[i] == ';') {
+        inSpec = 0;
+      } else
+      if(!inTag && !inSpec) {
+        if(s[i] == '&') {
+          for(e = i + 1;e < len && s[e] != ' ' && s[e] != ';' && s[e] != '&';e++);
+          inSpec = (e < len && s[e] == ';');
+        }
+        if(!inSpec) {
+          if(out) out[n] = s[i];
+          n++;
+        }
+      }
+      i++;
+    }
+    return n;
+}
+
 CAMLprim value
 Ns_QuoteHtml_OCaml(value ostr)
 {
+    TRACE_STUB;
+    CAMLparam1(ostr);
+    CAMLlocal1(retval);
+    size_t len = caml_string_length(ostr);
+    size_t n = QuoteHtml((const unsigned char*)String_val(ostr),len,0);
+
+    // Strings are immutable, nothing to quote means no copy
+    if(n == len) CAMLreturn(ostr);
+    retval = caml_alloc_string(n);
+    QuoteHtml((const unsigned char*)String_val(ostr),len,(char*)Bytes_val(retval));
+    CAMLreturn(retval);
+}
+
+CAMLprim value
+Ns_StripHtml_OCaml(value ostr)
+{
+    TRACE_STUB;
+    CAMLparam1(ostr);
+    CAMLlocal1(retval);
+    size_t len = caml_string_length(ostr);
+    size_t n = StripHtml((const unsigned char*)String_val(ostr),len,0);
+
+    if(n == len) CAMLreturn(ostr);
+    retval = caml_alloc_string(n);
+    StripHtml((const unsigned char*)String_val(ostr),len,(char*)Bytes_val(retval));
+    CAMLreturn(retval);
+}
+
+/*
+ * Previous scalar implementations, Ns_QuoteHtml into a DString and the
+ * strip loop over a C string copy, kept as the reference for
+ * test/ns_html.ml and the shim tests
+ */
+
+CAMLprim value
+Ns_QuoteHtmlScalar_OCaml(value ostr)
+{
+    TRACE_STUB;
     CAMLparam1(ostr);
     CAMLlocal1(retval);
     Ns_DString ds;
@@ -959,8 +1878,9 @@ Ns_QuoteHtml_OCaml(value ostr)
 }
 
 CAMLprim value
-Ns_StripHtml_OCaml(value ostr)
+Ns_StripHtmlScalar_OCaml(value ostr)
 {
+    TRACE_STUB;
     CAMLparam1(ostr);
     CAMLlocal1(retval);
     int inTag = 0, inSpec = 0;
@@ -1009,6 +1929,7 @@ Ns_StripHtml_OCaml(value ostr)
 CAMLprim value
 Ns_SetCleanup_OCaml()
 {
+    TRACE_STUB;
     CAMLparam0();
     NsInterp *itPtr;
     Tcl_HashEntry *hPtr;
@@ -1032,6 +1953,7 @@ Ns_SetCleanup_OCaml()
 CAMLprim value
 Ns_SetList_OCaml()
 {
+    TRACE_STUB;
     CAMLparam0();
     CAMLlocal3(result,nrec,orec);
     NsInterp *itPtr;
@@ -1056,6 +1978,7 @@ Ns_SetList_OCaml()
 CAMLprim value
 Ns_SetNew_OCaml(value oname)
 {
+    TRACE_STUB;
     CAMLparam1(oname);
     CAMLlocal1(retval);
     Ns_Set *set;
@@ -1075,6 +1998,7 @@ Ns_SetNew_OCaml(value oname)
 CAMLprim value
 Ns_SetCopy_OCaml(value oname)
 {
+    TRACE_STUB;
     CAMLparam1(oname);
     CAMLlocal1(retval);
     Ns_Set *set;
@@ -1093,6 +2017,7 @@ Ns_SetCopy_OCaml(value oname)
 CAMLprim value
 Ns_SetSplit_OCaml(value oname)
 {
+    TRACE_STUB;
     CAMLparam1(oname);
     int i;
     NsInterp *itPtr;
@@ -1110,6 +2035,7 @@ Ns_SetSplit_OCaml(value oname)
 CAMLprim value
 Ns_SetArray_OCaml(value oname)
 {
+    TRACE_STUB;
     CAMLparam1(oname);
     CAMLlocal3(result,nrec,orec);
     int i;
@@ -1138,6 +2064,7 @@ Ns_SetArray_OCaml(value oname)
 CAMLprim value
 Ns_SetSize_OCaml(value oname)
 {
+    TRACE_STUB;
     CAMLparam1(oname);
     NsInterp *itPtr;
     Ns_Set *set;
@@ -1150,6 +2077,7 @@ Ns_SetSize_OCaml(value oname)
 CAMLprim value
 Ns_SetName_OCaml(value oname)
 {
+    TRACE_STUB;
     CAMLparam1(oname);
     CAMLlocal1(retval);
     NsInterp *itPtr;
@@ -1163,6 +2091,7 @@ Ns_SetName_OCaml(value oname)
 CAMLprim value
 Ns_SetPrint_OCaml(value oname)
 {
+    TRACE_STUB;
     CAMLparam1(oname);
     NsInterp *itPtr;
     Ns_Set *set;
@@ -1176,6 +2105,7 @@ Ns_SetPrint_OCaml(value oname)
 CAMLprim value
 Ns_SetFree_OCaml(value oname)
 {
+    TRACE_STUB;
     CAMLparam1(oname);
     NsInterp *itPtr;
 
@@ -1186,6 +2116,7 @@ Ns_SetFree_OCaml(value oname)
 CAMLprim value
 Ns_SetFind_OCaml(value oname,value okey)
 {
+    TRACE_STUB;
     CAMLparam2(oname,okey);
     NsInterp *itPtr;
     Ns_Set *set;
@@ -1198,6 +2129,7 @@ Ns_SetFind_OCaml(value oname,value okey)
 CAMLprim value
 Ns_SetIFind_OCaml(value oname,value okey)
 {
+    TRACE_STUB;
     CAMLparam2(oname,okey);
     NsInterp *itPtr;
     Ns_Set *set;
@@ -1210,6 +2142,7 @@ Ns_SetIFind_OCaml(value oname,value okey)
 CAMLprim value
 Ns_SetUnique_OCaml(value oname,value okey)
 {
+    TRACE_STUB;
     CAMLparam2(oname,okey);
     NsInterp *itPtr;
     Ns_Set *set;
@@ -1222,6 +2155,7 @@ Ns_SetUnique_OCaml(value oname,value okey)
 CAMLprim value
 Ns_SetIUnique_OCaml(value oname,value okey)
 {
+    TRACE_STUB;
     CAMLparam2(oname,okey);
     NsInterp *itPtr;
     Ns_Set *set;
@@ -1234,6 +2168,7 @@ Ns_SetIUnique_OCaml(value oname,value okey)
 CAMLprim value
 Ns_SetDelKey_OCaml(value oname,value okey)
 {
+    TRACE_STUB;
     CAMLparam2(oname,okey);
     NsInterp *itPtr;
     Ns_Set *set;
@@ -1247,6 +2182,7 @@ Ns_SetDelKey_OCaml(value oname,value okey)
 CAMLprim value
 Ns_SetIDelKey_OCaml(value oname,value okey)
 {
+    TRACE_STUB;
     CAMLparam2(oname,okey);
     NsInterp *itPtr;
     Ns_Set *set;
@@ -1260,6 +2196,7 @@ Ns_SetIDelKey_OCaml(value oname,value okey)
 CAMLprim value
 Ns_SetGet_OCaml(value oname,value okey)
 {
+    TRACE_STUB;
     CAMLparam2(oname,okey);
     CAMLlocal1(retval);
     Ns_Set *set;
@@ -1275,6 +2212,7 @@ Ns_SetGet_OCaml(value oname,value okey)
 CAMLprim value
 Ns_SetIGet_OCaml(value oname,value okey)
 {
+    TRACE_STUB;
     CAMLparam2(oname,okey);
     CAMLlocal1(retval);
     Ns_Set *set;
@@ -1290,6 +2228,7 @@ Ns_SetIGet_OCaml(value oname,value okey)
 CAMLprim value
 Ns_SetValue_OCaml(value oname,value oidx)
 {
+    TRACE_STUB;
     CAMLparam2(oname,oidx);
     CAMLlocal1(retval);
     Ns_Set *set;
@@ -1307,6 +2246,7 @@ Ns_SetValue_OCaml(value oname,value oidx)
 CAMLprim value
 Ns_SetIsNull_OCaml(value oname,value oidx)
 {
+    TRACE_STUB;
     CAMLparam2(oname,oidx);
     Ns_Set *set;
     NsInterp *itPtr;
@@ -1321,6 +2261,7 @@ Ns_SetIsNull_OCaml(value oname,value oidx)
 CAMLprim value
 Ns_SetKey_OCaml(value oname,value oidx)
 {
+    TRACE_STUB;
     CAMLparam2(oname,oidx);
     CAMLlocal1(retval);
     Ns_Set *set;
@@ -1337,6 +2278,7 @@ Ns_SetKey_OCaml(value oname,value oidx)
 CAMLprim value
 Ns_SetDelete_OCaml(value oname,value oidx)
 {
+    TRACE_STUB;
     CAMLparam2(oname,oidx);
     Ns_Set *set;
     NsInterp *itPtr;
@@ -1351,6 +2293,7 @@ Ns_SetDelete_OCaml(value oname,value oidx)
 CAMLprim value
 Ns_SetTrunc_OCaml(value oname,value oidx)
 {
+    TRACE_STUB;
     CAMLparam2(oname,oidx);
     Ns_Set *set;
     NsInterp *itPtr;
@@ -1365,6 +2308,7 @@ Ns_SetTrunc_OCaml(value oname,value oidx)
 CAMLprim value
 Ns_SetUpdate_OCaml(value oname,value okey,value ovalue)
 {
+    TRACE_STUB;
     CAMLparam3(oname,okey,ovalue);
     Ns_Set *set;
     NsInterp *itPtr;
@@ -1380,6 +2324,7 @@ Ns_SetUpdate_OCaml(value oname,value okey,value ovalue)
 CAMLprim value
 Ns_SetICPut_OCaml(value oname,value okey,value ovalue)
 {
+    TRACE_STUB;
     CAMLparam3(oname,okey,ovalue);
     Ns_Set *set;
     NsInterp *itPtr;
@@ -1395,6 +2340,7 @@ Ns_SetICPut_OCaml(value oname,value okey,value ovalue)
 CAMLprim value
 Ns_SetCPut_OCaml(value oname,value okey,value ovalue)
 {
+    TRACE_STUB;
     CAMLparam3(oname,okey,ovalue);
     Ns_Set *set;
     NsInterp *itPtr;
@@ -1410,6 +2356,7 @@ Ns_SetCPut_OCaml(value oname,value okey,value ovalue)
 CAMLprim value
 Ns_SetPut_OCaml(value oname,value okey,value ovalue)
 {
+    TRACE_STUB;
     CAMLparam3(oname,okey,ovalue);
     Ns_Set *set;
     NsInterp *itPtr;
@@ -1423,6 +2370,7 @@ Ns_SetPut_OCaml(value oname,value okey,value ovalue)
 CAMLprim value
 Ns_SetMerge_OCaml(value oname,value oname2)
 {
+    TRACE_STUB;
     CAMLparam2(oname,oname2);
     Ns_Set *set, *set2;
     NsInterp *itPtr;
@@ -1437,6 +2385,7 @@ Ns_SetMerge_OCaml(value oname,value oname2)
 CAMLprim value
 Ns_SetMove_OCaml(value oname,value oname2)
 {
+    TRACE_STUB;
     CAMLparam2(oname,oname2);
     Ns_Set *set, *set2;
     NsInterp *itPtr;
@@ -1451,6 +2400,7 @@ Ns_SetMove_OCaml(value oname,value oname2)
 CAMLprim value
 Ns_NormalizePath_OCaml(value opath)
 {
+    TRACE_STUB;
     CAMLparam1(opath);
     CAMLlocal1(retval);
     Ns_DString ds;
@@ -1465,6 +2415,7 @@ Ns_NormalizePath_OCaml(value opath)
 CAMLprim value
 Ns_Url2File_OCaml(value opath)
 {
+    TRACE_STUB;
     CAMLparam1(opath);
     CAMLlocal1(retval);
     Ns_DString ds;
@@ -1480,170 +2431,971 @@ Ns_Url2File_OCaml(value opath)
 CAMLprim value
 Ns_Time_OCaml()
 {
+    TRACE_STUB;
     CAMLparam0();
-    CAMLreturn(Int_val(time(0)));
+    CAMLreturn(Val_long(time(0)));
 }
 
+/*
+ * Wall clock and monotonic time in microseconds
+ */
+
 CAMLprim value
-Ns_FmtTime_OCaml(value otime,value ofmt)
+Ns_TimeUsec_OCaml(value unit)
 {
-    CAMLparam2(otime,ofmt);
-    CAMLlocal1(retval);
-    char result[512];
-    time_t time = Int_val(otime);
+    TRACE_STUB;
+    Ns_Time now;
 
-    strftime(result,sizeof(result),String_val(ofmt),ns_localtime(&time));
-    retval = copy_string2(result);
-    CAMLreturn(retval);
+    Ns_GetTime(&now);
+    return Val_long((intnat)now.sec * 1000000 + now.usec);
+}
+
+CAMLprim value
+Ns_MonotonicUsec_OCaml(value unit)
+{
+    TRACE_STUB;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return Val_long((intnat)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
 }
 
 /*
- *  nsv_ implementation copied from tclvar.c due to static declaration
+ * Formatted times are cached per thread by second and format, the same
+ * Date or log timestamp is usually formatted many times within a second
  */
 
-typedef struct Bucket {
-    Ns_Mutex lock;
-    Tcl_HashTable arrays;
-} Bucket;
- 
-typedef struct Array {
-    Bucket *bucketPtr;
-    Tcl_HashEntry *entryPtr;
-    Tcl_HashTable vars;
-} Array;
+#define FMTTIME_CACHE 8
 
-#define UnlockArray(arrayPtr) Ns_MutexUnlock(&((arrayPtr)->bucketPtr->lock));
+typedef struct FmtTime {
+    time_t sec;
+    char fmt[64];
+    char result[512];
+} FmtTime;
 
-static Array *
-LockArray(char *array,int create)
+typedef struct FmtTimeCache {
+    int next;                   /* Entry to replace on miss */
+    FmtTime entries[FMTTIME_CACHE];
+} FmtTimeCache;
+
+CAMLprim value
+Ns_FmtTime_OCaml(value otime,value ofmt)
 {
-    NsInterp *itPtr = GetInterp();
-    Bucket *bucketPtr;
-    Tcl_HashEntry *hPtr;
-    Array *arrayPtr;
-    register char *p = array;
-    register unsigned int result = 0;
-    int i, new;
+    TRACE_STUB;
+    CAMLparam2(otime,ofmt);
+    CAMLlocal1(retval);
+    char result[512];
+    time_t time = Long_val(otime);
+    const char *fmt = String_val(ofmt);
+    FmtTimeCache *cachePtr = Ns_TlsGet(&fmtTimeTls);
+    FmtTime *entryPtr;
+    int i;
 
-    if(!itPtr) return 0;
-    while(1) {
-      if((i = *p++) == 0) break;
-      result += (result<<3) + i;
+    if(caml_string_length(ofmt) >= sizeof(entryPtr->fmt)) {
+      strftime(result,sizeof(result),fmt,ns_localtime(&time));
+      retval = copy_string2(result);
+      CAMLreturn(retval);
     }
-    i = result % itPtr->servPtr->nsv.nbuckets;
-    bucketPtr = &itPtr->servPtr->nsv.buckets[i];
-    Ns_MutexLock(&bucketPtr->lock);
-    if(create) {
-      hPtr = Tcl_CreateHashEntry(&bucketPtr->arrays, array, &new);
-      if(!new) {
-        arrayPtr = Tcl_GetHashValue(hPtr);
-      } else {
-       arrayPtr = ns_malloc(sizeof(Array));
-       arrayPtr->bucketPtr = bucketPtr;
-       arrayPtr->entryPtr = hPtr;
-       Tcl_InitHashTable(&arrayPtr->vars, TCL_STRING_KEYS);
-       Tcl_SetHashValue(hPtr, arrayPtr);
-      }
-    } else {
-      if(!(hPtr = Tcl_FindHashEntry(&bucketPtr->arrays, array))) {
-        Ns_MutexUnlock(&bucketPtr->lock);
-        return NULL;
+    if(!cachePtr) {
+      cachePtr = ns_calloc(1,sizeof(FmtTimeCache));
+      for(i = 0;i < FMTTIME_CACHE;i++) cachePtr->entries[i].sec = -1;
+      Ns_TlsSet(&fmtTimeTls,cachePtr);
+    }
+    for(i = 0;i < FMTTIME_CACHE;i++) {
+      entryPtr = &cachePtr->entries[i];
+      if(entryPtr->sec == time && !strcmp(entryPtr->fmt,fmt)) {
+        retval = copy_string(entryPtr->result);
+        CAMLreturn(retval);
       }
-      arrayPtr = Tcl_GetHashValue(hPtr);
     }
-    return arrayPtr;
+    entryPtr = &cachePtr->entries[cachePtr->next];
+    cachePtr->next = (cachePtr->next + 1) % FMTTIME_CACHE;
+    entryPtr->sec = time;
+    strcpy(entryPtr->fmt,fmt);
+    if(!strftime(entryPtr->result,sizeof(entryPtr->result),fmt,ns_localtime(&time))) entryPtr->result[0] = 0;
+    retval = copy_string(entryPtr->result);
+    CAMLreturn(retval);
 }
 
-static void
-UpdateVar(Tcl_HashEntry *hPtr,char *val,int append)
+static NsOCamlProc *
+NewProc(const char *label,value oproc)
 {
-    char *ostr, *nstr;
-    int olen = 0,nlen;
+    NsOCamlProc *procPtr = ns_malloc(sizeof(NsOCamlProc));
 
-    if(!val || !*val) return;
-    nlen = strlen(val);
-    ostr = Tcl_GetHashValue(hPtr);
-    if(append) {
-      if(ostr) olen = strlen(ostr);
-      nlen += olen;
-    }
-    nstr = ns_realloc(ostr,(size_t)(nlen+1));
-    nstr[olen] = 0;
-    strcat(nstr,val);
-    Tcl_SetHashValue(hPtr,nstr);
+    procPtr->label = ns_strdup(label);
+    procPtr->closure = oproc;
+    procPtr->nextPtr = 0;
+    caml_register_generational_global_root(&procPtr->closure);
+    return procPtr;
 }
 
+/*
+ * NaviServer frees procs from any thread, the scheduler after a one time
+ * or unscheduled proc, a connection thread after unregister when the
+ * request was still running. Only the owner of the OCaml runtime may
+ * remove the closure root, so they wait in a list for OCAMLLeave, which
+ * calls NsOCamlReleaseProcs. Taking the runtime here could deadlock with
+ * OCaml code calling into the scheduler.
+ */
+
+static struct {
+    Ns_Mutex lock;
+    NsOCamlProc *firstPtr;
+} freeProcs;
+
 static void
-SetVar(Array *arrayPtr,char *key,char *value)
+FreeProc(void *arg)
 {
-    int new;
-    Tcl_HashEntry *hPtr;
+    NsOCamlProc *procPtr = arg;
 
-    hPtr = Tcl_CreateHashEntry(&arrayPtr->vars,key,&new);
-    UpdateVar(hPtr,value,0);
+    Ns_MutexLock(&freeProcs.lock);
+    procPtr->nextPtr = freeProcs.firstPtr;
+    freeProcs.firstPtr = procPtr;
+    Ns_MutexUnlock(&freeProcs.lock);
 }
 
-static void
-FlushArray(Array *arrayPtr)
+void
+NsOCamlReleaseProcs(void)
 {
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
-
-    hPtr = Tcl_FirstHashEntry(&arrayPtr->vars, &search);
-    while(hPtr != NULL) {
-      ns_free(Tcl_GetHashValue(hPtr));
-      Tcl_DeleteHashEntry(hPtr);
-      hPtr = Tcl_NextHashEntry(&search);
+    NsOCamlProc *procPtr, *nextPtr;
+
+    Ns_MutexLock(&freeProcs.lock);
+    procPtr = freeProcs.firstPtr;
+    freeProcs.firstPtr = 0;
+    Ns_MutexUnlock(&freeProcs.lock);
+    for(;procPtr;procPtr = nextPtr) {
+      nextPtr = procPtr->nextPtr;
+      caml_remove_generational_global_root(&procPtr->closure);
+      ns_free(procPtr->label);
+      ns_free(procPtr);
     }
 }
 
+/*
+ * Called by the scheduler thread, the proc is queued like by FreeProc
+ */
+
+static void
+FreeSchedProc(void *arg,int UNUSED(id))
+{
+    FreeProc(arg);
+}
+
 CAMLprim value
-Ns_NsvGet_OCaml(value oarray,value oname)
+Ns_RegisterProc_OCaml(value omethod,value ourl,value oproc)
 {
-    CAMLparam2(oarray,oname);
-    CAMLlocal1(retval);
-    Array *arrayPtr;
-    Tcl_HashEntry *hPtr;
-    char *result = "";
+    TRACE_STUB;
+    CAMLparam3(omethod,ourl,oproc);
+    NsOCamlProc *procPtr;
+    Ns_DString ds;
 
-    if((arrayPtr = LockArray(String_val(oarray),0))) {
-      hPtr = Tcl_FindHashEntry(&arrayPtr->vars,String_val(oname));
-      if(hPtr) result = Tcl_GetHashValue(hPtr);
-      UnlockArray(arrayPtr);
-    }
-    retval = copy_string2(result);
-    CAMLreturn(retval);
+    Ns_DStringInit(&ds);
+    Ns_DStringPrintf(&ds,"%s %s",String_val(omethod),String_val(ourl));
+    procPtr = NewProc(ds.string,oproc);
+    Ns_RegisterRequest(GetServer(),String_val(omethod),String_val(ourl),
+                       NsOCamlProcHandler,FreeProc,procPtr,0);
+    Ns_DStringFree(&ds);
+    CAMLreturn(Val_unit);
 }
 
 CAMLprim value
-Ns_NsvExists_OCaml(value oarray,value oname)
+Ns_UnRegisterProc_OCaml(value omethod,value ourl)
 {
-    CAMLparam2(oarray,oname);
-    Array *arrayPtr;
-    int result = 0;
-
-    if((arrayPtr = LockArray(String_val(oarray),0))) {
-      if(Tcl_FindHashEntry(&arrayPtr->vars,String_val(oname))) result = 1;
-      UnlockArray(arrayPtr);
-    }
-    CAMLreturn(Val_int(result));
+    TRACE_STUB;
+    CAMLparam2(omethod,ourl);
+    Ns_UnRegisterRequest(GetServer(),String_val(omethod),String_val(ourl),NS_TRUE);
+    CAMLreturn(Val_unit);
 }
 
 CAMLprim value
-Ns_NsvSet_OCaml(value oarray,value oname,value ovalue)
+Ns_RegisterFilter_OCaml(value owhen,value omethod,value ourl,value oproc)
 {
-    CAMLparam3(oarray,oname,ovalue);
-    Array *arrayPtr;
+    TRACE_STUB;
+    CAMLparam4(owhen,omethod,ourl,oproc);
+    NsOCamlProc *procPtr;
+    Ns_DString ds;
+    static const Ns_FilterType types[] = {
+        NS_FILTER_PRE_AUTH, NS_FILTER_POST_AUTH, NS_FILTER_TRACE
+    };
+    static const char *names[] = { "preauth", "postauth", "trace" };
 
-    arrayPtr = LockArray(String_val(oarray),1);
-    SetVar(arrayPtr,String_val(oname),String_val(ovalue));
-    UnlockArray(arrayPtr);
+    Ns_DStringInit(&ds);
+    Ns_DStringPrintf(&ds,"%s filter %s %s",names[Int_val(owhen)],String_val(omethod),String_val(ourl));
+    procPtr = NewProc(ds.string,oproc);
+    Ns_RegisterFilter(GetServer(),String_val(omethod),String_val(ourl),
+                      NsOCamlFilterHandler,types[Int_val(owhen)],procPtr,NS_FALSE);
+    Ns_DStringFree(&ds);
     CAMLreturn(Val_unit);
 }
 
+/*
+ * Scheduled procedures, they always run in their own threads, so waiting
+ * for OCaml runtime does not delay other scheduled procedures. Repeating
+ * procs need an interval of at least a second, ns_after may run at once.
+ */
+
 CAMLprim value
-Ns_NsvIncr_OCaml(value oarray,value oname,value ovalue)
+Ns_ScheduleProc_OCaml(value ointerval,value oproc)
 {
+    TRACE_STUB;
+    CAMLparam2(ointerval,oproc);
+    Ns_Time interval;
+    int id;
+
+    if(Int_val(ointerval) <= 0) caml_invalid_argument("ns_schedule_proc: interval must be positive");
+    interval.sec = Int_val(ointerval);
+    interval.usec = 0;
+    id = Ns_ScheduleProcEx(NsOCamlSchedHandler,NewProc("scheduled proc",oproc),
+                           NS_SCHED_THREAD,&interval,FreeSchedProc);
+    CAMLreturn(Val_int(id));
+}
+
+CAMLprim value
+Ns_ScheduleDaily_OCaml(value ohour,value ominute,value oproc)
+{
+    TRACE_STUB;
+    CAMLparam3(ohour,ominute,oproc);
+    int id;
+
+    id = Ns_ScheduleDaily(NsOCamlSchedHandler,NewProc("daily proc",oproc),
+                          NS_SCHED_THREAD,Int_val(ohour),Int_val(ominute),FreeSchedProc);
+    CAMLreturn(Val_int(id));
+}
+
+CAMLprim value
+Ns_After_OCaml(value odelay,value oproc)
+{
+    TRACE_STUB;
+    CAMLparam2(odelay,oproc);
+    Ns_Time delay;
+    int id;
+
+    if(Int_val(odelay) < 0) caml_invalid_argument("ns_after: delay must not be negative");
+    delay.sec = Int_val(odelay);
+    delay.usec = 0;
+    id = Ns_ScheduleProcEx(NsOCamlSchedHandler,NewProc("after proc",oproc),
+                           NS_SCHED_THREAD|NS_SCHED_ONCE,&delay,FreeSchedProc);
+    CAMLreturn(Val_int(id));
+}
+
+CAMLprim value
+Ns_UnscheduleProc_OCaml(value oid)
+{
+    TRACE_STUB;
+    CAMLparam1(oid);
+    Ns_UnscheduleProc(Int_val(oid));
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Background jobs, queued as one time scheduled procedures. OCaml code
+ * is serialized, so a job waited for while holding the runtime cannot be
+ * running in other thread, it is either done or still queued and then
+ * ns_job_wait just runs it in place.
+ */
+
+#define JOB_QUEUED  0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+
+struct NsOCamlJob {
+    int id;
+    int state;
+    int refCount;               /* Scheduler and the jobs table */
+    value closure;              /* Generational global root */
+    char *result;
+    char *error;
+};
+
+static struct {
+    Ns_Mutex lock;
+    Ns_Cond cond;
+    Tcl_HashTable table;
+    int nextid;
+    int initialized;
+} jobs;
+
+static void
+ReleaseJob(NsOCamlJob *jobPtr)
+{
+    int refCount;
+
+    Ns_MutexLock(&jobs.lock);
+    refCount = --jobPtr->refCount;
+    Ns_MutexUnlock(&jobs.lock);
+    if(refCount > 0) return;
+    ns_free(jobPtr->result);
+    ns_free(jobPtr->error);
+    ns_free(jobPtr);
+}
+
+static void
+FreeSchedJob(void *arg,int UNUSED(id))
+{
+    ReleaseJob(arg);
+}
+
+/*
+ * Run the job unless somebody else has already done it, the caller must
+ * own OCaml runtime
+ */
+
+void
+NsOCamlJobRun(NsOCamlJob *jobPtr)
+{
+    static value *limit = NULL;
+    value res;
+
+    Ns_MutexLock(&jobs.lock);
+    if(jobPtr->state != JOB_QUEUED) {
+      Ns_MutexUnlock(&jobs.lock);
+      return;
+    }
+    jobPtr->state = JOB_RUNNING;
+    Ns_MutexUnlock(&jobs.lock);
+
+    // Jobs run under the allocation limit of nsocaml.ml when it is loaded
+    if(!limit) limit = caml_named_value("ns_ocaml_limit");
+    res = limit ? caml_callback_exn(*limit,jobPtr->closure) : caml_callback_exn(jobPtr->closure,Val_unit);
+    Ns_MutexLock(&jobs.lock);
+    if(Is_exception_result(res)) {
+      char *msg = format_caml_exception(Extract_exception(res));
+      jobPtr->error = ns_strdup(msg);
+      free(msg);
+    } else {
+      jobPtr->result = ns_strdup(String_val(res));
+    }
+    jobPtr->state = JOB_DONE;
+    Ns_CondBroadcast(&jobs.cond);
+    Ns_MutexUnlock(&jobs.lock);
+    caml_remove_generational_global_root(&jobPtr->closure);
+}
+
+CAMLprim value
+Ns_JobQueue_OCaml(value oproc)
+{
+    TRACE_STUB;
+    CAMLparam1(oproc);
+    NsOCamlJob *jobPtr;
+    Tcl_HashEntry *hPtr;
+    Ns_Time now = { 0, 0 };
+    int new;
+
+    jobPtr = ns_calloc(1,sizeof(NsOCamlJob));
+    jobPtr->refCount = 2;
+    jobPtr->closure = oproc;
+    caml_register_generational_global_root(&jobPtr->closure);
+    Ns_MutexLock(&jobs.lock);
+    if(!jobs.initialized) {
+      Tcl_InitHashTable(&jobs.table,TCL_ONE_WORD_KEYS);
+      jobs.initialized = 1;
+    }
+    jobPtr->id = ++jobs.nextid;
+    hPtr = Tcl_CreateHashEntry(&jobs.table,INT2PTR(jobPtr->id),&new);
+    Tcl_SetHashValue(hPtr,jobPtr);
+    Ns_MutexUnlock(&jobs.lock);
+    if(Ns_ScheduleProcEx(NsOCamlJobHandler,jobPtr,NS_SCHED_THREAD|NS_SCHED_ONCE,&now,FreeSchedJob) < 0) {
+      // Could not schedule, the job will run in ns_job_wait
+      ReleaseJob(jobPtr);
+    }
+    CAMLreturn(Val_int(jobPtr->id));
+}
+
+CAMLprim value
+Ns_JobWait_OCaml(value oid)
+{
+    TRACE_STUB;
+    CAMLparam1(oid);
+    CAMLlocal1(retval);
+    NsOCamlJob *jobPtr = 0;
+    Tcl_HashEntry *hPtr = 0;
+
+    Ns_MutexLock(&jobs.lock);
+    if(jobs.initialized) hPtr = Tcl_FindHashEntry(&jobs.table,INT2PTR(Int_val(oid)));
+    if(hPtr) {
+      jobPtr = Tcl_GetHashValue(hPtr);
+      Tcl_DeleteHashEntry(hPtr);
+    }
+    Ns_MutexUnlock(&jobs.lock);
+    if(!jobPtr) caml_invalid_argument("ns_job_wait: no such job");
+
+    NsOCamlJobRun(jobPtr);
+    Ns_MutexLock(&jobs.lock);
+    while(jobPtr->state != JOB_DONE) Ns_CondWait(&jobs.cond,&jobs.lock);
+    Ns_MutexUnlock(&jobs.lock);
+    if(jobPtr->error) {
+      char msg[512];
+
+      snprintf(msg,sizeof(msg),"%s",jobPtr->error);
+      ReleaseJob(jobPtr);
+      caml_failwith(msg);
+    }
+    retval = copy_string2(jobPtr->result);
+    ReleaseJob(jobPtr);
+    CAMLreturn(retval);
+}
+
+/*
+ * Caches, values are OCaml strings copied out of the heap. OCaml code is
+ * serialized, so misses on the same key are computed once: a pending entry
+ * seen by cache_eval can only be a recursive evaluation of the same key.
+ */
+
+typedef struct Cache {
+    Ns_Cache *cache;
+    int ttl;                    /* Seconds, 0 means no expiration */
+} Cache;
+
+typedef struct CacheValue {
+    size_t length;
+    char data[1];
+} CacheValue;
+
+static struct {
+    Ns_Mutex lock;
+    Tcl_HashTable table;
+    int initialized;
+} caches;
+
+static Cache *
+GetCache(char *name)
+{
+    Tcl_HashEntry *hPtr = 0;
+
+    Ns_MutexLock(&caches.lock);
+    if(caches.initialized) hPtr = Tcl_FindHashEntry(&caches.table,name);
+    Ns_MutexUnlock(&caches.lock);
+    if(!hPtr) caml_invalid_argument("ns_cache: no such cache");
+    return Tcl_GetHashValue(hPtr);
+}
+
+CAMLprim value
+Ns_CacheCreate_OCaml(value oname,value osize,value ottl)
+{
+    TRACE_STUB;
+    CAMLparam3(oname,osize,ottl);
+    Tcl_HashEntry *hPtr;
+    Cache *cachePtr;
+    int new;
+
+    if(Long_val(osize) < 0) caml_invalid_argument("ns_cache_create: size must not be negative");
+    if(Int_val(ottl) < 0) caml_invalid_argument("ns_cache_create: ttl must not be negative");
+    Ns_MutexLock(&caches.lock);
+    if(!caches.initialized) {
+      Tcl_InitHashTable(&caches.table,TCL_STRING_KEYS);
+      caches.initialized = 1;
+    }
+    hPtr = Tcl_CreateHashEntry(&caches.table,String_val(oname),&new);
+    if(new) {
+      cachePtr = ns_malloc(sizeof(Cache));
+      cachePtr->cache = Ns_CacheCreateSz(String_val(oname),TCL_STRING_KEYS,(size_t)Long_val(osize),ns_free);
+      cachePtr->ttl = Int_val(ottl);
+      Tcl_SetHashValue(hPtr,cachePtr);
+    }
+    Ns_MutexUnlock(&caches.lock);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+Ns_CacheEval_OCaml(value oname,value okey,value oproc)
+{
+    TRACE_STUB;
+    CAMLparam3(oname,okey,oproc);
+    CAMLlocal2(retval,res);
+    Cache *cachePtr = GetCache(String_val(oname));
+    CacheValue *valPtr;
+    Ns_Entry *entry;
+    Ns_Time expires;
+    int new;
+
+    Ns_CacheLock(cachePtr->cache);
+    entry = Ns_CacheCreateEntry(cachePtr->cache,String_val(okey),&new);
+    if(!new && !(valPtr = Ns_CacheGetValue(entry))) {
+      Ns_CacheUnlock(cachePtr->cache);
+      caml_failwith("ns_cache_eval: recursive evaluation of the same key");
+    }
+    if(!new) {
+      retval = caml_alloc_string(valPtr->length);
+      memcpy(Bytes_val(retval),valPtr->data,valPtr->length);
+      Ns_CacheUnlock(cachePtr->cache);
+      CAMLreturn(retval);
+    }
+    Ns_CacheUnlock(cachePtr->cache);
+
+    res = caml_callback_exn(oproc,Val_unit);
+
+    // The pending entry stays, NaviServer does not flush entries without
+    // value, and creating it again would count the miss twice
+    Ns_CacheLock(cachePtr->cache);
+    if(Is_exception_result(res)) {
+      Ns_CacheDeleteEntry(entry);
+      Ns_CacheBroadcast(cachePtr->cache);
+      Ns_CacheUnlock(cachePtr->cache);
+      caml_raise(Extract_exception(res));
+    }
+    valPtr = ns_malloc(sizeof(CacheValue) + caml_string_length(res));
+    valPtr->length = caml_string_length(res);
+    memcpy(valPtr->data,String_val(res),valPtr->length);
+    if(cachePtr->ttl > 0) {
+      Ns_GetTime(&expires);
+      Ns_IncrTime(&expires,cachePtr->ttl,0);
+      Ns_CacheSetValueExpires(entry,valPtr,valPtr->length,&expires,0);
+    } else {
+      Ns_CacheSetValueSz(entry,valPtr,valPtr->length);
+    }
+    Ns_CacheBroadcast(cachePtr->cache);
+    Ns_CacheUnlock(cachePtr->cache);
+    CAMLreturn(res);
+}
+
+CAMLprim value
+Ns_CacheFlush_OCaml(value oname,value okey)
+{
+    TRACE_STUB;
+    CAMLparam2(oname,okey);
+    Cache *cachePtr = GetCache(String_val(oname));
+    Ns_Entry *entry;
+
+    Ns_CacheLock(cachePtr->cache);
+    if(!*String_val(okey)) {
+      Ns_CacheFlush(cachePtr->cache);
+    } else
+    if((entry = Ns_CacheFindEntry(cachePtr->cache,String_val(okey)))) {
+      Ns_CacheFlushEntry(entry);
+    }
+    Ns_CacheUnlock(cachePtr->cache);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+Ns_CacheStats_OCaml(value oname)
+{
+    TRACE_STUB;
+    CAMLparam1(oname);
+    CAMLlocal1(retval);
+    Cache *cachePtr = GetCache(String_val(oname));
+    Ns_DString ds;
+
+    Ns_DStringInit(&ds);
+    Ns_CacheLock(cachePtr->cache);
+    Ns_CacheStats(cachePtr->cache,&ds);
+    Ns_CacheUnlock(cachePtr->cache);
+    retval = copy_string(ds.string);
+    Ns_DStringFree(&ds);
+    CAMLreturn(retval);
+}
+
+/*
+ * Shared regions, immutable OCaml values copied out of the heap by
+ * ns_shared_publish. Copied blocks have black headers and the region is
+ * registered as static data, so the GC neither marks nor moves it while
+ * polymorphic compare and hash still see ordinary values, this needs
+ * OCaml with naked pointers. All access happens with the OCaml runtime
+ * held, which serializes publishers and readers. ns_shared_get returns a
+ * custom block holding a reference to the region, a replaced region is
+ * freed by the finalizer of its last handle.
+ */
+
+#ifdef NO_NAKED_POINTERS
+#error "ns_shared requires OCaml with naked pointers"
+#endif
+
+typedef struct Region {
+    char *name;
+    value *data;                /* Copied blocks with their headers */
+    mlsize_t size;              /* In words */
+    value root;
+    int refCount;               /* Registry plus handles */
+} Region;
+
+static struct {
+    Tcl_HashTable table;
+    int initialized;
+} shared;
+
+static void ReleaseRegion(Region *regionPtr);
+
+#define Region_val(v) (*((Region **) Data_custom_val(v)))
+
+static void
+SharedFinalize(value v)
+{
+    ReleaseRegion(Region_val(v));
+}
+
+static int
+SharedCompare(value v1,value v2)
+{
+    uintptr_t r1 = (uintptr_t)Region_val(v1), r2 = (uintptr_t)Region_val(v2);
+
+    return r1 == r2 ? 0 : r1 < r2 ? -1 : 1;
+}
+
+static struct custom_operations sharedOps = {
+    "nsocaml.shared",
+    SharedFinalize,
+    SharedCompare,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+    custom_compare_ext_default,
+    custom_fixed_length_default
+};
+
+typedef struct SharedCopy {
+    Tcl_HashTable seen;         /* Source block -> offset of its copy */
+    value *blocks;              /* Source blocks in the order of offsets */
+    int nblocks;
+    int maxblocks;
+    mlsize_t size;
+    const char *error;
+} SharedCopy;
+
+static int
+SharedAdd(SharedCopy *copyPtr,value v)
+{
+    Tcl_HashEntry *hPtr;
+    const char *id;
+    int isNew;
+
+    // Immediates, atoms and blocks outside of the heap are kept as is
+    if(Is_long(v) || !Is_in_heap_or_young(v)) return 0;
+    hPtr = Tcl_CreateHashEntry(&copyPtr->seen,(char*)v,&isNew);
+    if(!isNew) return 0;
+    switch(Tag_val(v)) {
+     case Closure_tag:
+     case Infix_tag:
+     case Object_tag:
+     case Lazy_tag:
+     case Forward_tag:
+         copyPtr->error = "ns_shared_publish: functional, object or lazy value";
+         return -1;
+     case Abstract_tag:
+         copyPtr->error = "ns_shared_publish: abstract value";
+         return -1;
+     case Custom_tag:
+         // Only boxed integers, everything else may need finalization
+         id = Custom_ops_val(v)->identifier;
+         if(strcmp(id,"_j") && strcmp(id,"_i") && strcmp(id,"_n")) {
+           copyPtr->error = "ns_shared_publish: custom value";
+           return -1;
+         }
+         break;
+    }
+    Tcl_SetHashValue(hPtr,(ClientData)(uintptr_t)copyPtr->size);
+    copyPtr->size += Wosize_val(v) + 1;
+    if(copyPtr->nblocks == copyPtr->maxblocks) {
+      copyPtr->maxblocks = copyPtr->maxblocks ? copyPtr->maxblocks * 2 : 256;
+      copyPtr->blocks = ns_realloc(copyPtr->blocks,copyPtr->maxblocks * sizeof(value));
+    }
+    copyPtr->blocks[copyPtr->nblocks++] = v;
+    return 0;
+}
+
+/*
+ * Two passes, the first collects reachable blocks and assigns offsets so
+ * sharing and cycles are preserved, the second fills the region. Nothing is
+ * allocated in the OCaml heap meanwhile, source blocks cannot move.
+ */
+
+static Region *
+SharedCopyValue(value v,const char **errorPtr)
+{
+    SharedCopy copy;
+    Region *regionPtr = 0;
+    header_t *hp;
+    value b, f, *fields;
+    mlsize_t i;
+    int n;
+
+    memset(&copy,0,sizeof(copy));
+    Tcl_InitHashTable(&copy.seen,TCL_ONE_WORD_KEYS);
+    if(SharedAdd(&copy,v)) goto done;
+    for(n = 0;n < copy.nblocks;n++) {
+      b = copy.blocks[n];
+      if(Tag_val(b) >= No_scan_tag) continue;
+      for(i = 0;i < Wosize_val(b);i++) {
+        if(SharedAdd(&copy,Field(b,i))) goto done;
+      }
+    }
+    regionPtr = ns_calloc(1,sizeof(Region));
+    regionPtr->size = copy.size;
+    regionPtr->data = ns_malloc(Bsize_wsize(copy.size));
+    regionPtr->root = v;
+    for(n = 0;n < copy.nblocks;n++) {
+      b = copy.blocks[n];
+      hp = (header_t*)(regionPtr->data + (uintptr_t)Tcl_GetHashValue(Tcl_FindHashEntry(&copy.seen,(char*)b)));
+      *hp = Make_header(Wosize_val(b),Tag_val(b),Caml_black);
+      fields = (value*)(hp + 1);
+      if(Tag_val(b) >= No_scan_tag) {
+        memcpy(fields,(void*)b,Bsize_wsize(Wosize_val(b)));
+        continue;
+      }
+      for(i = 0;i < Wosize_val(b);i++) {
+        f = Field(b,i);
+        if(Is_block(f) && Is_in_heap_or_young(f)) {
+          f = Val_hp(regionPtr->data + (uintptr_t)Tcl_GetHashValue(Tcl_FindHashEntry(&copy.seen,(char*)f)));
+        }
+        fields[i] = f;
+      }
+    }
+    if(Is_block(v) && Is_in_heap_or_young(v)) regionPtr->root = Val_hp(regionPtr->data);
+    if(caml_page_table_add(In_static_data,regionPtr->data,regionPtr->data + copy.size)) {
+      ns_free(regionPtr->data);
+      ns_free(regionPtr);
+      regionPtr = 0;
+      copy.error = "ns_shared_publish: out of memory";
+    }
+done:
+    *errorPtr = copy.error;
+    Tcl_DeleteHashTable(&copy.seen);
+    ns_free(copy.blocks);
+    return regionPtr;
+}
+
+static void
+ReleaseRegion(Region *regionPtr)
+{
+    if(!regionPtr || --regionPtr->refCount > 0) return;
+    caml_page_table_remove(In_static_data,regionPtr->data,regionPtr->data + regionPtr->size);
+    ns_free(regionPtr->data);
+    ns_free(regionPtr->name);
+    ns_free(regionPtr);
+}
+
+static Region *
+SharedSwap(char *name,Region *regionPtr)
+{
+    Tcl_HashEntry *hPtr;
+    Region *oldPtr = 0;
+    int isNew;
+
+    if(!shared.initialized) {
+      Tcl_InitHashTable(&shared.table,TCL_STRING_KEYS);
+      shared.initialized = 1;
+    }
+    if(regionPtr) {
+      hPtr = Tcl_CreateHashEntry(&shared.table,name,&isNew);
+      if(!isNew) oldPtr = Tcl_GetHashValue(hPtr);
+      Tcl_SetHashValue(hPtr,regionPtr);
+    } else
+    if((hPtr = Tcl_FindHashEntry(&shared.table,name))) {
+      oldPtr = Tcl_GetHashValue(hPtr);
+      Tcl_DeleteHashEntry(hPtr);
+    }
+    return oldPtr;
+}
+
+CAMLprim value
+Ns_SharedPublish_OCaml(value oname,value ovalue)
+{
+    TRACE_STUB;
+    CAMLparam2(oname,ovalue);
+    const char *error;
+    Region *regionPtr;
+
+    if(!(regionPtr = SharedCopyValue(ovalue,&error))) caml_invalid_argument(error);
+    regionPtr->name = ns_strdup(String_val(oname));
+    regionPtr->refCount = 1;
+    ReleaseRegion(SharedSwap(regionPtr->name,regionPtr));
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+Ns_SharedGet_OCaml(value oname)
+{
+    TRACE_STUB;
+    CAMLparam1(oname);
+    CAMLlocal1(retval);
+    Tcl_HashEntry *hPtr = 0;
+    Region *regionPtr;
+
+    if(shared.initialized) hPtr = Tcl_FindHashEntry(&shared.table,String_val(oname));
+    if(!hPtr) caml_raise_not_found();
+    regionPtr = Tcl_GetHashValue(hPtr);
+    retval = caml_alloc_custom(&sharedOps,sizeof(Region*),0,1);
+    Region_val(retval) = regionPtr;
+    regionPtr->refCount++;
+    CAMLreturn(retval);
+}
+
+/*
+ * Root of the region, valid as long as the handle is reachable, used by
+ * ns_shared_with only
+ */
+
+CAMLprim value
+Ns_SharedValue_OCaml(value ohandle)
+{
+    TRACE_STUB;
+    CAMLparam1(ohandle);
+    CAMLreturn(Region_val(ohandle)->root);
+}
+
+CAMLprim value
+Ns_SharedRemove_OCaml(value oname)
+{
+    TRACE_STUB;
+    CAMLparam1(oname);
+
+    ReleaseRegion(SharedSwap(String_val(oname),0));
+    CAMLreturn(Val_unit);
+}
+
+/*
+ *  nsv_ implementation copied from tclvar.c due to static declaration
+ */
+
+typedef struct Bucket {
+    Ns_Mutex lock;
+    Tcl_HashTable arrays;
+} Bucket;
+ 
+typedef struct Array {
+    Bucket *bucketPtr;
+    Tcl_HashEntry *entryPtr;
+    Tcl_HashTable vars;
+} Array;
+
+#define UnlockArray(arrayPtr) Ns_MutexUnlock(&((arrayPtr)->bucketPtr->lock));
+
+static Array *
+LockArray(char *array,int create)
+{
+    NsInterp *itPtr = GetInterp();
+    Bucket *bucketPtr;
+    Tcl_HashEntry *hPtr;
+    Array *arrayPtr;
+    register char *p = array;
+    register unsigned int result = 0;
+    int i, new;
+    Tcl_WideInt start;
+
+    if(!itPtr) return 0;
+    while(1) {
+      if((i = *p++) == 0) break;
+      result += (result<<3) + i;
+    }
+    i = result % itPtr->servPtr->nsv.nbuckets;
+    bucketPtr = &itPtr->servPtr->nsv.buckets[i];
+    start = NsOCamlTraceTime();
+    Ns_MutexLock(&bucketPtr->lock);
+    NsOCamlTraceAdd("nsv lock","lock",start);
+    if(create) {
+      hPtr = Tcl_CreateHashEntry(&bucketPtr->arrays, array, &new);
+      if(!new) {
+        arrayPtr = Tcl_GetHashValue(hPtr);
+      } else {
+       arrayPtr = ns_malloc(sizeof(Array));
+       arrayPtr->bucketPtr = bucketPtr;
+       arrayPtr->entryPtr = hPtr;
+       Tcl_InitHashTable(&arrayPtr->vars, TCL_STRING_KEYS);
+       Tcl_SetHashValue(hPtr, arrayPtr);
+      }
+    } else {
+      if(!(hPtr = Tcl_FindHashEntry(&bucketPtr->arrays, array))) {
+        Ns_MutexUnlock(&bucketPtr->lock);
+        return NULL;
+      }
+      arrayPtr = Tcl_GetHashValue(hPtr);
+    }
+    return arrayPtr;
+}
+
+static void
+UpdateVar(Tcl_HashEntry *hPtr,char *val,int append)
+{
+    char *ostr, *nstr;
+    int olen = 0,nlen;
+
+    if(!val || !*val) return;
+    nlen = strlen(val);
+    ostr = Tcl_GetHashValue(hPtr);
+    if(append) {
+      if(ostr) olen = strlen(ostr);
+      nlen += olen;
+    }
+    nstr = ns_realloc(ostr,(size_t)(nlen+1));
+    nstr[olen] = 0;
+    strcat(nstr,val);
+    Tcl_SetHashValue(hPtr,nstr);
+}
+
+static void
+SetVar(Array *arrayPtr,char *key,char *value)
+{
+    int new;
+    Tcl_HashEntry *hPtr;
+
+    hPtr = Tcl_CreateHashEntry(&arrayPtr->vars,key,&new);
+    UpdateVar(hPtr,value,0);
+}
+
+static void
+FlushArray(Array *arrayPtr)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+
+    hPtr = Tcl_FirstHashEntry(&arrayPtr->vars, &search);
+    while(hPtr != NULL) {
+      ns_free(Tcl_GetHashValue(hPtr));
+      Tcl_DeleteHashEntry(hPtr);
+      hPtr = Tcl_NextHashEntry(&search);
+    }
+}
+
+CAMLprim value
+Ns_NsvGet_OCaml(value oarray,value oname)
+{
+    TRACE_STUB;
+    CAMLparam2(oarray,oname);
+    CAMLlocal1(retval);
+    Array *arrayPtr;
+    Tcl_HashEntry *hPtr;
+    char *result = "";
+
+    if((arrayPtr = LockArray(String_val(oarray),0))) {
+      hPtr = Tcl_FindHashEntry(&arrayPtr->vars,String_val(oname));
+      if(hPtr) result = Tcl_GetHashValue(hPtr);
+      UnlockArray(arrayPtr);
+    }
+    retval = copy_string2(result);
+    CAMLreturn(retval);
+}
+
+CAMLprim value
+Ns_NsvExists_OCaml(value oarray,value oname)
+{
+    TRACE_STUB;
+    CAMLparam2(oarray,oname);
+    Array *arrayPtr;
+    int result = 0;
+
+    if((arrayPtr = LockArray(String_val(oarray),0))) {
+      if(Tcl_FindHashEntry(&arrayPtr->vars,String_val(oname))) result = 1;
+      UnlockArray(arrayPtr);
+    }
+    CAMLreturn(Val_int(result));
+}
+
+CAMLprim value
+Ns_NsvSet_OCaml(value oarray,value oname,value ovalue)
+{
+    TRACE_STUB;
+    CAMLparam3(oarray,oname,ovalue);
+    Array *arrayPtr;
+
+    arrayPtr = LockArray(String_val(oarray),1);
+    SetVar(arrayPtr,String_val(oname),String_val(ovalue));
+    UnlockArray(arrayPtr);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+Ns_NsvIncr_OCaml(value oarray,value oname,value ovalue)
+{
+    TRACE_STUB;
     CAMLparam3(oarray,oname,ovalue);
     Array *arrayPtr;
     char buf[32];
@@ -1663,6 +3415,7 @@ Ns_NsvIncr_OCaml(value oarray,value oname,value ovalue)
 CAMLprim value
 Ns_NsvAppend_OCaml(value oarray,value oname,value ovalue)
 {
+    TRACE_STUB;
     CAMLparam3(oarray,oname,ovalue);
     Array *arrayPtr;
     int new;
@@ -1678,6 +3431,7 @@ Ns_NsvAppend_OCaml(value oarray,value oname,value ovalue)
 CAMLprim value
 Ns_NsvUnset_OCaml(value oarray,value oname)
 {
+    TRACE_STUB;
     CAMLparam2(oarray,oname);
     Tcl_HashEntry *hPtr = NULL;
     Array *arrayPtr;
@@ -1704,6 +3458,7 @@ Ns_NsvUnset_OCaml(value oarray,value oname)
 CAMLprim value
 Ns_NsvNames_OCaml(value oarray,value oname)
 {
+    TRACE_STUB;
     CAMLparam2(oarray,oname);
     CAMLlocal3(result,nrec,orec);
     NsInterp *itPtr;
@@ -1740,6 +3495,7 @@ Ns_NsvNames_OCaml(value oarray,value oname)
 CAMLprim value
 Ns_NsvArrayNames_OCaml(value oarray,value oname)
 {
+    TRACE_STUB;
     CAMLparam2(oarray,oname);
     CAMLlocal3(result,nrec,orec);
     Array *arrayPtr;
@@ -1767,3 +3523,705 @@ Ns_NsvArrayNames_OCaml(value oarray,value oname)
     }
     CAMLreturn(result);
 }
+
+/*
+ * HTTP client, requests are queued with ns_http queue and run by the
+ * NaviServer task thread, so several of them proceed concurrently while
+ * the handler waits for each with ns_http wait. Commands are called
+ * with Tcl_EvalObjv, nothing is parsed as a script, and the response is
+ * taken apart from the result dict.
+ */
+
+static Tcl_Obj *
+EvalObjv(Tcl_Interp *interp,int objc,Tcl_Obj **objv)
+{
+    int i, rc;
+
+    for(i = 0;i < objc;i++) Tcl_IncrRefCount(objv[i]);
+    rc = Tcl_EvalObjv(interp,objc,objv,0);
+    for(i = 0;i < objc;i++) Tcl_DecrRefCount(objv[i]);
+    return rc == TCL_OK ? Tcl_GetObjResult(interp) : 0;
+}
+
+static void
+EvalError(Tcl_Interp *interp,const char *cmd)
+{
+    char msg[512];
+
+    snprintf(msg,sizeof(msg),"%s: %s",cmd,Tcl_GetStringResult(interp));
+    caml_failwith(msg);
+}
+
+/*
+ * Queues http_request record: method, url, headers, body, timeout in
+ * milliseconds. Returns the ns_http handle.
+ */
+
+CAMLprim value
+Ns_HttpQueue_OCaml(value oreq)
+{
+    TRACE_STUB;
+    CAMLparam1(oreq);
+    CAMLlocal2(oheaders,retval);
+    NsInterp *itPtr = GetInterp();
+    Tcl_Obj *objv[12], *result, *setId = 0;
+    Ns_Set *set;
+    int objc = 0;
+    char buf[64];
+
+    if(!itPtr) caml_failwith("ns_http_queue: no interpreter");
+    objv[objc++] = Tcl_NewStringObj("ns_http",7);
+    objv[objc++] = Tcl_NewStringObj("queue",5);
+    objv[objc++] = Tcl_NewStringObj("-method",7);
+    objv[objc++] = Tcl_NewStringObj(String_val(Field(oreq,0)),-1);
+    if(Field(oreq,2) != Val_emptylist) {
+      set = Ns_SetCreate("headers");
+      for(oheaders = Field(oreq,2);oheaders != Val_emptylist;oheaders = Field(oheaders,1))
+        Ns_SetPut(set,String_val(Field(Field(oheaders,0),0)),String_val(Field(Field(oheaders,0),1)));
+      Ns_TclEnterSet(itPtr->interp,set,NS_TCL_SET_DYNAMIC);
+      setId = Tcl_DuplicateObj(Tcl_GetObjResult(itPtr->interp));
+      Tcl_IncrRefCount(setId);
+      objv[objc++] = Tcl_NewStringObj("-headers",8);
+      objv[objc++] = setId;
+    }
+    if(caml_string_length(Field(oreq,3)) > 0) {
+      objv[objc++] = Tcl_NewStringObj("-body",5);
+      objv[objc++] = Tcl_NewByteArrayObj((unsigned char*)String_val(Field(oreq,3)),(int)caml_string_length(Field(oreq,3)));
+    }
+    if(Int_val(Field(oreq,4)) > 0) {
+      snprintf(buf,sizeof(buf),"%dms",Int_val(Field(oreq,4)));
+      objv[objc++] = Tcl_NewStringObj("-timeout",8);
+      objv[objc++] = Tcl_NewStringObj(buf,-1);
+    }
+    objv[objc++] = Tcl_NewStringObj(String_val(Field(oreq,1)),-1);
+    result = EvalObjv(itPtr->interp,objc,objv);
+    if(result) retval = copy_string(Tcl_GetString(result));
+    if(setId) {
+      // Headers are written into the request when it is queued
+      Ns_TclFreeSet(itPtr->interp,Tcl_GetString(setId));
+      Tcl_DecrRefCount(setId);
+    }
+    if(!result) EvalError(itPtr->interp,"ns_http_queue");
+    CAMLreturn(retval);
+}
+
+/*
+ * Waits for the queued request, returns http_response record: status,
+ * headers and body as a char Bigarray outside of the OCaml heap
+ */
+
+CAMLprim value
+Ns_HttpWait_OCaml(value ohandle)
+{
+    TRACE_STUB;
+    CAMLparam1(ohandle);
+    CAMLlocal4(retval,oheaders,obody,ocell);
+    NsInterp *itPtr = GetInterp();
+    Tcl_Obj *objv[3], *result, *key, *field;
+    const char *data = "", *setId = 0;
+    int status = 0, len = 0, i;
+    Ns_Set *set;
+
+    if(!itPtr) caml_failwith("ns_http_wait: no interpreter");
+    objv[0] = Tcl_NewStringObj("ns_http",7);
+    objv[1] = Tcl_NewStringObj("wait",4);
+    objv[2] = Tcl_NewStringObj(String_val(ohandle),-1);
+    if(!(result = EvalObjv(itPtr->interp,3,objv))) EvalError(itPtr->interp,"ns_http_wait");
+    Tcl_IncrRefCount(result);
+
+    key = Tcl_NewStringObj("status",6);
+    if(Tcl_DictObjGet(0,result,key,&field) == TCL_OK && field) Tcl_GetIntFromObj(0,field,&status);
+    Tcl_DecrRefCount(key);
+    key = Tcl_NewStringObj("body",4);
+    if(Tcl_DictObjGet(0,result,key,&field) == TCL_OK && field) {
+      if(field->typePtr == Tcl_GetObjType("bytearray"))
+        data = (const char*)Tcl_GetByteArrayFromObj(field,&len);
+      else
+        data = Tcl_GetStringFromObj(field,&len);
+    }
+    Tcl_DecrRefCount(key);
+    obody = caml_ba_alloc_dims(CAML_BA_UINT8|CAML_BA_C_LAYOUT,1,0,(intnat)len);
+    memcpy(Caml_ba_data_val(obody),data,(size_t)len);
+
+    key = Tcl_NewStringObj("headers",7);
+    if(Tcl_DictObjGet(0,result,key,&field) == TCL_OK && field) setId = Tcl_GetString(field);
+    Tcl_DecrRefCount(key);
+    oheaders = Val_emptylist;
+    if(setId && (set = Ns_TclGetSet(itPtr->interp,setId))) {
+      for(i = (int)Ns_SetSize(set) - 1;i >= 0;i--) {
+        retval = caml_alloc_tuple(2);
+        Store_field(retval,0,copy_string2(Ns_SetKey(set,i)));
+        Store_field(retval,1,copy_string2(Ns_SetValue(set,i)));
+        ocell = caml_alloc_small(2,0);
+        Field(ocell,0) = retval;
+        Field(ocell,1) = oheaders;
+        oheaders = ocell;
+      }
+      Ns_TclFreeSet(itPtr->interp,setId);
+    }
+    Tcl_DecrRefCount(result);
+
+    retval = caml_alloc_tuple(3);
+    Store_field(retval,0,Val_int(status));
+    Store_field(retval,1,oheaders);
+    Store_field(retval,2,obody);
+    CAMLreturn(retval);
+}
+
+/*
+ * Cancels the queued request, its handle becomes invalid
+ */
+
+CAMLprim value
+Ns_HttpCancel_OCaml(value ohandle)
+{
+    TRACE_STUB;
+    CAMLparam1(ohandle);
+    NsInterp *itPtr = GetInterp();
+    Tcl_Obj *objv[3];
+
+    if(!itPtr) caml_failwith("ns_http_cancel: no interpreter");
+    objv[0] = Tcl_NewStringObj("ns_http",7);
+    objv[1] = Tcl_NewStringObj("cancel",6);
+    objv[2] = Tcl_NewStringObj(String_val(ohandle),-1);
+    if(!EvalObjv(itPtr->interp,3,objv)) EvalError(itPtr->interp,"ns_http_cancel");
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Connection channels, ns_connchan has no public C API either. A detached
+ * connection is owned by the channel, the connection thread is released
+ * when the handler returns and the socket is served by callbacks which
+ * run ns_ocaml channel in the socket callback thread. There is no
+ * connection there, the stubs use the interp of the OCaml execution,
+ * which is given back when the callback returns, see GetInterp.
+ */
+
+static Tcl_Obj *
+ConnChanEval(const char *cmd,value ochan,Tcl_Obj *arg)
+{
+    NsInterp *itPtr = GetInterp();
+    Tcl_Obj *objv[4], *result;
+    int objc = 0;
+    char msg[64];
+
+    snprintf(msg,sizeof(msg),"ns_connchan_%s",cmd);
+    if(!itPtr) caml_failwith(msg);
+    objv[objc++] = Tcl_NewStringObj("ns_connchan",11);
+    objv[objc++] = Tcl_NewStringObj(cmd,-1);
+    objv[objc++] = Tcl_NewStringObj(String_val(ochan),-1);
+    if(arg) objv[objc++] = arg;
+    if(!(result = EvalObjv(itPtr->interp,objc,objv))) EvalError(itPtr->interp,msg);
+    return result;
+}
+
+/*
+ * Detaches the current connection, returns the channel name. No response
+ * is sent for the connection, the handler writes it to the channel.
+ */
+
+CAMLprim value
+Ns_ConnChanDetach_OCaml(value unit)
+{
+    TRACE_STUB;
+    CAMLparam1(unit);
+    CAMLlocal1(retval);
+    NsInterp *itPtr = GetInterp();
+    Ns_Conn *conn = GetConn();
+    Tcl_Obj *objv[2], *result;
+
+    if(!itPtr || !conn) caml_failwith("ns_connchan_detach: no connection");
+    // Worker threads run with their own interp, which has no connection
+    itPtr->conn = (Conn*)conn;
+    objv[0] = Tcl_NewStringObj("ns_connchan",11);
+    objv[1] = Tcl_NewStringObj("detach",6);
+    result = EvalObjv(itPtr->interp,2,objv);
+    if(itPtr->interp == Ns_TlsGet(&interpTls)) itPtr->conn = 0;
+    if(!result) EvalError(itPtr->interp,"ns_connchan_detach");
+    retval = copy_string(Tcl_GetString(result));
+    CAMLreturn(retval);
+}
+
+/*
+ * Returns the data available on the channel, empty string on end of file
+ */
+
+CAMLprim value
+Ns_ConnChanRead_OCaml(value ochan)
+{
+    TRACE_STUB;
+    CAMLparam1(ochan);
+    CAMLlocal1(retval);
+    Tcl_Obj *result = ConnChanEval("read",ochan,0);
+    const char *data;
+    int len;
+
+    if(result->typePtr == Tcl_GetObjType("bytearray"))
+      data = (const char*)Tcl_GetByteArrayFromObj(result,&len);
+    else
+      data = Tcl_GetStringFromObj(result,&len);
+    retval = caml_alloc_string((mlsize_t)len);
+    memcpy((char*)String_val(retval),data,(size_t)len);
+    CAMLreturn(retval);
+}
+
+/*
+ * Writes raw bytes, returns the number of bytes sent which is less than
+ * the length of data when the socket would block
+ */
+
+CAMLprim value
+Ns_ConnChanWrite_OCaml(value ochan,value odata)
+{
+    TRACE_STUB;
+    CAMLparam2(ochan,odata);
+    Tcl_Obj *result;
+    int sent = 0;
+
+    result = ConnChanEval("write",ochan,Tcl_NewByteArrayObj((unsigned char*)String_val(odata),(int)caml_string_length(odata)));
+    Tcl_GetIntFromObj(0,result,&sent);
+    CAMLreturn(Val_int(sent));
+}
+
+CAMLprim value
+Ns_ConnChanClose_OCaml(value ochan)
+{
+    TRACE_STUB;
+    CAMLparam1(ochan);
+    ConnChanEval("close",ochan,0);
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Registers ns_ocaml channel as callback of the channel for the events in
+ * when: r, w and e. Timeout in milliseconds, 0 for none.
+ */
+
+CAMLprim value
+Ns_ConnChanCallback_OCaml(value ochan,value owhen,value otimeout)
+{
+    TRACE_STUB;
+    CAMLparam3(ochan,owhen,otimeout);
+    NsInterp *itPtr = GetInterp();
+    Tcl_Obj *objv[7], *script[3];
+    int objc = 0;
+    char buf[64];
+
+    if(!itPtr) caml_failwith("ns_connchan_callback");
+    objv[objc++] = Tcl_NewStringObj("ns_connchan",11);
+    objv[objc++] = Tcl_NewStringObj("callback",8);
+    if(Int_val(otimeout) > 0) {
+      snprintf(buf,sizeof(buf),"%dms",Int_val(otimeout));
+      objv[objc++] = Tcl_NewStringObj("-timeout",8);
+      objv[objc++] = Tcl_NewStringObj(buf,-1);
+    }
+    objv[objc++] = Tcl_NewStringObj(String_val(ochan),-1);
+    script[0] = Tcl_NewStringObj("ns_ocaml",8);
+    script[1] = Tcl_NewStringObj("channel",7);
+    script[2] = Tcl_NewStringObj(String_val(ochan),-1);
+    objv[objc++] = Tcl_NewListObj(3,script);
+    objv[objc++] = Tcl_NewStringObj(String_val(owhen),-1);
+    if(!EvalObjv(itPtr->interp,objc,objv)) EvalError(itPtr->interp,"ns_connchan_callback");
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Database handles from nsdb pools, kept in a custom block pointing to a
+ * DbRef. Released handles are cleared in the DbRef, so using them raises
+ * Failure instead of touching a handle which may already belong to
+ * another request. Handles still held when the outermost OCaml execution
+ * returns are put back to their pools by NsOCamlDbRelease, the finalizer
+ * covers handles dropped outside of executions.
+ */
+
+typedef struct DbRef {
+    Ns_DbHandle *handle;
+    struct DbRef *nextPtr;      /* Held handles, with OCaml runtime held */
+    struct DbRef *prevPtr;
+} DbRef;
+
+static DbRef *dbHeld;
+
+#define DbRef_val(v) (*((DbRef **) Data_custom_val(v)))
+
+static void
+DbPut(DbRef *refPtr)
+{
+    if(!refPtr->handle) return;
+    if(refPtr->handle->fetchingRows) Ns_DbFlush(refPtr->handle);
+    Ns_DbPoolPutHandle(refPtr->handle);
+    refPtr->handle = 0;
+    if(refPtr->prevPtr) refPtr->prevPtr->nextPtr = refPtr->nextPtr; else dbHeld = refPtr->nextPtr;
+    if(refPtr->nextPtr) refPtr->nextPtr->prevPtr = refPtr->prevPtr;
+    refPtr->nextPtr = refPtr->prevPtr = 0;
+}
+
+static void
+DbFinalize(value v)
+{
+    DbRef *refPtr = DbRef_val(v);
+
+    if(refPtr->handle) Ns_Log(Warning,"nsocaml: ns_db: handle from pool %s was not released",refPtr->handle->poolname);
+    DbPut(refPtr);
+    ns_free(refPtr);
+}
+
+static struct custom_operations dbOps = {
+    "nsocaml.db",
+    DbFinalize,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+    custom_compare_ext_default,
+    custom_fixed_length_default
+};
+
+void
+NsOCamlDbRelease(void)
+{
+    while(dbHeld) {
+      Ns_Log(Warning,"nsocaml: ns_db: releasing handle from pool %s held after the request",dbHeld->handle->poolname);
+      DbPut(dbHeld);
+    }
+}
+
+static Ns_DbHandle *
+GetDb(value odb)
+{
+    Ns_DbHandle *handle = DbRef_val(odb)->handle;
+
+    if(!handle) caml_failwith("ns_db: handle has been released");
+    return handle;
+}
+
+static void
+DbError(Ns_DbHandle *handle,const char *sql)
+{
+    char msg[512];
+
+    snprintf(msg,sizeof(msg),"ns_db: %s: %s",
+             handle->dsExceptionMsg.length ? handle->dsExceptionMsg.string : "query failed",sql);
+    caml_failwith(msg);
+}
+
+/*
+ * Replaces each ? outside of string literals, quoted identifiers and
+ * comments with the next parameter quoted as a string literal, E'...'
+ * literals may contain backslash escapes. Returns NS_ERROR when the
+ * number of parameters does not match the placeholders.
+ */
+
+static Ns_ReturnCode
+DbBind(Ns_DString *dsPtr,const char *sql,value oparams)
+{
+    const char *p = sql, *start;
+    bool escapes;
+    char quote;
+
+    while(*p) {
+      start = p;
+      if(*p == '\'' || *p == '"') {
+        // Doubled quotes inside end one literal and start the next one
+        escapes = *p == '\'' && p > sql && (p[-1] == 'E' || p[-1] == 'e') &&
+                  (p - 1 == sql || !(isalnum((unsigned char)p[-2]) || p[-2] == '_'));
+        for(quote = *p++;*p && *p != quote;p++) {
+          if(escapes && *p == '\\' && p[1]) p++;
+        }
+        if(*p) p++;
+      } else
+      if(p[0] == '-' && p[1] == '-') {
+        while(*p && *p != '\n') p++;
+      } else
+      if(p[0] == '/' && p[1] == '*') {
+        for(p += 2;*p && !(p[0] == '*' && p[1] == '/');p++);
+        if(*p) p += 2;
+      } else
+      if(*p == '?') {
+        if(oparams == Val_emptylist) return NS_ERROR;
+        Ns_DStringNAppend(dsPtr,"'",1);
+        Ns_DbQuoteValue(dsPtr,String_val(Field(oparams,0)));
+        Ns_DStringNAppend(dsPtr,"'",1);
+        oparams = Field(oparams,1);
+        p++;
+        continue;
+      } else {
+        p++;
+      }
+      Ns_DStringNAppend(dsPtr,start,p - start);
+    }
+    return oparams == Val_emptylist ? NS_OK : NS_ERROR;
+}
+
+static void
+DbBindSql(Ns_DString *dsPtr,value osql,value oparams)
+{
+    if(DbBind(dsPtr,String_val(osql),oparams) != NS_OK) {
+      Ns_DStringFree(dsPtr);
+      caml_invalid_argument("ns_db: number of parameters does not match placeholders");
+    }
+}
+
+CAMLprim value
+Ns_DbGetHandle_OCaml(value opool)
+{
+    TRACE_STUB;
+    CAMLparam1(opool);
+    CAMLlocal1(retval);
+    const char *server = GetServer(), *pool = String_val(opool);
+    Ns_DbHandle *handle;
+    DbRef *refPtr;
+    char msg[256];
+
+    if(!*pool && !(pool = Ns_DbPoolDefault(server))) caml_failwith("ns_db_gethandle: no default pool");
+    if(!(handle = Ns_DbPoolGetHandle(server,pool))) {
+      snprintf(msg,sizeof(msg),"ns_db_gethandle: no handle from pool %s",pool);
+      caml_failwith(msg);
+    }
+    refPtr = ns_calloc(1,sizeof(DbRef));
+    refPtr->handle = handle;
+    if((refPtr->nextPtr = dbHeld)) dbHeld->prevPtr = refPtr;
+    dbHeld = refPtr;
+    retval = caml_alloc_custom(&dbOps,sizeof(DbRef*),0,1);
+    DbRef_val(retval) = refPtr;
+    CAMLreturn(retval);
+}
+
+CAMLprim value
+Ns_DbReleaseHandle_OCaml(value odb)
+{
+    TRACE_STUB;
+
+    DbPut(DbRef_val(odb));
+    return Val_unit;
+}
+
+CAMLprim value
+Ns_DbDml_OCaml(value odb,value osql,value oparams)
+{
+    TRACE_STUB;
+    CAMLparam3(odb,osql,oparams);
+    Ns_DbHandle *handle = GetDb(odb);
+    Ns_DString ds;
+
+    Ns_DStringInit(&ds);
+    DbBindSql(&ds,osql,oparams);
+    if(Ns_DbDML(handle,ds.string) != NS_OK) {
+      Ns_DStringFree(&ds);
+      DbError(handle,String_val(osql));
+    }
+    Ns_DStringFree(&ds);
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Starts a query, returns column names, rows are then fetched one by one
+ * with ns_db_getrow
+ */
+
+CAMLprim value
+Ns_DbSelect_OCaml(value odb,value osql,value oparams)
+{
+    TRACE_STUB;
+    CAMLparam3(odb,osql,oparams);
+    CAMLlocal1(retval);
+    Ns_DbHandle *handle = GetDb(odb);
+    Ns_DString ds;
+    Ns_Set *row;
+    size_t i;
+
+    if(handle->fetchingRows) Ns_DbFlush(handle);
+    Ns_DStringInit(&ds);
+    DbBindSql(&ds,osql,oparams);
+    row = Ns_DbSelect(handle,ds.string);
+    Ns_DStringFree(&ds);
+    if(!row) DbError(handle,String_val(osql));
+    retval = caml_alloc(Ns_SetSize(row),0);
+    for(i = 0;i < Ns_SetSize(row);i++) Store_field(retval,i,copy_string2(Ns_SetKey(row,i)));
+    CAMLreturn(retval);
+}
+
+/*
+ * Next row of the current query as an array of column values, NULL
+ * values become empty strings. None after the last row.
+ */
+
+CAMLprim value
+Ns_DbGetRow_OCaml(value odb)
+{
+    TRACE_STUB;
+    CAMLparam1(odb);
+    CAMLlocal2(retval,orow);
+    Ns_DbHandle *handle = GetDb(odb);
+    size_t i;
+
+    if(!handle->fetchingRows) CAMLreturn(Val_int(0));
+    switch(Ns_DbGetRow(handle,handle->row)) {
+     case NS_OK:
+        break;
+     case NS_END_DATA:
+        CAMLreturn(Val_int(0));
+     default:
+        DbError(handle,"getrow");
+    }
+    orow = caml_alloc(Ns_SetSize(handle->row),0);
+    for(i = 0;i < Ns_SetSize(handle->row);i++) Store_field(orow,i,copy_string2(Ns_SetValue(handle->row,i)));
+    retval = caml_alloc_small(1,0);
+    Field(retval,0) = orow;
+    CAMLreturn(retval);
+}
+
+CAMLprim value
+Ns_DbFlush_OCaml(value odb)
+{
+    TRACE_STUB;
+    CAMLparam1(odb);
+    Ns_DbHandle *handle = GetDb(odb);
+
+    if(handle->fetchingRows) Ns_DbFlush(handle);
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Tracing, see TRACE_STUB. The ring buffer of a thread is allocated on
+ * its first traced request.
+ */
+
+void
+NsOCamlTraceInit(const char *dir,int size)
+{
+    if(!dir || !*dir) return;
+    trace.dir = ns_strdup(dir);
+    trace.size = size > 0 ? size : 1024;
+}
+
+Tcl_WideInt
+NsOCamlTraceTime(void)
+{
+    TraceBuffer *bufPtr;
+    struct timespec ts;
+
+    if(!trace.dir || !(bufPtr = Ns_TlsGet(&traceTls)) || !bufPtr->active) return 0;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (Tcl_WideInt)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+NsOCamlTraceAdd(const char *name,const char *cat,Tcl_WideInt start)
+{
+    TraceBuffer *bufPtr;
+    TraceEvent *evPtr;
+    Tcl_WideInt end;
+
+    if(start == 0 || !(end = NsOCamlTraceTime())) return;
+    bufPtr = Ns_TlsGet(&traceTls);
+    evPtr = &bufPtr->events[bufPtr->count++ % (unsigned long)trace.size];
+    evPtr->name = name;
+    evPtr->cat = cat;
+    evPtr->start = start;
+    evPtr->end = end;
+}
+
+static TraceSpan
+TraceEnter(const char *name)
+{
+    TraceSpan span;
+
+    span.name = name;
+    span.start = trace.dir ? NsOCamlTraceTime() : 0;
+    return span;
+}
+
+static void
+TraceExit(TraceSpan *spanPtr)
+{
+    if(spanPtr->start) NsOCamlTraceAdd(spanPtr->name,"stub",spanPtr->start);
+}
+
+/*
+ * Starts recording spans of the request run by the current thread,
+ * returns its start time or 0 when tracing is off. An execution nested
+ * in a traced one(ns_eval running ns_ocaml) is part of the outer trace,
+ * it returns 0 and only its stubs are recorded.
+ */
+
+Tcl_WideInt
+NsOCamlTraceBegin(void)
+{
+    TraceBuffer *bufPtr;
+
+    if(!trace.dir) return 0;
+    if(!(bufPtr = Ns_TlsGet(&traceTls))) {
+      bufPtr = ns_calloc(1,sizeof(TraceBuffer) + (size_t)(trace.size - 1) * sizeof(TraceEvent));
+      Ns_TlsSet(&traceTls,bufPtr);
+    }
+    if(bufPtr->active) {
+      bufPtr->depth++;
+      return 0;
+    }
+    bufPtr->active = NS_TRUE;
+    bufPtr->depth = 0;
+    bufPtr->count = 0;
+    return NsOCamlTraceTime();
+}
+
+static void
+TraceString(Ns_DString *dsPtr,const char *str)
+{
+    const char *p;
+
+    for(p = str ? str : "";*p;p++) {
+      if(*p == '"' || *p == '\\' || (unsigned char)*p < 0x20) Ns_DStringPrintf(dsPtr,"\\u%04x",(unsigned char)*p);
+      else Ns_DStringNAppend(dsPtr,p,1);
+    }
+}
+
+/*
+ * Records the span of the whole request and writes the spans as Chrome
+ * trace JSON into trace directory, one file per request. Events which
+ * did not fit into the ring buffer are reported as dropped.
+ */
+
+void
+NsOCamlTraceEnd(const char *label,Tcl_WideInt start)
+{
+    TraceBuffer *bufPtr;
+    TraceEvent *evPtr;
+    Ns_Conn *conn = GetConn();
+    unsigned long i, first;
+    Ns_DString ds, path;
+    FILE *fp;
+
+    if(!trace.dir || !(bufPtr = Ns_TlsGet(&traceTls)) || !bufPtr->active) return;
+    if(bufPtr->depth > 0) {
+      bufPtr->depth--;
+      return;
+    }
+    NsOCamlTraceAdd(label,"request",start);
+    bufPtr->active = NS_FALSE;
+    first = bufPtr->count > (unsigned long)trace.size ? bufPtr->count - (unsigned long)trace.size : 0;
+    Ns_DStringInit(&ds);
+    Ns_DStringPrintf(&ds,"{\"traceEvents\":[");
+    for(i = first;i < bufPtr->count;i++) {
+      evPtr = &bufPtr->events[i % (unsigned long)trace.size];
+      Ns_DStringPrintf(&ds,"%s\n{\"name\":\"",i > first ? "," : "");
+      TraceString(&ds,evPtr->name);
+      Ns_DStringPrintf(&ds,"\",\"cat\":\"%s\",\"ph\":\"X\","
+                       "\"ts\":%" TCL_LL_MODIFIER "d,\"dur\":%" TCL_LL_MODIFIER "d,\"pid\":%d,\"tid\":%" PRIuPTR "}",
+                       evPtr->cat,evPtr->start,evPtr->end - evPtr->start,(int)getpid(),Ns_ThreadId());
+    }
+    Ns_DStringPrintf(&ds,"],\n\"displayTimeUnit\":\"ms\",\"otherData\":{\"url\":\"");
+    TraceString(&ds,conn ? conn->request.url : "");
+    Ns_DStringPrintf(&ds,"\",\"dropped\":%lu}}\n",first);
+
+    Ns_DStringInit(&path);
+    Ns_DStringPrintf(&path,"%s/trace-%" TCL_LL_MODIFIER "d-%" PRIuPTR ".json",trace.dir,start,Ns_ThreadId());
+    if((fp = fopen(path.string,"w"))) {
+      fwrite(ds.string,1,(size_t)ds.length,fp);
+      fclose(fp);
+    } else {
+      Ns_Log(Warning,"nsocaml: cannot write trace %s: %s",path.string,strerror(errno));
+    }
+    Ns_DStringFree(&path);
+    Ns_DStringFree(&ds);
+}
@@ -24,12 +24,77 @@
  *
  *)
 
+(*----- Exceptions -----*)
+
+(* Raised inside a handler which ran out of its time budget *)
+exception Ns_timeout
+
+(* Raised inside a handler which allocated more than allowed *)
+exception Ns_alloc_limit
+
+(*----- Types -----*)
+
+(* Stage at which a filter runs *)
+type filter_when = Preauth | Postauth | Trace
+
+(* Filter outcome: continue with the next filter, skip the remaining
+   filters or stop processing because the filter sent a response *)
+type filter_result = Filter_ok | Filter_break | Filter_return
+
+(* Log severity, same order as Ns_LogSeverity *)
+type severity = Log_notice | Log_warning | Log_error | Log_fatal | Log_bug | Log_debug | Log_dev
+
+(* Database handle from an nsdb pool *)
+type db
+
+(* Handle of a region published by ns_shared_publish, it keeps the region
+   alive after the name is republished or removed *)
+type 'a shared
+
+(* Backend HTTP request, timeout in milliseconds, 0 for the ns_http default *)
+type http_request = {
+  req_method : string;
+  req_url : string;
+  req_headers : (string * string) list;
+  req_body : string;
+  req_timeout : int;
+}
+
+(* Backend HTTP response, the body is kept outside of the OCaml heap *)
+type http_response = {
+  resp_status : int;
+  resp_headers : (string * string) list;
+  resp_body : (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t;
+}
+
+(* Queued HTTP request *)
+type http
+
+(* Event passed to connection channel callbacks *)
+type connchan_event = Chan_readable | Chan_writable | Chan_error | Chan_timeout | Chan_exit
+
+(* Server-sent events writer, over the streamed current connection or a
+   detached channel, events are buffered until flushed *)
+type sse = {
+  sse_chan : string option;
+  sse_buf : Buffer.t;
+  mutable sse_open : bool;
+  mutable sse_sent : int;
+  mutable sse_heartbeat : int;
+}
+
 (*----- Declare external functions -----*)
 
 external ns_eval : string -> string = "Ns_Eval_OCaml"
 
 external ns_log : string -> string -> unit = "Ns_Log_OCaml"
 
+external ns_log_sev : severity -> string -> unit = "Ns_LogSev_OCaml"
+
+external ns_log_enabled : severity -> bool = "Ns_LogEnabled_OCaml" [@@noalloc]
+
+external ns_logkv : severity -> string -> (string * string) list -> unit = "Ns_LogKv_OCaml"
+
 external ns_info : string -> string = "Ns_Info_OCaml"
 
 external ns_conn : string -> string = "Ns_Conn_OCaml"
@@ -38,6 +103,12 @@ external ns_server : string -> string = "Ns_Server_OCaml"
 
 external ns_write : string -> unit = "Ns_Write_OCaml"
 
+external ns_stream_start : int -> string -> (string * string) list -> bool = "Ns_StreamStart_OCaml"
+
+external ns_stream_write : string -> bool = "Ns_StreamWrite_OCaml"
+
+external ns_conn_sent : unit -> bool = "Ns_ConnSent_OCaml"
+
 external ns_returnredirect : string -> unit = "Ns_ReturnRedirect_OCaml"
 
 external ns_returnnotfound : unit -> unit = "Ns_ReturnNotFound_OCaml"
@@ -50,6 +121,16 @@ external ns_returninternalerror : unit -> unit = "Ns_ReturnInternalError_OCaml"
 
 external ns_return : int -> string -> string -> unit = "Ns_Return_OCaml"
 
+external ns_returnv : int -> string -> string array -> unit = "Ns_ReturnV_OCaml"
+
+external ns_return_precompressed : string -> int -> string -> string -> unit = "Ns_ReturnPrecompressed_OCaml"
+
+external ns_compress : int -> unit = "Ns_Compress_OCaml"
+
+external ns_response_nocache : unit -> unit = "Ns_ResponseNoCache_OCaml"
+
+external ns_response_cache_flush : string -> unit = "Ns_ResponseCacheFlush_OCaml"
+
 external ns_returnfile : int -> string -> string -> unit = "Ns_ReturnFile_OCaml"
 
 external ns_queryexists : string -> int = "Ns_QueryExists_OCaml"
@@ -62,6 +143,14 @@ external ns_urlencode : string -> string = "Ns_UrlEncode_OCaml"
 
 external ns_urldecode : string -> string = "Ns_UrlDecode_OCaml"
 
+external ns_urlencode_array : string array -> string array = "Ns_UrlEncodeArray_OCaml"
+
+external ns_urldecode_array : string array -> string array = "Ns_UrlDecodeArray_OCaml"
+
+external ns_urlencode_query : (string * string) list -> string = "Ns_UrlEncodeQuery_OCaml"
+
+external ns_write_urlencode : string -> unit = "Ns_WriteUrlEncode_OCaml"
+
 external ns_config : string -> string -> string = "Ns_Config_OCaml"
 
 external ns_guesstype : string -> string = "Ns_GuessType_OCaml"
@@ -70,6 +159,10 @@ external ns_quotehtml : string -> string = "Ns_QuoteHtml_OCaml"
 
 external ns_striphtml : string -> string = "Ns_StripHtml_OCaml"
 
+external ns_quotehtml_scalar : string -> string = "Ns_QuoteHtmlScalar_OCaml"
+
+external ns_striphtml_scalar : string -> string = "Ns_StripHtmlScalar_OCaml"
+
 external ns_set_cleanup : unit -> unit = "Ns_SetCleanup_OCaml"
 
 external ns_set_array : unit -> string list = "Ns_SetArray_OCaml"
@@ -130,12 +223,51 @@ external ns_set_merge : string -> string -> unit = "Ns_SetMerge_OCaml"
 
 external ns_set_move : string -> string -> unit = "Ns_SetMove_OCaml"
 
+external ns_register_proc : string -> string -> (unit -> unit) -> unit = "Ns_RegisterProc_OCaml"
+
+external ns_unregister_proc : string -> string -> unit = "Ns_UnRegisterProc_OCaml"
+
+external ns_register_filter : filter_when -> string -> string -> (unit -> filter_result) -> unit = "Ns_RegisterFilter_OCaml"
+
+external ns_schedule_proc : int -> (unit -> unit) -> int = "Ns_ScheduleProc_OCaml"
+
+external ns_schedule_daily : int -> int -> (unit -> unit) -> int = "Ns_ScheduleDaily_OCaml"
+
+external ns_after : int -> (unit -> unit) -> int = "Ns_After_OCaml"
+
+external ns_unschedule_proc : int -> unit = "Ns_UnscheduleProc_OCaml"
+
+external ns_job_queue : (unit -> string) -> int = "Ns_JobQueue_OCaml"
+
+external ns_job_wait : int -> string = "Ns_JobWait_OCaml"
+
+external ns_cache_create : string -> int -> int -> unit = "Ns_CacheCreate_OCaml"
+
+external ns_cache_eval : string -> string -> (unit -> string) -> string = "Ns_CacheEval_OCaml"
+
+external ns_cache_flush : string -> string -> unit = "Ns_CacheFlush_OCaml"
+
+external ns_cache_stats : string -> string = "Ns_CacheStats_OCaml"
+
+external ns_shared_publish : string -> 'a -> unit = "Ns_SharedPublish_OCaml"
+
+external ns_shared_get : string -> 'a shared = "Ns_SharedGet_OCaml"
+
+(* Root of the region itself, only ns_shared_with may hand it out *)
+external ns_shared_root : 'a shared -> 'a = "Ns_SharedValue_OCaml"
+
+external ns_shared_remove : string -> unit = "Ns_SharedRemove_OCaml"
+
 external ns_normalizepath : string -> string = "Ns_NormalizePath_OCaml"
 
 external ns_url2file : string -> string = "Ns_Url2File_OCaml"
 
 external ns_time : unit -> int = "Ns_Time_OCaml"
 
+external ns_time_usec : unit -> int = "Ns_TimeUsec_OCaml"
+
+external ns_monotonic_usec : unit -> int = "Ns_MonotonicUsec_OCaml"
+
 external ns_fmttime : int -> string -> string = "Ns_FmtTime_OCaml"
 
 external nsv_get : string -> string -> string = "Ns_NsvGet_OCaml"
@@ -154,3 +286,292 @@ external nsv_names : string -> string list = "Ns_NsvNames_OCaml"
 
 external nsv_array_names : string -> string -> string list = "Ns_NsvArrayNames_OCaml"
 
+external ns_http_queue : http_request -> http = "Ns_HttpQueue_OCaml"
+
+external ns_http_wait : http -> http_response = "Ns_HttpWait_OCaml"
+
+external ns_http_cancel : http -> unit = "Ns_HttpCancel_OCaml"
+
+external ns_connchan_detach : unit -> string = "Ns_ConnChanDetach_OCaml"
+
+external ns_connchan_read : string -> string = "Ns_ConnChanRead_OCaml"
+
+external ns_connchan_write : string -> string -> int = "Ns_ConnChanWrite_OCaml"
+
+external ns_connchan_release : string -> unit = "Ns_ConnChanClose_OCaml"
+
+external ns_connchan_listen : string -> string -> int -> unit = "Ns_ConnChanCallback_OCaml"
+
+external ns_db_gethandle : string -> db = "Ns_DbGetHandle_OCaml"
+
+external ns_db_releasehandle : db -> unit = "Ns_DbReleaseHandle_OCaml"
+
+external ns_db_dml : db -> string -> string list -> unit = "Ns_DbDml_OCaml"
+
+external ns_db_select : db -> string -> string list -> string array = "Ns_DbSelect_OCaml"
+
+external ns_db_getrow : db -> string array option = "Ns_DbGetRow_OCaml"
+
+external ns_db_flush : db -> unit = "Ns_DbFlush_OCaml"
+
+
+(*----- Shared data -----*)
+
+(* Applies f to the shared value without copying, the handle is kept
+   reachable until f returns, so the region cannot be freed under it.
+   f must neither mutate the value nor return or store any part of it *)
+
+let ns_shared_with h f =
+  let r = f (ns_shared_root h) in
+  ignore (Sys.opaque_identity h);
+  r
+
+(* Copy of the shared value in the OCaml heap, independent of the handle
+   and safe to keep and mutate *)
+
+let ns_shared_value (h : 'a shared) : 'a =
+  ns_shared_with h (fun v -> Marshal.from_string (Marshal.to_string v []) 0)
+
+(*----- OCaml server pages -----*)
+
+(* Page function of the .mlp module being loaded, set by the module itself *)
+let ns_mlp_page = ref (fun () -> ())
+
+(*----- Batch url encoding -----*)
+
+let ns_urlencode_list l = Array.to_list (ns_urlencode_array (Array.of_list l))
+
+let ns_urldecode_list l = Array.to_list (ns_urldecode_array (Array.of_list l))
+
+(*----- Formatted logging -----*)
+
+(* Printf style logging, the message is not formatted when the severity
+   is disabled, arguments are still evaluated by the caller *)
+
+let ns_logf sev fmt =
+  if ns_log_enabled sev then Printf.ksprintf (ns_log_sev sev) fmt
+  else Printf.ikfprintf ignore () fmt
+
+(*----- Database -----*)
+
+(* Runs f with a handle from the pool, "" for the default pool, the
+   handle is released even when f raises *)
+
+let ns_db_with pool f =
+  let db = ns_db_gethandle pool in
+  Fun.protect (fun () -> f db) ~finally:(fun () -> ns_db_releasehandle db)
+
+(* Folds over rows as they are fetched, the result set is never held in
+   memory as a whole *)
+
+let ns_db_fold db sql params f init =
+  ignore (ns_db_select db sql params);
+  let rec loop acc =
+    match ns_db_getrow db with
+      None -> acc
+    | Some row -> loop (f acc row) in
+  try loop init with e -> ns_db_flush db; raise e
+
+let ns_db_iter db sql params f = ns_db_fold db sql params (fun () row -> f row) ()
+
+let ns_db_rows db sql params = List.rev (ns_db_fold db sql params (fun l row -> row :: l) [])
+
+let ns_db_0or1row db sql params =
+  ignore (ns_db_select db sql params);
+  match ns_db_getrow db with
+    None -> None
+  | Some row ->
+      if ns_db_getrow db <> None then begin
+        ns_db_flush db;
+        failwith ("ns_db_0or1row: query returned more than one row: " ^ sql)
+      end;
+      Some row
+
+(*----- HTTP client -----*)
+
+let ns_http_request ?(meth="GET") ?(headers=[]) ?(body="") ?(timeout=0) url =
+  { req_method = meth; req_url = url; req_headers = headers; req_body = body; req_timeout = timeout }
+
+let ns_http_run req = ns_http_wait (ns_http_queue req)
+
+(* Queues all requests before waiting for any, so they run concurrently.
+   When queueing or waiting fails the requests not waited for yet are
+   cancelled before the exception is passed on *)
+
+let ns_http_cancel_all handles =
+  List.iter (fun h -> try ns_http_cancel h with _ -> ()) handles
+
+let ns_http_run_all reqs =
+  let queued = ref [] in
+  (try List.iter (fun req -> queued := ns_http_queue req :: !queued) reqs
+   with e -> ns_http_cancel_all !queued; raise e);
+  let rec wait = function
+      [] -> []
+    | h :: rest ->
+        match ns_http_wait h with
+          resp -> resp :: wait rest
+        | exception e -> ns_http_cancel_all rest; raise e in
+  wait (List.rev !queued)
+
+let ns_http_body_string resp =
+  let body = resp.resp_body in
+  String.init (Bigarray.Array1.dim body) (Bigarray.Array1.unsafe_get body)
+
+let ns_http_header resp name =
+  let name = String.lowercase_ascii name in
+  snd (List.find (fun (k, _) -> String.lowercase_ascii k = name) resp.resp_headers)
+
+(*----- Connection channels -----*)
+
+(* Callbacks of detached connections by channel name, called by
+   ns_ocaml channel, a callback returns false to close the channel *)
+
+let ns_connchan_callbacks : (string, connchan_event -> bool) Hashtbl.t = Hashtbl.create 16
+
+let ns_connchan_callback ?(events="r") ?(timeout=0) chan f =
+  Hashtbl.replace ns_connchan_callbacks chan f;
+  ns_connchan_listen chan events timeout
+
+let ns_connchan_close chan =
+  Hashtbl.remove ns_connchan_callbacks chan;
+  ns_connchan_release chan
+
+(* Argument is "channel when", returns the ns_connchan callback result:
+   true to keep the channel, false to have NaviServer close it *)
+
+let ns_connchan_dispatch arg =
+  let chan, ev =
+    match String.index_opt arg ' ' with
+      Some i -> String.sub arg 0 i, String.sub arg (i + 1) (String.length arg - i - 1)
+    | None -> arg, "" in
+  let ev = match ev with
+      "r" -> Chan_readable
+    | "w" -> Chan_writable
+    | "t" -> Chan_timeout
+    | "x" -> Chan_exit
+    | _ -> Chan_error in
+  let keep =
+    match Hashtbl.find_opt ns_connchan_callbacks chan with
+      None -> false
+    | Some f ->
+        try f ev && ev <> Chan_exit with e ->
+          ns_log "Error" ("ns_connchan: " ^ chan ^ ": " ^ Printexc.to_string e);
+          false in
+  if not keep then Hashtbl.remove ns_connchan_callbacks chan;
+  keep
+
+(*----- Server-sent events -----*)
+
+let ns_sse_headers = ["Cache-Control", "no-cache"; "X-Accel-Buffering", "no"]
+
+(* Streams events on the current connection, the handler keeps the
+   connection thread and the OCaml runtime until it returns *)
+
+let ns_sse_start ?(headers=[]) () =
+  let ok = ns_stream_start 200 "text/event-stream" (ns_sse_headers @ headers) in
+  { sse_chan = None; sse_buf = Buffer.create 1024; sse_open = ok;
+    sse_sent = ns_monotonic_usec (); sse_heartbeat = -1 }
+
+(* Detaches the connection and streams events on the channel, events are
+   sent later by scheduled procs or other requests. The client closing
+   the connection is noticed by the readable callback. *)
+
+let ns_sse_detach ?(headers=[]) () =
+  let chan = ns_connchan_detach () in
+  let w = { sse_chan = Some chan; sse_buf = Buffer.create 1024; sse_open = true;
+            sse_sent = ns_monotonic_usec (); sse_heartbeat = -1 } in
+  let head = Buffer.create 256 in
+  Buffer.add_string head "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nConnection: close\r\n";
+  List.iter (fun (k, v) -> Printf.bprintf head "%s: %s\r\n" k v) (ns_sse_headers @ headers);
+  Buffer.add_string head "\r\n";
+  ignore (ns_connchan_write chan (Buffer.contents head));
+  ns_connchan_callback chan (fun ev ->
+    if ev = Chan_readable && ns_connchan_read chan <> "" then true
+    else begin
+      w.sse_open <- false;
+      if w.sse_heartbeat >= 0 then ns_unschedule_proc w.sse_heartbeat;
+      w.sse_heartbeat <- -1;
+      false
+    end);
+  w
+
+let ns_sse_connected w = w.sse_open
+
+(* Lines end with CR, LF or CRLF like in the event stream itself, multi-line
+   data and comments become several fields. Event names and ids must be
+   single lines, a line break would end the field early *)
+
+let ns_sse_lines text =
+  if not (String.contains text '\r') then String.split_on_char '\n' text else begin
+    let b = Buffer.create (String.length text) in
+    String.iteri (fun i c ->
+      if c <> '\r' then Buffer.add_char b c else
+      if i + 1 = String.length text || text.[i + 1] <> '\n' then Buffer.add_char b '\n') text;
+    String.split_on_char '\n' (Buffer.contents b)
+  end
+
+let ns_sse_field w name text =
+  List.iter (fun line -> Printf.bprintf w.sse_buf "%s: %s\n" name line) (ns_sse_lines text)
+
+let ns_sse_check name text =
+  if String.contains text '\n' || String.contains text '\r' then
+    invalid_arg ("ns_sse_event: line break in " ^ name)
+
+let ns_sse_event ?event ?id ?retry w data =
+  Option.iter (ns_sse_check "event") event;
+  Option.iter (ns_sse_check "id") id;
+  Option.iter (ns_sse_field w "event") event;
+  Option.iter (ns_sse_field w "id") id;
+  Option.iter (fun ms -> Printf.bprintf w.sse_buf "retry: %d\n" ms) retry;
+  ns_sse_field w "data" data;
+  Buffer.add_char w.sse_buf '\n'
+
+let ns_sse_comment w text =
+  ns_sse_field w "" text;
+  Buffer.add_char w.sse_buf '\n'
+
+let ns_sse_close w =
+  if w.sse_heartbeat >= 0 then ns_unschedule_proc w.sse_heartbeat;
+  w.sse_heartbeat <- -1;
+  if w.sse_open then begin
+    w.sse_open <- false;
+    match w.sse_chan with
+      Some chan -> ns_connchan_close chan
+    | None -> ignore (ns_conn "close")
+  end
+
+(* Sends buffered events, returns false once the client has gone. A
+   channel which does not take the whole buffer is closed, the client
+   is too slow to keep up. *)
+
+let ns_sse_flush w =
+  if w.sse_open && Buffer.length w.sse_buf > 0 then begin
+    let data = Buffer.contents w.sse_buf in
+    Buffer.clear w.sse_buf;
+    let ok =
+      match w.sse_chan with
+        None -> ns_stream_write data
+      | Some chan ->
+          try ns_connchan_write chan data = String.length data with Failure _ -> false in
+    w.sse_sent <- ns_monotonic_usec ();
+    if not ok then ns_sse_close w
+  end;
+  w.sse_open
+
+(* Sends a comment when nothing has been sent for interval seconds, so
+   proxies keep the connection and a disconnected client is noticed *)
+
+let ns_sse_keepalive w interval =
+  if ns_monotonic_usec () - w.sse_sent >= interval * 1000000 then begin
+    ns_sse_comment w "ping";
+    ignore (ns_sse_flush w)
+  end;
+  w.sse_open
+
+(* Runs ns_sse_keepalive every interval seconds on the scheduler, for
+   detached writers *)
+
+let ns_sse_heartbeat w interval =
+  if w.sse_heartbeat < 0 then
+    w.sse_heartbeat <- ns_schedule_proc interval (fun () ->
+      if not (ns_sse_keepalive w interval) then ns_sse_close w)
@@ -37,20 +37,193 @@
 #include <caml/callback.h>
 #include <caml/memory.h>
 #include <caml/mlvalues.h>
+#include <caml/signals.h>
+#include <caml/minor_gc.h>
+#include "nsocaml.h"
 
 #define NSOCAML_VERSION  "0.2"
 
+/*
+ * Signal recorded in the OCaml runtime when a handler runs out of its
+ * time budget, it is never delivered by the OS, the runtime just runs the
+ * OCaml handler installed by nsocaml.ml on the next poll point.
+ */
+
+#define OCAML_TIMEOUT_SIGNAL SIGVTALRM
+
+/*
+ * Signal recorded by the profiler thread, the OCaml handler samples the
+ * call stack of the running handler, see nsocaml.ml.
+ */
+
+#define OCAML_PROFILE_SIGNAL SIGPROF
+
 NS_EXPORT Ns_ModuleInitProc Ns_ModuleInit;
 
 static Ns_OpProc OCAMLHandler;
+static Ns_OpProc OCAMLTemplateHandler;
 static Ns_TclTraceProc OCAMLInterpInit;
 
 //static int OCAMLHandler(void *arg,Ns_Conn *conn);
 //static int OCAMLInterpInit(Tcl_Interp *interp,void *context);
 static int OCAMLCmd(void *context,Tcl_Interp *interp,int objc,Tcl_Obj * const objv[]);
 
-static Ns_Mutex ocamlLock;
+static Ns_ThreadProc OCAMLWatchdog;
+static Ns_ThreadProc OCAMLProfiler;
+
+static Ns_ReturnCode OCAMLEnter(bool admission,const Ns_Time *budget);
+static bool OCAMLLeave(void);
+static Ns_ReturnCode OCAMLUnavailable(Ns_Conn *conn);
+
+typedef enum {
+    OCAML_OK,                   /* Executed successfully */
+    OCAML_EXCEPTION,            /* Raised an exception */
+    OCAML_EXPIRED,              /* Interrupted by the watchdog */
+    OCAML_BUSY                  /* Rejected by admission control */
+} OCamlResult;
+
+static OCamlResult OCAMLExec(const char *label,value *fn,const char *arg,const Ns_Time *budget,bool admission,int *resultPtr);
+static OCamlResult OCAMLRun(Ns_Conn *conn,const char *label,value *fn,const char *arg,const Ns_Time *budget,int *resultPtr);
+static Ns_ThreadProc OCAMLWorker;
+static void OCAMLBudget(const char *url,Ns_Time *timePtr);
+
 static value *ocamlLoader;
+static value *ocamlLimit;
+static value *ocamlProfile;
+static value *ocamlChannel;
+
+/*
+ * OCaml runtime is not reentrant, all calls into it are serialized through
+ * the gate below. It also implements admission control: the number of
+ * threads queued for the runtime and the time they may wait are limited
+ * by the module config, requests over the limits get 503 right away.
+ */
+
+static struct {
+    Ns_Mutex lock;
+    Ns_Cond cond;
+    uintptr_t owner;            /* Thread currently running OCaml code */
+    int depth;                  /* Nested calls from the owner thread */
+    int waiting;                /* Threads queued for the runtime */
+    int maxwaiting;             /* Queue limit, 0 means unlimited */
+    Ns_Time maxwait;            /* Queue wait limit, 0 means unlimited */
+    int retryafter;             /* Retry-After for rejected requests */
+    unsigned long nrun;         /* Total executions */
+    unsigned long nqueued;      /* Executions which had to wait */
+    unsigned long nrejected;    /* Rejected because queue was full */
+    unsigned long ntimeout;     /* Rejected because of the wait limit */
+    Ns_Cond watch;              /* Wakes up the watchdog thread */
+    Ns_Time deadline;           /* End of the current time budget */
+    bool expired;               /* Current execution has been interrupted */
+    unsigned long nexpired;     /* Executions interrupted by the watchdog */
+} gate;
+
+/*
+ * Sampling profiler, protected by the gate lock like the watchdog
+ */
+
+static struct {
+    Ns_Cond cond;               /* Wakes up the profiler thread */
+    bool running;               /* Between profile start and stop */
+    Ns_Time interval;           /* Time between samples */
+    unsigned long nsamples;     /* Samples recorded since start */
+} profile;
+
+/*
+ * Time budgets for OCaml handlers, the default one from the module section
+ * and per URL pattern ones from the timeouts subsection.
+ */
+
+typedef struct Budget {
+    char *pattern;
+    Ns_Time timeout;
+} Budget;
+
+static Budget *budgets;
+static int nbudgets;
+static Ns_Time defaultBudget;
+
+/*
+ * Response cache of pages, opt-in per URL pattern from the responsecache
+ * subsection. Complete responses are kept under the URL plus the query
+ * arguments and headers named by the rule and served without running
+ * OCaml until the TTL expires or the page file changes.
+ */
+
+typedef struct CacheRule {
+    char *pattern;
+    Ns_Time ttl;
+    int nquery;
+    const char **query;         /* Query arguments in the key */
+    int nheaders;
+    const char **headers;       /* Request headers in the key */
+    char *vary;                 /* Same headers for the Vary header */
+} CacheRule;
+
+static CacheRule *cacheRules;
+static int ncacheRules;
+static Ns_Cache *responseCache;
+
+static Ns_ReturnCode OCAMLCacheRuleParse(const char *pattern,const char *spec,CacheRule *rulePtr);
+static Ns_ReturnCode OCAMLCachedPage(Ns_Conn *conn,const CacheRule *rulePtr,const char *file,value *loader);
+
+/*
+ * GC policy, heap parameters are passed to the runtime through
+ * OCAMLRUNPARAM, allocation limit is enforced by nsocaml.ml
+ */
+
+static struct {
+    bool minorgc;               /* Empty minor heap after each request */
+    Tcl_WideInt maxalloc;       /* Per request allocation limit in bytes */
+} gc;
+
+static void OCAMLRunParam(const char *path,Ns_DString *dsPtr);
+
+/*
+ * OCaml server pages(.mlp), templates are translated and compiled by
+ * nsocaml.ml into modules kept in the cache directory
+ */
+
+static struct {
+    const char *dir;            /* Cache of compiled templates */
+    const char *compiler;       /* Bytecode compiler command */
+} mlp;
+
+static value *ocamlTemplate;
+
+/*
+ * Optional pool of OCaml worker threads. Connection threads queue their
+ * requests and wait, the workers run OCaml code on behalf of them, so
+ * connection threads never touch the runtime themselves.
+ */
+
+#define JOB_QUEUED  0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+
+typedef struct Job {
+    struct Job *nextPtr;
+    Ns_Conn *conn;
+    const char *label;
+    value *fn;
+    const char *arg;
+    Ns_Time budget;
+    int *resultPtr;
+    int state;
+    OCamlResult result;
+    Ns_Cond cond;               /* Signalled when the job changes state */
+} Job;
+
+static struct {
+    Ns_Mutex lock;
+    Ns_Cond cond;               /* Signalled when a job is queued */
+    Job *firstPtr;
+    Job *lastPtr;
+    int nworkers;
+    int queued;
+    unsigned long nrejected;
+    unsigned long ntimeout;
+} pool;
 
 NS_EXPORT int Ns_ModuleVersion = 1;
 
@@ -61,8 +234,68 @@ Ns_ModuleInit(const char *server, const char *module)
     NsServer *servPtr;
     char *argv[] = { 0, 0, 0 };
     const char *path;
+    Ns_Set *set;
+    size_t i;
 
     path = Ns_ConfigGetPath(server,module,NULL);
+    // Admission control
+    Ns_MutexSetName(&gate.lock,"nsocaml:gate");
+    gate.maxwaiting = Ns_ConfigIntRange(path,"maxwaiting",0,0,INT_MAX);
+    gate.retryafter = Ns_ConfigIntRange(path,"retryafter",5,0,INT_MAX);
+    Ns_ConfigTimeUnitRange(path,"maxwait","0s",0,0,INT_MAX,0,&gate.maxwait);
+    // Watchdog time budgets
+    Ns_ConfigTimeUnitRange(path,"timeout","0s",0,0,INT_MAX,0,&defaultBudget);
+    if((set = Ns_ConfigGetSection(Ns_ConfigGetPath(server,module,"timeouts",NULL)))) {
+      budgets = ns_calloc(Ns_SetSize(set),sizeof(Budget));
+      for(i = 0;i < Ns_SetSize(set);i++) {
+        if(Ns_GetTimeFromString(NULL,Ns_SetValue(set,i),&budgets[nbudgets].timeout) != TCL_OK) {
+          Ns_Log(Warning,"nsocaml: invalid timeout for %s: %s",Ns_SetKey(set,i),Ns_SetValue(set,i));
+          continue;
+        }
+        budgets[nbudgets++].pattern = ns_strdup(Ns_SetKey(set,i));
+      }
+    }
+    // Response cache
+    if((set = Ns_ConfigGetSection(Ns_ConfigGetPath(server,module,"responsecache",NULL)))) {
+      cacheRules = ns_calloc(Ns_SetSize(set),sizeof(CacheRule));
+      for(i = 0;i < Ns_SetSize(set);i++) {
+        if(OCAMLCacheRuleParse(Ns_SetKey(set,i),Ns_SetValue(set,i),&cacheRules[ncacheRules]) != NS_OK) {
+          Ns_Log(Warning,"nsocaml: invalid response cache rule for %s: %s",Ns_SetKey(set,i),Ns_SetValue(set,i));
+          continue;
+        }
+        ncacheRules++;
+      }
+      responseCache = Ns_CacheCreateSz("nsocaml:response",TCL_STRING_KEYS,
+                                       (size_t)Ns_ConfigMemUnitRange(path,"responsecachesize","10MB",10*1024*1024,0,LLONG_MAX),
+                                       NsOCamlFreeResponse);
+    }
+    Ns_ThreadCreate(OCAMLWatchdog,0,0,0);
+    Ns_ThreadCreate(OCAMLProfiler,0,0,0);
+    // GC policy
+    gc.minorgc = Ns_ConfigBool(path,"minorgc",NS_FALSE);
+    gc.maxalloc = Ns_ConfigMemUnitRange(path,"maxalloc","0",0,0,LLONG_MAX);
+    // Template compiler
+    Ns_DStringInit(&ds);
+    mlp.dir = Ns_ConfigString(path,"mlpdir",0);
+    if(!mlp.dir || !*mlp.dir) mlp.dir = ns_strdup(Ns_DStringPrintf(&ds,"%s/modules/nsocaml",Ns_InfoHomePath()));
+    Ns_DStringSetLength(&ds,0);
+    mlp.compiler = Ns_ConfigString(path,"ocamlc","ocamlc");
+    OCAMLRunParam(path,&ds);
+    if(ds.length > 0) {
+      Ns_Log(Notice,"nsocaml: OCAMLRUNPARAM=%s",ds.string);
+      setenv("OCAMLRUNPARAM",ds.string,1);
+    }
+    Ns_DStringFree(&ds);
+    // Worker pool
+    NsOCamlLibInit();
+    // Tracing
+    NsOCamlTraceInit(Ns_ConfigString(path,"tracedir",""),Ns_ConfigIntRange(path,"tracesize",1024,1,INT_MAX));
+    // Compression
+    NsOCamlCompressInit(Ns_ConfigIntRange(path,"compress",0,0,9),
+                        (size_t)Ns_ConfigMemUnitRange(path,"compressminsize","1kB",1024,0,INT_MAX),
+                        (size_t)Ns_ConfigMemUnitRange(path,"gzipcache","10MB",10*1024*1024,0,LLONG_MAX));
+    Ns_MutexSetName(&pool.lock,"nsocaml:pool");
+    pool.nworkers = Ns_ConfigIntRange(path,"workers",0,0,1024);
     // Initialize OCaml dynamic loader
     Ns_DStringInit(&ds);
     Ns_DStringPrintf(&ds,"%s/bin/nsocaml.so",Ns_InfoHomePath());
@@ -73,10 +306,29 @@ Ns_ModuleInit(const char *server, const char *module)
       Ns_Log(Error,"nsocaml: ns_ocaml_load function is not found");
       return TCL_ERROR;
     }
+    if(!(ocamlLimit = caml_named_value("ns_ocaml_limit"))) {
+      Ns_Log(Error,"nsocaml: ns_ocaml_limit function is not found");
+      return TCL_ERROR;
+    }
+    if(!(ocamlTemplate = caml_named_value("ns_ocaml_mlp"))) {
+      Ns_Log(Error,"nsocaml: ns_ocaml_mlp function is not found");
+      return TCL_ERROR;
+    }
+    if(!(ocamlProfile = caml_named_value("ns_ocaml_profile"))) {
+      Ns_Log(Error,"nsocaml: ns_ocaml_profile function is not found");
+      return TCL_ERROR;
+    }
+    if(!(ocamlChannel = caml_named_value("ns_ocaml_channel"))) {
+      Ns_Log(Error,"nsocaml: ns_ocaml_channel function is not found");
+      return TCL_ERROR;
+    }
+    for(i = 0;i < (size_t)pool.nworkers;i++) Ns_ThreadCreate(OCAMLWorker,INT2PTR(i),0,0);
     // OCaml object files handler
     if((servPtr = NsGetServer(server))) {
       Ns_RegisterRequest(server,"GET","*.cmo",OCAMLHandler,0,servPtr,0);
       Ns_RegisterRequest(server,"POST","*.cmo",OCAMLHandler,0,servPtr,0);
+      Ns_RegisterRequest(server,"GET","*.mlp",OCAMLTemplateHandler,0,servPtr,0);
+      Ns_RegisterRequest(server,"POST","*.mlp",OCAMLTemplateHandler,0,servPtr,0);
     }
     // Initialize Tcl interpreter
     Ns_TclRegisterTrace(server, OCAMLInterpInit, 0, NS_TCL_TRACE_CREATE);
@@ -93,14 +345,25 @@ OCAMLInterpInit(Tcl_Interp *interp, const void *context)
 static int
 OCAMLCmd(ClientData UNUSED(clientData), Tcl_Interp *interp,int objc,Tcl_Obj * const objv[])
 {
-    int cmd;
+    int cmd, sub, keep = 0;
+    char *msg;
     value *fn, res, arg = Val_unit;
+    Tcl_DString ds;
+    Ns_Time interval = { 0, 10000 };
     enum commands {
-        cmdCall, cmdLoad
+        cmdCall, cmdChannel, cmdLoad, cmdProfile, cmdStats
     };
       
     static const char *sCmd[] = {
-        "call", "load",
+        "call", "channel", "load", "profile", "stats",
+        0
+    };
+    enum profileCommands {
+        cmdStart, cmdStop, cmdDump
+    };
+
+    static const char *pCmd[] = {
+        "start", "stop", "dump",
         0
     };
 
@@ -117,14 +380,11 @@ OCAMLCmd(ClientData UNUSED(clientData), Tcl_Interp *interp,int objc,Tcl_Obj * co
            Tcl_WrongNumArgs(interp,2,objv,"filename");
            return TCL_ERROR;
          }
+         if(OCAMLEnter(NS_TRUE,0) != NS_OK) goto busy;
          arg = copy_string(Tcl_GetString(objv[2]));
-         Ns_MutexLock(&ocamlLock);
          res = callback_exn(*ocamlLoader,arg);
-         Ns_MutexUnlock(&ocamlLock);
-         if(Is_exception_result(res)) {
-           Tcl_AppendResult(interp,format_caml_exception(Extract_exception(res)),free);
-           return TCL_ERROR;
-         }
+         if(Is_exception_result(res)) goto error;
+         OCAMLLeave();
          break;
 
      case cmdCall:
@@ -136,48 +396,752 @@ OCAMLCmd(ClientData UNUSED(clientData), Tcl_Interp *interp,int objc,Tcl_Obj * co
            Tcl_AppendResult(interp,Tcl_GetString(objv[2])," function is not defined",0);
            return TCL_ERROR;
          }
-         if(objc > 3) arg = copy_string(Tcl_GetString(objv[2]));
-         Ns_MutexLock(&ocamlLock);
+         if(OCAMLEnter(NS_TRUE,0) != NS_OK) goto busy;
+         if(objc > 3) arg = copy_string(Tcl_GetString(objv[3]));
          res = callback_exn(*fn,arg);
-         Ns_MutexUnlock(&ocamlLock);
-         if(Is_exception_result(res)) {
-           Tcl_AppendResult(interp,format_caml_exception(Extract_exception(res)),free);
+         if(Is_exception_result(res)) goto error;
+         // String returned by the function becomes the Tcl result
+         if(Is_block(res) && Tag_val(res) == String_tag)
+           Tcl_SetObjResult(interp,Tcl_NewStringObj(String_val(res),(int)caml_string_length(res)));
+         OCAMLLeave();
+         break;
+
+     case cmdChannel:
+         // Callback of ns_connchan, the event is appended by NaviServer.
+         // Not subject to admission, dropping the event would stall the
+         // channel, but it runs under the default time budget and the
+         // allocation limit, a callback over them closes the channel.
+         // The Tcl interp used by its ns_connchan calls is released by
+         // OCAMLLeave, so a long-lived channel does not pile them up.
+         if(objc < 4) {
+           Tcl_WrongNumArgs(interp,2,objv,"channel when");
            return TCL_ERROR;
          }
+         Tcl_DStringInit(&ds);
+         Tcl_DStringAppend(&ds,Tcl_GetString(objv[2]),-1);
+         Tcl_DStringAppend(&ds," ",1);
+         Tcl_DStringAppend(&ds,Tcl_GetString(objv[3]),-1);
+         if(OCAMLExec(ds.string,ocamlChannel,ds.string,&defaultBudget,NS_FALSE,&keep) != OCAML_OK) keep = 0;
+         Tcl_DStringFree(&ds);
+         Tcl_SetObjResult(interp,Tcl_NewIntObj(keep));
+         break;
+
+     case cmdProfile:
+         if(objc < 3) {
+           Tcl_WrongNumArgs(interp,2,objv,"start ?interval?|stop|dump");
+           return TCL_ERROR;
+         }
+         if(Tcl_GetIndexFromObj(interp,objv[2],pCmd,"command",TCL_EXACT,&sub) != TCL_OK)
+           return TCL_ERROR;
+         if(sub == cmdStart && objc > 3 &&
+            (Ns_GetTimeFromString(interp,Tcl_GetString(objv[3]),&interval) != NS_OK ||
+             (interval.sec == 0 && interval.usec <= 0))) {
+           Tcl_AppendResult(interp,"invalid interval: ",Tcl_GetString(objv[3]),0);
+           return TCL_ERROR;
+         }
+         if(OCAMLEnter(NS_TRUE,0) != NS_OK) goto busy;
+         res = callback_exn(*ocamlProfile,copy_string(pCmd[sub]));
+         if(Is_exception_result(res)) goto error;
+         Tcl_SetObjResult(interp,Tcl_NewStringObj(String_val(res),-1));
+         OCAMLLeave();
+         if(sub != cmdDump) {
+           Ns_MutexLock(&gate.lock);
+           profile.running = sub == cmdStart;
+           if(profile.running) {
+             profile.interval = interval;
+             profile.nsamples = 0;
+           }
+           Ns_CondSignal(&profile.cond);
+           Ns_MutexUnlock(&gate.lock);
+         }
+         break;
+
+     case cmdStats:
+         Tcl_DStringInit(&ds);
+         Ns_MutexLock(&gate.lock);
+         Ns_MutexLock(&pool.lock);
+         Ns_DStringPrintf(&ds,"running %d waiting %d maxwaiting %d "
+                          "executed %lu queued %lu rejected %lu timeouts %lu expired %lu "
+                          "workers %d poolqueue %d profiling %d samples %lu",
+                          gate.depth > 0,gate.waiting,gate.maxwaiting,
+                          gate.nrun,gate.nqueued,gate.nrejected + pool.nrejected,
+                          gate.ntimeout + pool.ntimeout,gate.nexpired,
+                          pool.nworkers,pool.queued,profile.running,profile.nsamples);
+         Ns_MutexUnlock(&pool.lock);
+         Ns_MutexUnlock(&gate.lock);
+         Tcl_DStringResult(interp,&ds);
          break;
     }
     return TCL_OK;
+error:
+    msg = format_caml_exception(Extract_exception(res));
+    OCAMLLeave();
+    Tcl_AppendResult(interp,msg,0);
+    free(msg);
+    return TCL_ERROR;
+busy:
+    Tcl_AppendResult(interp,"OCaml runtime is busy",0);
+    return TCL_ERROR;
 }
 
+/*
+ * Acquire OCaml runtime for the current thread. Nested calls from the
+ * thread which already owns the runtime(ns_eval calling ns_ocaml) pass
+ * through. With admission enabled the call fails with NS_ERROR when the
+ * queue is full and NS_TIMEOUT when the wait limit expires. Non-zero budget
+ * arms the watchdog for the execution.
+ */
+
 static Ns_ReturnCode
-OCAMLHandler(const void *arg, Ns_Conn *conn)
+OCAMLEnter(bool admission,const Ns_Time *budget)
+{
+    Ns_ReturnCode status = NS_OK;
+    uintptr_t tid = Ns_ThreadId();
+    Ns_Time timeout, *timeoutPtr = NULL;
+
+    Ns_MutexLock(&gate.lock);
+    if(gate.depth > 0 && gate.owner == tid) {
+      gate.depth++;
+      Ns_MutexUnlock(&gate.lock);
+      return NS_OK;
+    }
+    if(gate.depth > 0) {
+      if(admission && gate.maxwaiting > 0 && gate.waiting >= gate.maxwaiting) {
+        gate.nrejected++;
+        Ns_MutexUnlock(&gate.lock);
+        return NS_ERROR;
+      }
+      if(admission && (gate.maxwait.sec > 0 || gate.maxwait.usec > 0)) {
+        Ns_GetTime(&timeout);
+        Ns_IncrTime(&timeout,gate.maxwait.sec,gate.maxwait.usec);
+        timeoutPtr = &timeout;
+      }
+      gate.waiting++;
+      gate.nqueued++;
+      while(gate.depth > 0 && status == NS_OK) {
+        if(Ns_CondTimedWait(&gate.cond,&gate.lock,timeoutPtr) == NS_TIMEOUT && gate.depth > 0) {
+          gate.ntimeout++;
+          status = NS_TIMEOUT;
+        }
+      }
+      gate.waiting--;
+    }
+    if(status == NS_OK) {
+      gate.owner = tid;
+      gate.depth = 1;
+      gate.nrun++;
+      gate.expired = NS_FALSE;
+      gate.deadline.sec = gate.deadline.usec = 0;
+      if(budget && (budget->sec > 0 || budget->usec > 0)) {
+        Ns_GetTime(&gate.deadline);
+        Ns_IncrTime(&gate.deadline,budget->sec,budget->usec);
+        Ns_CondSignal(&gate.watch);
+      }
+    }
+    Ns_MutexUnlock(&gate.lock);
+    return status;
+}
+
+/*
+ * Release OCaml runtime, returns true if the execution has been
+ * interrupted by the watchdog.
+ */
+
+static bool
+OCAMLLeave(void)
+{
+    bool expired = NS_FALSE;
+
+    // Still owned by this thread, depth cannot change under us
+    if(gate.depth == 1) {
+      NsOCamlDbRelease();
+      NsOCamlReleaseInterp();
+      NsOCamlReleaseProcs();
+    }
+    Ns_MutexLock(&gate.lock);
+    if(--gate.depth == 0) {
+      expired = gate.expired;
+      gate.owner = 0;
+      gate.expired = NS_FALSE;
+      gate.deadline.sec = gate.deadline.usec = 0;
+      Ns_CondSignal(&gate.cond);
+    }
+    Ns_MutexUnlock(&gate.lock);
+    return expired;
+}
+
+/*
+ * Watchdog thread, interrupts OCaml execution which runs out of its time
+ * budget by recording OCAML_TIMEOUT_SIGNAL, the OCaml signal handler then
+ * raises Ns_timeout inside the handler. Code blocked in C(Tcl eval, I/O)
+ * is interrupted only when it returns back to OCaml.
+ */
+
+static void
+OCAMLWatchdog(void *UNUSED(arg))
+{
+    Ns_Time now, diff;
+
+    Ns_ThreadSetName("-nsocaml:watchdog-");
+    Ns_MutexLock(&gate.lock);
+    for(;;) {
+      if(gate.depth == 0 || gate.expired || gate.deadline.sec == 0) {
+        Ns_CondWait(&gate.watch,&gate.lock);
+        continue;
+      }
+      Ns_GetTime(&now);
+      if(Ns_DiffTime(&gate.deadline,&now,&diff) > 0) {
+        Ns_CondTimedWait(&gate.watch,&gate.lock,&gate.deadline);
+        continue;
+      }
+      gate.expired = NS_TRUE;
+      gate.nexpired++;
+      caml_record_signal(OCAML_TIMEOUT_SIGNAL);
+    }
+}
+
+/*
+ * Profiler thread, while profiling is on records OCAML_PROFILE_SIGNAL
+ * every interval when OCaml code is running, the OCaml signal handler then
+ * samples the call stack. Signals recorded while the handler is blocked
+ * in a C call collapse into one sample taken when the call returns.
+ */
+
+static void
+OCAMLProfiler(void *UNUSED(arg))
+{
+    Ns_Time timeout;
+
+    Ns_ThreadSetName("-nsocaml:profiler-");
+    Ns_MutexLock(&gate.lock);
+    for(;;) {
+      if(!profile.running) {
+        Ns_CondWait(&profile.cond,&gate.lock);
+        continue;
+      }
+      Ns_GetTime(&timeout);
+      Ns_IncrTime(&timeout,profile.interval.sec,profile.interval.usec);
+      if(Ns_CondTimedWait(&profile.cond,&gate.lock,&timeout) == NS_TIMEOUT &&
+         profile.running && gate.depth > 0) {
+        profile.nsamples++;
+        caml_record_signal(OCAML_PROFILE_SIGNAL);
+      }
+    }
+}
+
+/*
+ * Returns true if the current execution ran out of its time budget, used
+ * by the OCaml signal handler to ignore stale signals.
+ */
+
+CAMLprim value
+Ns_OCamlExpired(value unit)
+{
+    bool expired;
+
+    Ns_MutexLock(&gate.lock);
+    expired = gate.depth > 0 && gate.owner == Ns_ThreadId() && gate.expired;
+    Ns_MutexUnlock(&gate.lock);
+    return Val_bool(expired);
+}
+
+/*
+ * Build OCAMLRUNPARAM from the module config, settings from the
+ * environment go last so they still override the config.
+ */
+
+static void
+OCAMLRunParam(const char *path,Ns_DString *dsPtr)
+{
+    int i;
+    const char *env, *val;
+    static const char *params[] = {
+        "minorheap", "s",
+        "spaceoverhead", "o",
+        "maxoverhead", "O",
+        "majorincrement", "i",
+        "allocpolicy", "a",
+        "verbose", "v",
+        0
+    };
+
+    for(i = 0;params[i];i += 2) {
+      if(!(val = Ns_ConfigGetValue(path,params[i]))) continue;
+      Ns_DStringPrintf(dsPtr,"%s%s=%s",dsPtr->length ? "," : "",params[i+1],val);
+    }
+    if((env = getenv("OCAMLRUNPARAM")) && *env && dsPtr->length)
+      Ns_DStringPrintf(dsPtr,",%s",env);
+}
+
+/*
+ * Per request allocation limit, the OCaml side aborts the request with
+ * Ns_alloc_limit exception once it has allocated more than that.
+ */
+
+CAMLprim value
+Ns_OCamlMaxAlloc(value unit)
+{
+    return Val_long(gc.maxalloc);
+}
+
+/*
+ * Template cache directory and compiler, the directory is never empty,
+ * it defaults to modules/nsocaml under the server home
+ */
+
+CAMLprim value
+Ns_OCamlMlpConfig(value unit)
+{
+    CAMLparam1(unit);
+    CAMLlocal3(retval,odir,ocompiler);
+
+    odir = copy_string(mlp.dir);
+    ocompiler = copy_string(mlp.compiler);
+    retval = alloc_small(2,0);
+    Field(retval,0) = odir;
+    Field(retval,1) = ocompiler;
+    CAMLreturn(retval);
+}
+
+static void
+OCAMLBudget(const char *url,Ns_Time *timePtr)
+{
+    int i;
+
+    *timePtr = defaultBudget;
+    for(i = 0;i < nbudgets;i++) {
+      if(Tcl_StringMatch(url,budgets[i].pattern)) {
+        *timePtr = budgets[i].timeout;
+        break;
+      }
+    }
+}
+
+static Ns_ReturnCode
+OCAMLUnavailable(Ns_Conn *conn)
+{
+    char buf[TCL_INTEGER_SPACE];
+
+    snprintf(buf,sizeof(buf),"%d",gate.retryafter);
+    Ns_ConnSetHeaders(conn,"Retry-After",buf);
+    return Ns_ConnReturnUnavailable(conn);
+}
+
+/*
+ * Run OCaml function in the current thread, label is used in the log.
+ * Integer or constant constructor returned by the function is stored in
+ * resultPtr if it is not NULL.
+ */
+
+static OCamlResult
+OCAMLExec(const char *label,value *fn,const char *arg,const Ns_Time *budget,bool admission,int *resultPtr)
+{
+   value res, varg;
+   char *msg = 0;
+   Tcl_WideInt start = NsOCamlTraceBegin();
+   OCamlResult result = OCAML_OK;
+
+   if(OCAMLEnter(admission,budget) != NS_OK) {
+     NsOCamlTraceEnd(label,start);
+     return OCAML_BUSY;
+   }
+   NsOCamlTraceAdd("ocaml wait","lock",start);
+   // Without argument fn is a registered closure, it runs under the
+   // same allocation limit as loaded modules and pages. The limit is not
+   // there when the stubs run without nsocaml.ml, see test/shim
+   if(arg) {
+     varg = copy_string(arg);
+     res = callback_exn(*fn,varg);
+   } else
+   if(ocamlLimit) {
+     res = callback_exn(*ocamlLimit,*fn);
+   } else {
+     res = callback_exn(*fn,Val_unit);
+   }
+   if(Is_exception_result(res)) msg = format_caml_exception(Extract_exception(res)); else
+   if(resultPtr && Is_long(res)) *resultPtr = Int_val(res);
+   if(gc.minorgc) caml_minor_collection();
+   if(OCAMLLeave()) {
+     result = OCAML_EXPIRED;
+   } else
+   if(msg) {
+     Ns_Log(Error,"nsocaml: %s: %s",label,msg);
+     result = OCAML_EXCEPTION;
+   }
+   free(msg);
+   NsOCamlTraceEnd(label,start);
+   return result;
+}
+
+/*
+ * Run OCaml function on behalf of the connection, either directly or by
+ * handing it off to the worker pool and waiting for the result.
+ */
+
+static OCamlResult
+OCAMLRun(Ns_Conn *conn,const char *label,value *fn,const char *arg,const Ns_Time *budget,int *resultPtr)
+{
+    Job job, **jobPtrPtr;
+    Ns_Time timeout, *timeoutPtr = NULL;
+
+    if(pool.nworkers == 0) return OCAMLExec(label,fn,arg,budget,NS_TRUE,resultPtr);
+
+    memset(&job,0,sizeof(job));
+    job.conn = conn;
+    job.label = label;
+    job.fn = fn;
+    job.arg = arg;
+    job.budget = *budget;
+    job.resultPtr = resultPtr;
+    if(gate.maxwait.sec > 0 || gate.maxwait.usec > 0) {
+      Ns_GetTime(&timeout);
+      Ns_IncrTime(&timeout,gate.maxwait.sec,gate.maxwait.usec);
+      timeoutPtr = &timeout;
+    }
+    Ns_MutexLock(&pool.lock);
+    if(gate.maxwaiting > 0 && pool.queued >= gate.maxwaiting) {
+      pool.nrejected++;
+      Ns_MutexUnlock(&pool.lock);
+      return OCAML_BUSY;
+    }
+    if(pool.lastPtr) pool.lastPtr->nextPtr = &job; else pool.firstPtr = &job;
+    pool.lastPtr = &job;
+    pool.queued++;
+    Ns_CondSignal(&pool.cond);
+    while(job.state == JOB_QUEUED) {
+      if(Ns_CondTimedWait(&job.cond,&pool.lock,timeoutPtr) == NS_TIMEOUT && job.state == JOB_QUEUED) {
+        // Not picked up by any worker in time, take it back from the queue
+        for(jobPtrPtr = &pool.firstPtr;*jobPtrPtr != &job;jobPtrPtr = &(*jobPtrPtr)->nextPtr);
+        *jobPtrPtr = job.nextPtr;
+        if(pool.lastPtr == &job) {
+          for(pool.lastPtr = pool.firstPtr;pool.lastPtr && pool.lastPtr->nextPtr;pool.lastPtr = pool.lastPtr->nextPtr);
+        }
+        pool.queued--;
+        pool.ntimeout++;
+        job.state = JOB_DONE;
+        job.result = OCAML_BUSY;
+      }
+    }
+    while(job.state != JOB_DONE) Ns_CondWait(&job.cond,&pool.lock);
+    Ns_MutexUnlock(&pool.lock);
+    Ns_CondDestroy(&job.cond);
+    return job.result;
+}
+
+/*
+ * OCaml worker thread, runs queued jobs with the connection of the job
+ * made current for naviserver.c stubs. Tcl interps cannot be shared
+ * between threads, ns_eval runs in an interp of the worker without the
+ * connection, where Tcl connection commands fail.
+ */
+
+static void
+OCAMLWorker(void *arg)
+{
+    Job *jobPtr;
+
+    Ns_ThreadSetName("-nsocaml:worker%d-",PTR2INT(arg));
+    Ns_MutexLock(&pool.lock);
+    for(;;) {
+      while(!pool.firstPtr) Ns_CondWait(&pool.cond,&pool.lock);
+      jobPtr = pool.firstPtr;
+      if(!(pool.firstPtr = jobPtr->nextPtr)) pool.lastPtr = 0;
+      pool.queued--;
+      jobPtr->state = JOB_RUNNING;
+      Ns_MutexUnlock(&pool.lock);
+
+      NsOCamlSetConn(jobPtr->conn);
+      jobPtr->result = OCAMLExec(jobPtr->label,jobPtr->fn,jobPtr->arg,&jobPtr->budget,NS_FALSE,jobPtr->resultPtr);
+      NsOCamlSetConn(0);
+
+      Ns_MutexLock(&pool.lock);
+      jobPtr->state = JOB_DONE;
+      Ns_CondSignal(&jobPtr->cond);
+    }
+}
+
+/*
+ * Run OCaml function for the connection and turn the outcome into HTTP
+ * response when the function did not provide any.
+ */
+
+static Ns_ReturnCode
+OCAMLRespond(Ns_Conn *conn,const char *label,value *fn,const char *arg)
+{
+   Ns_Time budget;
+   Ns_ReturnCode status = TCL_OK;
+
+   OCAMLBudget(conn->request.url,&budget);
+   NsOCamlCompressConn(conn);
+   switch(OCAMLRun(conn,label,fn,arg,&budget,0)) {
+    case OCAML_OK:
+       // OCaml module id not produce any HTTP response, return internal error then,
+       // detached connections are answered through the channel
+       if(Ns_ConnResponseStatus(conn) == 0 && !(conn->flags & NS_CONN_CLOSED)) {
+         Ns_Log(Error,"nsocaml: %s did not provide any valid HTTP response",label);
+         Ns_ConnReturnInternalError(conn);
+       }
+       break;
+
+    case OCAML_EXCEPTION:
+       status = TCL_ERROR;
+       break;
+
+    case OCAML_BUSY:
+       Ns_Log(Warning,"nsocaml: %s: OCaml runtime is busy, request rejected",label);
+       status = OCAMLUnavailable(conn);
+       break;
+
+    case OCAML_EXPIRED:
+       // Time budget is over, the handler has been interrupted
+       Ns_Log(Warning,"nsocaml: %s: interrupted after %ld.%06lds",label,budget.sec,budget.usec);
+       if(Ns_ConnResponseStatus(conn) == 0) status = Ns_ConnReturnStatus(conn,504);
+       break;
+   }
+   return status;
+}
+
+static Ns_ReturnCode
+OCAMLPage(const NsServer *servPtr,Ns_Conn *conn,value *loader)
 {
-   value res,file;
    Ns_DString ds;
-   const NsServer *servPtr = arg;
+   Ns_ReturnCode status;
+   int i;
 
    Ns_DStringInit(&ds);
    Ns_MakePath(&ds,servPtr->fastpath.pageroot,conn->request.url,NULL);
-   if(access(ds.string,R_OK) != 0) goto notfound;
-   file = copy_string(ds.string);
-   Ns_MutexLock(&ocamlLock);
-   res = callback_exn(*ocamlLoader,file);
-   Ns_MutexUnlock(&ocamlLock);
-   if(Is_exception_result(res)) {
-     const char *msg = format_caml_exception(Extract_exception(res));
-
-     Ns_Log(Error,"nsocaml: %s: %s",ds.string,msg);
-     free((char *)msg);
-     return TCL_ERROR;
-   }
-   // OCaml module id not produce any HTTP response, return internal error then
-   if(Ns_ConnResponseStatus(conn) == 0) {
-     Ns_Log(Error,"nsocaml: %s did not provide any valid HTTP response",ds.string);
-     Ns_ConnReturnInternalError(conn);
-   }
-   return TCL_OK;
-notfound:
+   if(access(ds.string,R_OK) != 0) {
+     Ns_DStringFree(&ds);
+     return Ns_ConnReturnNotFound(conn);
+   }
+   for(i = 0;i < ncacheRules;i++) {
+     if(Tcl_StringMatch(conn->request.url,cacheRules[i].pattern)) break;
+   }
+   if(i < ncacheRules && (!strcmp(conn->request.method,"GET") || !strcmp(conn->request.method,"HEAD"))) {
+     status = OCAMLCachedPage(conn,&cacheRules[i],ds.string,loader);
+   } else {
+     status = OCAMLRespond(conn,ds.string,loader,ds.string);
+   }
    Ns_DStringFree(&ds);
-   return Ns_ConnReturnNotFound(conn);
+   return status;
 }
 
+/*
+ * Response cache rule: "ttl ?query {names}? ?headers {names}?"
+ */
+
+static Ns_ReturnCode
+OCAMLCacheRuleParse(const char *pattern,const char *spec,CacheRule *rulePtr)
+{
+   Ns_ReturnCode status = NS_OK;
+   const char **argv;
+   Ns_DString ds;
+   int argc, i;
+
+   if(Tcl_SplitList(NULL,spec,&argc,&argv) != TCL_OK) return NS_ERROR;
+   if(argc % 2 == 0 || Ns_GetTimeFromString(NULL,argv[0],&rulePtr->ttl) != NS_OK) status = NS_ERROR;
+   for(i = 1;i < argc && status == NS_OK;i += 2) {
+     if(!strcmp(argv[i],"query") && !rulePtr->query) {
+       if(Tcl_SplitList(NULL,argv[i+1],&rulePtr->nquery,&rulePtr->query) != TCL_OK) status = NS_ERROR;
+     } else
+     if(!strcmp(argv[i],"headers") && !rulePtr->headers) {
+       if(Tcl_SplitList(NULL,argv[i+1],&rulePtr->nheaders,&rulePtr->headers) != TCL_OK) status = NS_ERROR;
+     } else {
+       status = NS_ERROR;
+     }
+   }
+   Tcl_Free((char*)argv);
+   if(status == NS_OK) {
+     rulePtr->pattern = ns_strdup(pattern);
+     if(rulePtr->nheaders > 0) {
+       Ns_DStringInit(&ds);
+       for(i = 0;i < rulePtr->nheaders;i++) Ns_DStringPrintf(&ds,"%s%s",i ? ", " : "",rulePtr->headers[i]);
+       rulePtr->vary = ns_strdup(ds.string);
+       Ns_DStringFree(&ds);
+     }
+   } else {
+     if(rulePtr->query) Tcl_Free((char*)rulePtr->query);
+     if(rulePtr->headers) Tcl_Free((char*)rulePtr->headers);
+     memset(rulePtr,0,sizeof(CacheRule));
+   }
+   return status;
+}
+
+/*
+ * Serves the page from the response cache, on a miss runs it and keeps
+ * the response when it is complete. Keys are the URL and the Host header
+ * followed by the selected query arguments and headers, each on its own
+ * line. The selected headers are announced in Vary.
+ */
+
+static Ns_ReturnCode
+OCAMLCachedPage(Ns_Conn *conn,const CacheRule *rulePtr,const char *file,value *loader)
+{
+   NsOCamlResponse *respPtr, *hitPtr = 0;
+   Ns_ReturnCode status;
+   Ns_DString key;
+   Ns_Entry *entry;
+   Ns_Set *query;
+   Ns_Time now;
+   struct stat st;
+   const char *v, *host;
+   int i, new;
+
+   if(stat(file,&st) != 0) return OCAMLRespond(conn,file,loader,file);
+   host = Ns_SetIGet(conn->headers,"Host");
+   Ns_DStringInit(&key);
+   Ns_DStringPrintf(&key,"%s\n%s\n",conn->request.url,host ? host : "");
+   query = rulePtr->nquery > 0 ? Ns_ConnGetQuery(NULL,conn,NULL,NULL) : 0;
+   for(i = 0;i < rulePtr->nquery;i++) {
+     v = query ? Ns_SetGet(query,rulePtr->query[i]) : 0;
+     Ns_DStringPrintf(&key,"%s=%s\n",rulePtr->query[i],v ? v : "");
+   }
+   for(i = 0;i < rulePtr->nheaders;i++) {
+     v = Ns_SetIGet(conn->headers,rulePtr->headers[i]);
+     Ns_DStringPrintf(&key,"%s:%s\n",rulePtr->headers[i],v ? v : "");
+   }
+
+   Ns_GetTime(&now);
+   Ns_CacheLock(responseCache);
+   if((entry = Ns_CacheFindEntry(responseCache,key.string)) && (respPtr = Ns_CacheGetValue(entry))) {
+     if(respPtr->mtime == st.st_mtime && Ns_DiffTime(&respPtr->expires,&now,0) > 0) {
+       hitPtr = ns_malloc(sizeof(NsOCamlResponse) + respPtr->length);
+       memcpy(hitPtr,respPtr,sizeof(NsOCamlResponse) + respPtr->length);
+       hitPtr->type = ns_strdup(respPtr->type);
+       hitPtr->headers = Ns_SetCopy(respPtr->headers);
+     } else {
+       Ns_CacheFlushEntry(entry);
+     }
+   }
+   Ns_CacheUnlock(responseCache);
+   if(hitPtr) {
+     status = NsOCamlReturnResponse(conn,hitPtr);
+     NsOCamlFreeResponse(hitPtr);
+     Ns_DStringFree(&key);
+     return status;
+   }
+
+   // Set before the page runs, so the captured headers have it as well
+   if(rulePtr->vary) Ns_ConnSetHeaders(conn,"Vary",rulePtr->vary);
+   NsOCamlCaptureBegin(conn);
+   status = OCAMLRespond(conn,file,loader,file);
+   if((respPtr = NsOCamlCaptureEnd(conn))) {
+     respPtr->mtime = st.st_mtime;
+     respPtr->expires = now;
+     Ns_IncrTime(&respPtr->expires,rulePtr->ttl.sec,rulePtr->ttl.usec);
+     Ns_CacheLock(responseCache);
+     entry = Ns_CacheCreateEntry(responseCache,key.string,&new);
+     Ns_CacheSetValueSz(entry,respPtr,sizeof(NsOCamlResponse) + respPtr->length);
+     Ns_CacheUnlock(responseCache);
+   }
+   Ns_DStringFree(&key);
+   return status;
+}
+
+/*
+ * Drops cached responses of the page url, all of them for empty url
+ */
+
+void
+NsOCamlResponseFlush(const char *url)
+{
+   Ns_CacheSearch search;
+   Ns_Entry *entry;
+   const char *key;
+   size_t len = strlen(url);
+
+   if(!responseCache) return;
+   Ns_CacheLock(responseCache);
+   for(entry = Ns_CacheFirstEntry(responseCache,&search);entry;entry = Ns_CacheNextEntry(&search)) {
+     key = Ns_CacheKey(entry);
+     if(len == 0 || (!strncmp(key,url,len) && key[len] == '\n')) Ns_CacheFlushEntry(entry);
+   }
+   Ns_CacheUnlock(responseCache);
+}
+
+static Ns_ReturnCode
+OCAMLHandler(const void *arg, Ns_Conn *conn)
+{
+   return OCAMLPage(arg,conn,ocamlLoader);
+}
+
+/*
+ * Request handler for OCaml server pages, see ns_ocaml_mlp in nsocaml.ml
+ */
+
+static Ns_ReturnCode
+OCAMLTemplateHandler(const void *arg, Ns_Conn *conn)
+{
+   return OCAMLPage(arg,conn,ocamlTemplate);
+}
+
+/*
+ * Request handler for OCaml closures registered with ns_register_proc
+ */
+
+Ns_ReturnCode
+NsOCamlProcHandler(const void *arg, Ns_Conn *conn)
+{
+   NsOCamlProc *procPtr = (NsOCamlProc *)arg;
+
+   return OCAMLRespond(conn,procPtr->label,&procPtr->closure,0);
+}
+
+/*
+ * Filter for OCaml closures registered with ns_register_filter, the
+ * closure returns Filter_ok, Filter_break or Filter_return.
+ */
+
+Ns_ReturnCode
+NsOCamlFilterHandler(const void *arg, Ns_Conn *conn, Ns_FilterType why)
+{
+   NsOCamlProc *procPtr = (NsOCamlProc *)arg;
+   Ns_Time budget;
+   int result = -1;
+   static const Ns_ReturnCode codes[] = { NS_OK, NS_FILTER_BREAK, NS_FILTER_RETURN };
+
+   OCAMLBudget(conn->request.url,&budget);
+   switch(OCAMLRun(conn,procPtr->label,&procPtr->closure,0,&budget,&result)) {
+    case OCAML_OK:
+       if(result >= 0 && result < 3) return codes[result];
+       break;
+
+    case OCAML_EXCEPTION:
+       break;
+
+    case OCAML_BUSY:
+       // Trace filters run after the response, skip them under load
+       if(why == NS_FILTER_TRACE) return NS_OK;
+       Ns_Log(Warning,"nsocaml: %s: OCaml runtime is busy, request rejected",procPtr->label);
+       OCAMLUnavailable(conn);
+       return NS_FILTER_RETURN;
+
+    case OCAML_EXPIRED:
+       Ns_Log(Warning,"nsocaml: %s: interrupted after %ld.%06lds",procPtr->label,budget.sec,budget.usec);
+       if(why == NS_FILTER_TRACE) return NS_OK;
+       if(Ns_ConnResponseStatus(conn) == 0) Ns_ConnReturnStatus(conn,504);
+       return NS_FILTER_RETURN;
+   }
+   return NS_ERROR;
+}
+
+/*
+ * Scheduled procedures and background jobs, they run in scheduler threads
+ * and are never rejected by admission control
+ */
+
+void
+NsOCamlSchedHandler(void *arg, int UNUSED(id))
+{
+   NsOCamlProc *procPtr = arg;
+
+   OCAMLExec(procPtr->label,&procPtr->closure,0,0,NS_FALSE,0);
+}
+
+void
+NsOCamlJobHandler(void *arg, int UNUSED(id))
+{
+   OCAMLEnter(NS_FALSE,0);
+   NsOCamlJobRun(arg);
+   OCAMLLeave();
+}
@@ -0,0 +1,100 @@
+/* 
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1(the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/.
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis,WITHOUT WARRANTY OF ANY KIND,either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * Alternatively,the contents of this file may be used under the terms
+ * of the GNU General Public License(the "GPL"),in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License,indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above,a recipient may use your
+ * version of this file under either the License or the GPL.
+ *
+ * Author Vlad Seryakov vlad@crystalballinc.com
+ * 
+ */
+
+/*
+ * nsocaml.h -- Interface between the module(nsocaml.c) and
+ *              the OCaml library stubs(naviserver.c)
+ *
+ */
+
+#ifndef NSOCAML_H
+#define NSOCAML_H
+
+/*
+ * OCaml closure registered as URL handler by ns_register_proc or as
+ * filter by ns_register_filter
+ */
+
+typedef struct NsOCamlProc {
+    value closure;              /* Generational global root */
+    char *label;                /* Method and URL, for the log */
+    struct NsOCamlProc *nextPtr; /* Waiting to be freed */
+} NsOCamlProc;
+
+/*
+ * Background job queued by ns_job_queue
+ */
+
+typedef struct NsOCamlJob NsOCamlJob;
+
+/*
+ * Complete page response kept by the response cache, captured by
+ * naviserver.c from ns_return and ns_returnv
+ */
+
+typedef struct NsOCamlResponse {
+    int status;
+    char *type;
+    Ns_Set *headers;            /* Output headers set by the page */
+    char etag[48];
+    time_t mtime;               /* Page file modification time */
+    Ns_Time expires;
+    size_t length;
+    char data[1];
+} NsOCamlResponse;
+
+/*
+ * nsocaml.c
+ */
+
+extern Ns_OpProc NsOCamlProcHandler;
+extern Ns_FilterProc NsOCamlFilterHandler;
+extern Ns_SchedProc NsOCamlSchedHandler;
+extern Ns_SchedProc NsOCamlJobHandler;
+extern void NsOCamlResponseFlush(const char *url);
+
+/*
+ * naviserver.c
+ */
+
+extern void NsOCamlLibInit(void);
+extern void NsOCamlSetConn(Ns_Conn *conn);
+extern void NsOCamlReleaseInterp(void);
+extern void NsOCamlReleaseProcs(void);
+extern void NsOCamlJobRun(NsOCamlJob *jobPtr);
+extern void NsOCamlDbRelease(void);
+extern void NsOCamlTraceInit(const char *dir,int size);
+extern Tcl_WideInt NsOCamlTraceBegin(void);
+extern void NsOCamlTraceEnd(const char *label,Tcl_WideInt start);
+extern Tcl_WideInt NsOCamlTraceTime(void);
+extern void NsOCamlTraceAdd(const char *name,const char *cat,Tcl_WideInt start);
+extern void NsOCamlCompressInit(int level,size_t minsize,size_t cachesize);
+extern void NsOCamlCompressConn(Ns_Conn *conn);
+extern void NsOCamlCaptureBegin(Ns_Conn *conn);
+extern NsOCamlResponse *NsOCamlCaptureEnd(Ns_Conn *conn);
+extern Ns_ReturnCode NsOCamlReturnResponse(Ns_Conn *conn,const NsOCamlResponse *respPtr);
+extern void NsOCamlFreeResponse(void *arg);
+
+#endif
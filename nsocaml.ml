@@ -27,19 +27,234 @@
 
 open Naviserver;;
 
+(*----- Declare external functions -----*)
+
+external ns_ocaml_expired : unit -> bool = "Ns_OCamlExpired"
+
+external ns_ocaml_maxalloc : unit -> int = "Ns_OCamlMaxAlloc"
+
+external ns_ocaml_mlpconfig : unit -> string * string = "Ns_OCamlMlpConfig"
+
 (*----- Define OCaml functions -----*)
 
+(* Per request allocation limit, allocations are sampled by Memprof
+   at the rate which gives about 1000 samples for the whole limit *)
+
+let ns_ocaml_maxalloc = ns_ocaml_maxalloc ();;
+
+let ns_ocaml_tracking = ref false;;
+
+let ns_ocaml_limit f =
+  if ns_ocaml_maxalloc <= 0 || !ns_ocaml_tracking then f () else begin
+    let words = ns_ocaml_maxalloc / (Sys.word_size / 8) in
+    let rate = min 1.0 (1000.0 /. float_of_int words) in
+    let limit = int_of_float (float_of_int words *. rate) in
+    let samples = ref 0 in
+    let count (a : Gc.Memprof.allocation) =
+      samples := !samples + a.Gc.Memprof.n_samples;
+      if !samples > limit then raise Ns_alloc_limit;
+      None in
+    ns_ocaml_tracking := true;
+    Gc.Memprof.start ~sampling_rate:rate ~callstack_size:0
+      { Gc.Memprof.null_tracker with
+        Gc.Memprof.alloc_minor = count; Gc.Memprof.alloc_major = count };
+    Fun.protect f ~finally:(fun () ->
+      Gc.Memprof.stop ();
+      ns_ocaml_tracking := false)
+  end;;
+
 let ns_ocaml_load name =
   try
-    Dynlink.loadfile name;
+    ns_ocaml_limit (fun () -> Dynlink.loadfile name);
   with
     Dynlink.Error (e) ->
       ns_log "Error" (Dynlink.error_message e);;
 
+(* OCaml server pages. Template text is sent as is, <%= expr %> sends the
+   string expr evaluates to, <% code %> is inserted into the page function
+   and <%! decl %> at the top level of the module. Each template becomes a
+   module with static text in preallocated strings, compiled once into the
+   cache directory and recompiled when the template changes *)
+
+let (ns_mlp_dir, ns_mlp_compiler) = ns_ocaml_mlpconfig ();;
+
+(* Compiled modules are loaded with unsafe modules allowed, the directory
+   must not be writable by anybody but the server *)
+
+let ns_mlp_checkdir () =
+  if not (Sys.file_exists ns_mlp_dir) then Unix.mkdir ns_mlp_dir 0o700;
+  let st = Unix.stat ns_mlp_dir in
+  if st.Unix.st_kind <> Unix.S_DIR || st.Unix.st_uid <> Unix.geteuid () ||
+     st.Unix.st_perm land 0o022 <> 0 then
+    failwith (ns_mlp_dir ^ ": mlpdir must be a directory owned by the server user and not writable by others");;
+
+let ns_mlp_pages : (string, float * (unit -> unit)) Hashtbl.t = Hashtbl.create 64;;
+
+let rec ns_mlp_find text sub pos =
+  match String.index_from_opt text pos sub.[0] with
+    None -> -1
+  | Some i ->
+      if i + String.length sub <= String.length text &&
+         String.sub text i (String.length sub) = sub then i
+      else ns_mlp_find text sub (i + 1);;
+
+let ns_mlp_translate text =
+  let decls = Buffer.create 1024 and body = Buffer.create 1024 in
+  let nstatic = ref 0 in
+  let static s =
+    if s <> "" then begin
+      Printf.bprintf decls "let ns_mlp_%d = %S;;\n" !nstatic s;
+      Printf.bprintf body "ns_mlp_put ns_mlp_%d;\n" !nstatic;
+      incr nstatic
+    end in
+  let rec scan pos =
+    let start = ns_mlp_find text "<%" pos in
+    if start < 0 then static (String.sub text pos (String.length text - pos)) else begin
+      static (String.sub text pos (start - pos));
+      let stop = ns_mlp_find text "%>" (start + 2) in
+      if stop < 0 then failwith ("unterminated <% at offset " ^ string_of_int start);
+      let code = String.sub text (start + 2) (stop - start - 2) in
+      let rest () = String.sub code 1 (String.length code - 1) in
+      if code <> "" && code.[0] = '=' then
+        Printf.bprintf body "ns_mlp_put (%s);\n" (rest ())
+      else if code <> "" && code.[0] = '!' then
+        Printf.bprintf decls "%s\n;;\n" (rest ())
+      else
+        Printf.bprintf body "%s\n" code;
+      scan (stop + 2)
+    end in
+  scan 0;
+  "open Naviserver;;\n" ^ Buffer.contents decls ^
+  "ns_mlp_page := (fun () ->\n" ^
+  "let ns_mlp_parts = ref [] in\n" ^
+  "let ns_mlp_put s = ns_mlp_parts := s :: !ns_mlp_parts in\n" ^
+  "begin\n" ^ Buffer.contents body ^ "() end;\n" ^
+  "if not (ns_conn_sent ()) then\n" ^
+  "ns_returnv 200 \"text/html\" (Array.of_list (List.rev !ns_mlp_parts)));;\n";;
+
+(* Modules are named after the file and its mtime, loaded modules cannot
+   be replaced under the same name. Files of older versions of the
+   template are removed when it is compiled again. The compiler runs
+   with the OCaml runtime held, every other OCaml request waits for it *)
+
+let ns_mlp_cleanup prefix name =
+  Array.iter (fun f ->
+    if String.length f > String.length prefix &&
+       String.sub f 0 (String.length prefix) = prefix &&
+       Filename.remove_extension f <> name then
+      try Sys.remove (Filename.concat ns_mlp_dir f) with Sys_error _ -> ())
+    (Sys.readdir ns_mlp_dir);;
+
+let ns_mlp_compile file mtime =
+  let prefix = "mlp_" ^ Digest.to_hex (Digest.string file) ^ "_" in
+  let name = prefix ^ Digest.to_hex (Digest.string (string_of_float mtime)) in
+  let base = Filename.concat ns_mlp_dir name in
+  ns_mlp_checkdir ();
+  if not (Sys.file_exists (base ^ ".cmo")) then begin
+    ns_mlp_cleanup prefix name;
+    let ic = open_in_bin file in
+    let text = Fun.protect (fun () -> really_input_string ic (in_channel_length ic))
+                 ~finally:(fun () -> close_in ic) in
+    let oc = open_out_bin (base ^ ".ml") in
+    Fun.protect (fun () -> output_string oc (ns_mlp_translate text))
+      ~finally:(fun () -> close_out oc);
+    let cmd = Printf.sprintf "%s -c -w s -o %s %s 2>%s" ns_mlp_compiler
+                (Filename.quote (base ^ ".cmo")) (Filename.quote (base ^ ".ml"))
+                (Filename.quote (base ^ ".err")) in
+    if Sys.command cmd <> 0 then begin
+      let ic = open_in_bin (base ^ ".err") in
+      let err = really_input_string ic (in_channel_length ic) in
+      close_in ic;
+      failwith (file ^ ": " ^ err)
+    end
+  end;
+  ns_mlp_page := (fun () -> ());
+  (try Dynlink.loadfile (base ^ ".cmo") with
+     Dynlink.Error (e) -> failwith (file ^ ": " ^ Dynlink.error_message e));
+  let page = !ns_mlp_page in
+  Hashtbl.replace ns_mlp_pages file (mtime, page);
+  page;;
+
+let ns_ocaml_mlp file =
+  let mtime = (Unix.stat file).Unix.st_mtime in
+  let page =
+    match Hashtbl.find_opt ns_mlp_pages file with
+      Some (t, page) when t = mtime -> page
+    | _ -> ns_mlp_compile file mtime in
+  ns_ocaml_limit page;;
+
+(*----- Sampling profiler -----*)
+
+(* Stacks sampled by the OCaml profile signal handler, counted by their
+   collapsed form "url;outer;...;inner" which flamegraph.pl reads. Frames
+   of this module at the top of the stack belong to the signal handler.
+   Modules must be compiled with -g to have frame names *)
+
+let ns_ocaml_profiling = ref false;;
+
+let ns_ocaml_samples : (string, int) Hashtbl.t = Hashtbl.create 256;;
+
+let ns_ocaml_frame slot =
+  let clean s = String.map (fun c -> if c = ';' || c = ' ' then '_' else c) s in
+  match Printexc.Slot.name slot, Printexc.Slot.location slot with
+    Some name, _ -> clean name
+  | None, Some loc -> clean (Printf.sprintf "%s:%d" loc.Printexc.filename loc.Printexc.line_number)
+  | None, None -> "??";;
+
+let ns_ocaml_sample () =
+  let slots =
+    match Printexc.backtrace_slots (Printexc.get_callstack 64) with
+      Some slots -> Array.to_list slots
+    | None -> [] in
+  let rec skip = function
+      slot :: rest when
+        (match Printexc.Slot.location slot with
+           Some loc -> loc.Printexc.filename = "nsocaml.ml"
+         | None -> false) -> skip rest
+    | l -> l in
+  let url = ns_conn "url" in
+  let frames = List.rev_map ns_ocaml_frame (skip slots) in
+  let stack = String.concat ";" ((if url = "" then "-" else url) :: frames) in
+  let n = try Hashtbl.find ns_ocaml_samples stack with Not_found -> 0 in
+  Hashtbl.replace ns_ocaml_samples stack (n + 1);;
+
+let ns_ocaml_profile cmd =
+  match cmd with
+    "start" ->
+      Hashtbl.reset ns_ocaml_samples;
+      ns_ocaml_profiling := true;
+      ""
+  | "stop" ->
+      ns_ocaml_profiling := false;
+      ""
+  | _ ->
+      let buf = Buffer.create 4096 in
+      Hashtbl.iter (fun stack n -> Printf.bprintf buf "%s %d\n" stack n) ns_ocaml_samples;
+      Buffer.contents buf;;
+
 (*----- Register OCaml callbacks -----*)
 
 Callback.register "ns_ocaml_load" ns_ocaml_load;;
 
+Callback.register "ns_ocaml_limit" ns_ocaml_limit;;
+
+Callback.register "ns_ocaml_mlp" ns_ocaml_mlp;;
+
+Callback.register "ns_ocaml_profile" ns_ocaml_profile;;
+
+Callback.register "ns_ocaml_channel"
+  (fun arg -> ns_ocaml_limit (fun () -> ns_connchan_dispatch arg));;
+
+(*----- Watchdog signal, recorded by nsocaml.c on handler timeout -----*)
+
+Sys.set_signal Sys.sigvtalrm
+  (Sys.Signal_handle (fun _ -> if ns_ocaml_expired () then raise Ns_timeout));;
+
+(*----- Profiler signal, recorded by nsocaml.c every sampling interval -----*)
+
+Sys.set_signal Sys.sigprof
+  (Sys.Signal_handle (fun _ -> if !ns_ocaml_profiling then ns_ocaml_sample ()));;
+
 (*----- Initialize Dynlink library. -----*)
 
 Dynlink.init ();;
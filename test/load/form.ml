@@ -0,0 +1,9 @@
+open Naviserver;;
+
+(* Form parsing, the load script sends 10 query fields f0..f9 *)
+
+let fields = List.init 10 (fun i -> "f" ^ string_of_int i);;
+
+let total = List.fold_left (fun n f -> n + String.length (ns_queryget f)) 0 fields;;
+
+ns_return 200 "text/plain" (string_of_int total ^ "\n");;
@@ -0,0 +1,5 @@
+open Naviserver;;
+
+(* Smallest response, measures the per request cost of loading the module *)
+
+ns_return 200 "text/plain" "Hello, World!\n";;
@@ -0,0 +1,21 @@
+open Naviserver;;
+
+(* Requested once before the runs. Fills the nsv array and registers the
+   same handlers as procs under /proc, which run as closures without
+   loading a module per request *)
+
+for i = 0 to 9 do
+  nsv_set "load" ("key" ^ string_of_int i) (String.make 32 'v')
+done;;
+
+nsv_set "load" "hits" "0";;
+
+let chunk = String.make 65536 'x';;
+
+ns_register_proc "GET" "/proc/hello" (fun () ->
+  ns_return 200 "text/plain" "Hello, World!\n");;
+
+ns_register_proc "GET" "/proc/large" (fun () ->
+  ns_returnv 200 "application/octet-stream" (Array.make 16 chunk));;
+
+ns_return 200 "text/plain" "ok\n";;
@@ -0,0 +1,7 @@
+open Naviserver;;
+
+(* 1MB response in 64KB chunks sent without concatenation *)
+
+let chunk = String.make 65536 'x';;
+
+ns_returnv 200 "application/octet-stream" (Array.make 16 chunk);;
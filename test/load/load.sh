@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Throughput and tail latency of OCaml handlers. Starts nsd with nsd.tcl,
+# drives every handler with wrk at each concurrency level and prints one
+# JSON line per run, see report.lua. Runs once per worker setting,
+# serialized in connection threads (0) and with OCaml worker threads.
+#
+#   NAVISERVER=/usr/local/ns sh load.sh
+#
+# LOAD_CONNECTIONS  concurrency levels, "1 8 64"
+# LOAD_WORKERS      worker settings, "0 4"
+# LOAD_DURATION     seconds per run, 10
+# LOAD_PORT         port of the test server, 8091
+#
+
+NAVISERVER=${NAVISERVER:-/usr/local/ns}
+LOAD_CONNECTIONS=${LOAD_CONNECTIONS:-"1 8 64"}
+LOAD_WORKERS=${LOAD_WORKERS:-"0 4"}
+LOAD_DURATION=${LOAD_DURATION:-10}
+LOAD_PORT=${LOAD_PORT:-8091}
+LOAD_LOGDIR=${LOAD_LOGDIR:-/tmp}
+export LOAD_PORT LOAD_LOGDIR
+
+dir=$(cd "$(dirname "$0")" && pwd)
+url=http://127.0.0.1:$LOAD_PORT
+query="f0=alpha&f1=beta&f2=gamma&f3=delta&f4=epsilon&f5=zeta&f6=eta&f7=theta&f8=iota&f9=kappa"
+
+# name url [body bytes]
+handlers="hello /hello.cmo
+template /hello.mlp
+proc /proc/hello
+form /form.cmo?$query
+nsv /nsv.cmo
+large /large.cmo
+proclarge /proc/large
+upload /upload.cmo 1048576"
+
+user=
+if [ "$(id -u)" = 0 ]; then user="-u nobody"; fi
+
+for workers in $LOAD_WORKERS; do
+    LOAD_WORKERS=$workers "$NAVISERVER/bin/nsd" -f $user -t "$dir/nsd.tcl" >"$LOAD_LOGDIR/nsocaml-load.out" 2>&1 &
+    pid=$!
+    n=0
+    until curl -sf "$url/init.cmo" >/dev/null; do
+        n=$((n + 1))
+        if [ $n -gt 50 ]; then
+            echo "nsd did not start, see $LOAD_LOGDIR/nsocaml-load.out" >&2
+            kill $pid 2>/dev/null
+            exit 1
+        fi
+        sleep 0.2
+    done
+    # Compile the template before it is measured
+    curl -sf "$url/hello.mlp" >/dev/null
+
+    echo "$handlers" | while read name path body; do
+        for connections in $LOAD_CONNECTIONS; do
+            LOAD_NAME=$name LOAD_MODE="workers=$workers" LOAD_CONNECTIONS=$connections LOAD_BODY=${body:-0} \
+                wrk -t $(( connections < 4 ? connections : 4 )) -c $connections -d ${LOAD_DURATION}s \
+                    -s "$dir/report.lua" "$url$path" | grep '^{'
+        done
+    done
+
+    kill $pid
+    wait $pid 2>/dev/null
+done
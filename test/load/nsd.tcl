@@ -0,0 +1,41 @@
+#
+# NaviServer configuration of the load tests, see load.sh. Pages are
+# served from this directory, LOAD_PORT and LOAD_WORKERS come from the
+# environment.
+#
+
+set home [file dirname [file dirname [info nameofexecutable]]]
+set pageroot [file dirname [file normalize [info script]]]
+set port [expr {[info exists env(LOAD_PORT)] ? $env(LOAD_PORT) : 8091}]
+set workers [expr {[info exists env(LOAD_WORKERS)] ? $env(LOAD_WORKERS) : 0}]
+set logdir [expr {[info exists env(LOAD_LOGDIR)] ? $env(LOAD_LOGDIR) : "/tmp"}]
+
+ns_section ns/parameters
+ns_param home $home
+ns_param serverlog $logdir/nsocaml-load.log
+ns_param pidfile $logdir/nsocaml-load.pid
+
+ns_section ns/servers
+ns_param load "nsocaml load test"
+
+ns_section ns/server/load
+ns_param minthreads 16
+ns_param maxthreads 16
+ns_param maxconnections 1024
+
+ns_section ns/server/load/fastpath
+ns_param pagedir $pageroot
+
+ns_section ns/server/load/modules
+ns_param nssock nssock.so
+ns_param nsocaml nsocaml.so
+
+ns_section ns/server/load/module/nssock
+ns_param address 127.0.0.1
+ns_param port $port
+ns_param maxinput 16MB
+ns_param backlog 1024
+
+ns_section ns/server/load/module/nsocaml
+ns_param workers $workers
+ns_param mlpdir $logdir/nsocaml-load-mlp
@@ -0,0 +1,14 @@
+open Naviserver;;
+
+(* Read heavy shared state, 100 reads and one write per request from the
+   array filled by init.cmo *)
+
+let buf = Buffer.create 1024;;
+
+for i = 0 to 99 do
+  Buffer.add_string buf (nsv_get "load" ("key" ^ string_of_int (i mod 10)))
+done;;
+
+nsv_incr "load" "hits" 1;;
+
+ns_return 200 "text/plain" (string_of_int (Buffer.length buf) ^ "\n");;
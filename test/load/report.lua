@@ -0,0 +1,22 @@
+-- wrk script: optional POST body of LOAD_BODY bytes, prints one JSON
+-- line with throughput and latency percentiles in microseconds
+
+local body = tonumber(os.getenv("LOAD_BODY") or "0")
+
+if body > 0 then
+   wrk.method = "POST"
+   wrk.body = string.rep("x", body)
+   wrk.headers["Content-Type"] = "application/octet-stream"
+end
+
+function done(summary, latency, requests)
+   local secs = summary.duration / 1000000
+   local errors = summary.errors.connect + summary.errors.read + summary.errors.write +
+                  summary.errors.status + summary.errors.timeout
+   io.write(string.format(
+      "{\"name\":\"%s\",\"mode\":\"%s\",\"connections\":%s,\"requests\":%d,\"errors\":%d," ..
+      "\"rps\":%.1f,\"p50\":%d,\"p99\":%d,\"p999\":%d,\"max\":%d}\n",
+      os.getenv("LOAD_NAME") or "", os.getenv("LOAD_MODE") or "", os.getenv("LOAD_CONNECTIONS") or "0",
+      summary.requests, errors, summary.requests / secs,
+      latency:percentile(50), latency:percentile(99), latency:percentile(99.9), latency.max))
+end
@@ -0,0 +1,5 @@
+open Naviserver;;
+
+(* POST body, the load script sends LOAD_BODY bytes *)
+
+ns_return 200 "text/plain" (ns_conn "contentlength" ^ "\n");;
@@ -0,0 +1,64 @@
+open Naviserver;;
+
+(* Per call latency and allocation of the stubs. Requested as a page it
+   runs all benchmarks in the connection thread, ns_bench.tcl calls it
+   through ns_ocaml call from several threads at once. Results are JSON:
+   [{"name":...,"calls":...,"ns_per_call":...,"bytes_per_call":...},...] *)
+
+let bench iterations (name, f) =
+  let bytes = Gc.allocated_bytes () in
+  let start = ns_monotonic_usec () in
+  for _ = 1 to iterations do f () done;
+  let usec = ns_monotonic_usec () - start in
+  let bytes = Gc.allocated_bytes () -. bytes in
+  Printf.sprintf "{\"name\":%S,\"calls\":%d,\"ns_per_call\":%.1f,\"bytes_per_call\":%.1f}"
+    name iterations
+    (float_of_int usec *. 1000. /. float_of_int iterations)
+    (bytes /. float_of_int iterations);;
+
+let run iterations benches =
+  "[" ^ String.concat ",\n" (List.map (bench iterations) benches) ^ "]\n";;
+
+(* Stubs which do not need a connection *)
+
+let common = [
+  "ns_time", (fun () -> ignore (ns_time ()));
+  "ns_time_usec", (fun () -> ignore (ns_time_usec ()));
+  "ns_fmttime", (fun () -> ignore (ns_fmttime 0 "%Y-%m-%d"));
+  "ns_info version", (fun () -> ignore (ns_info "version"));
+  "ns_log_enabled", (fun () -> ignore (ns_log_enabled Log_dev));
+  "ns_logf disabled", (fun () -> ns_logf Log_dev "%d %s" 1 "x");
+  "ns_urlencode clean", (fun () -> ignore (ns_urlencode "plain_name-1.txt"));
+  "ns_urlencode", (fun () -> ignore (ns_urlencode "a b&c=d"));
+  "ns_urlencode_array 10", (let a = Array.make 10 "a b" in fun () -> ignore (ns_urlencode_array a));
+  "ns_quotehtml clean", (fun () -> ignore (ns_quotehtml "plain text without markup"));
+  "ns_quotehtml", (fun () -> ignore (ns_quotehtml "<b>bold</b> & \"quoted\""));
+  "ns_striphtml", (fun () -> ignore (ns_striphtml "<b>bold</b> &amp; text"));
+  "ns_guesstype", (fun () -> ignore (ns_guesstype "index.html"));
+  "nsv_set", (fun () -> nsv_set "ocaml_bench" "key" "value");
+  "nsv_get", (fun () -> ignore (nsv_get "ocaml_bench" "key"));
+  "nsv_incr", (fun () -> nsv_incr "ocaml_bench" "counter" 1);
+  "ns_set_put/get", (let id = ns_set_create "ocaml_bench" in
+                     fun () -> ns_set_update id "key" "value"; ignore (ns_set_get id "key"));
+  "ns_cache_eval hit", (ns_cache_create "ocaml_bench" 100000 0;
+                        fun () -> ignore (ns_cache_eval "ocaml_bench" "key" (fun () -> "value")));
+  "ns_shared_get", (ns_shared_publish "ocaml_bench" (Array.make 100 "value");
+                    fun () -> ignore (ns_shared_get "ocaml_bench" : string array shared));
+  "ns_eval", (fun () -> ignore (ns_eval "string length abc"));
+];;
+
+(* Stubs which need the connection *)
+
+let conn = [
+  "ns_conn url", (fun () -> ignore (ns_conn "url"));
+  "ns_conn peeraddr", (fun () -> ignore (ns_conn "peeraddr"));
+  "ns_queryget", (fun () -> ignore (ns_queryget "iterations"));
+  "ns_queryexists", (fun () -> ignore (ns_queryexists "iterations"));
+];;
+
+Callback.register "ns_bench" (fun arg -> run (int_of_string arg) common);;
+
+if Filename.check_suffix (ns_conn "url") ".cmo" then begin
+  let iterations = try int_of_string (ns_queryget "iterations") with _ -> 10000 in
+  ns_return 200 "application/json" (run iterations (conn @ common))
+end;;
@@ -0,0 +1,27 @@
+#
+# Runs the stub benchmarks of ns_bench.cmo from 1..threads threads at
+# once through ns_ocaml call, all calls queue for the same OCaml runtime.
+# Reports JSON: [{"threads":n,"wall_usec":...,"results":[[...],...]},...]
+#
+
+set threads [ns_queryget threads 4]
+set iterations [ns_queryget iterations 10000]
+
+ns_ocaml load [file rootname [ns_url2file [ns_conn url]]].cmo
+
+set report {}
+for {set n 1} {$n <= $threads} {incr n} {
+    set start [clock microseconds]
+    set ids {}
+    for {set i 0} {$i < $n} {incr i} {
+        lappend ids [ns_thread begin [list ns_ocaml call ns_bench $iterations]]
+    }
+    set results {}
+    foreach id $ids {
+        lappend results [ns_thread wait $id]
+    }
+    set wall [expr {[clock microseconds] - $start}]
+    lappend report "{\"threads\":$n,\"wall_usec\":$wall,\"results\":\[[join $results ,]\]}"
+}
+
+ns_return 200 application/json "\[[join $report ,\n]\]\n"
@@ -0,0 +1,20 @@
+open Naviserver;;
+
+ns_log "Debug" "Testing ns_cache...";;
+
+ns_cache_create "ocaml_test" 1000000 60;;
+
+let compute () =
+  nsv_incr "ocaml" "computed" 1;
+  "value computed at " ^ string_of_int (ns_time ());;
+
+ns_log "Debug" ("eval 1: " ^ ns_cache_eval "ocaml_test" "key1" compute);;
+ns_log "Debug" ("eval 2: " ^ ns_cache_eval "ocaml_test" "key1" compute);;
+ns_log "Debug" ("computed: " ^ nsv_get "ocaml" "computed");;
+
+ns_cache_flush "ocaml_test" "key1";;
+
+ns_log "Debug" ("eval 3: " ^ ns_cache_eval "ocaml_test" "key1" compute);;
+ns_log "Debug" ("stats: " ^ ns_cache_stats "ocaml_test");;
+
+ns_return 200 "text/plain" "test completed.";;
@@ -0,0 +1,15 @@
+open Naviserver;;
+
+(* Returns a 100KB JSON document gzipped when the client accepts gzip,
+   ?mode=precompressed serves it from the gzip cache, ?mode=off sends it
+   as is. Compare with curl --compressed -w '%{size_download}' *)
+
+ns_log "Debug" "Testing compression...";;
+
+let json = "[" ^ String.concat "," (List.init 2000 (fun i ->
+  Printf.sprintf "{\"id\":%d,\"name\":\"item %d\",\"price\":%d.99}" i i (i mod 97))) ^ "]";;
+
+match ns_queryget "mode" with
+  "precompressed" -> ns_return_precompressed "ns_compress.json" 200 "application/json" json
+| "off" -> ns_compress 0; ns_return 200 "application/json" json
+| _ -> ns_compress 6; ns_return 200 "application/json" json;;
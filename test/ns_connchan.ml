@@ -0,0 +1,20 @@
+open Naviserver;;
+
+(* Echo over a detached connection, the connection thread is released
+   right away and every chunk the client sends is echoed back until it
+   closes the connection:
+
+     (printf 'GET /ns_connchan.cmo HTTP/1.0\r\n\r\n'; cat) | nc localhost 8080 *)
+
+ns_log "Debug" "Testing ns_connchan...";;
+
+let chan = ns_connchan_detach ();;
+
+ignore (ns_connchan_write chan "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\necho:\n");;
+
+ns_connchan_callback chan (fun ev ->
+  match ev with
+    Chan_readable ->
+      let data = ns_connchan_read chan in
+      data <> "" && ns_connchan_write chan data = String.length data
+  | _ -> false);;
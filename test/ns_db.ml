@@ -0,0 +1,15 @@
+open Naviserver;;
+
+(* Requires an nsdb pool, the default one of the server or ?pool=name *)
+
+ns_log "Debug" "Testing ns_db...";;
+
+let pool = ns_queryget "pool";;
+
+ns_db_with pool (fun db ->
+  ns_db_iter db "select ? as a, ? as b" ["it's"; "?"] (fun row ->
+    ns_write (String.concat " | " (Array.to_list row) ^ "\n"));
+  let n = ns_db_fold db "select 1 union all select 2" [] (fun n row -> n + int_of_string row.(0)) 0 in
+  ns_write ("sum: " ^ string_of_int n ^ "\n"));;
+
+ns_write "test completed.\n";;
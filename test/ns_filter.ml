@@ -0,0 +1,19 @@
+open Naviserver;;
+
+ns_log "Debug" "Testing ns_register_filter...";;
+
+ns_register_filter Preauth "GET" "/ocaml/private/*" (fun () ->
+  if ns_conn "authuser" = "" then begin
+    ns_returnunauthorized ();
+    Filter_return
+  end else Filter_ok);;
+
+ns_register_filter Postauth "GET" "/ocaml/*" (fun () ->
+  nsv_incr "ocaml" "requests" 1;
+  Filter_ok);;
+
+ns_register_filter Trace "GET" "/ocaml/*" (fun () ->
+  ns_log "Debug" ((ns_conn "url") ^ " " ^ (ns_conn "status"));
+  Filter_ok);;
+
+ns_return 200 "text/plain" "test completed.";;
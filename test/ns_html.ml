@@ -0,0 +1,28 @@
+open Naviserver;;
+
+ns_log "Debug" "Testing ns_quotehtml and ns_striphtml...";;
+
+let text = String.concat "" (List.init 200 (fun i ->
+  "<p class=\"row\">Row " ^ string_of_int i ^ " &amp; plain text without markup, 'quoted'</p>\n"));;
+
+let count = 1000;;
+
+(* Microseconds per call, span kernels against the previous scalar
+   stubs, both called from OCaml the same way *)
+
+let bench f =
+  let start = Unix.gettimeofday () in
+  for _ = 1 to count do ignore (f text) done;
+  (Unix.gettimeofday () -. start) *. 1e6 /. float_of_int count;;
+
+if ns_quotehtml text <> ns_quotehtml_scalar text then
+  ns_log "Error" "ns_quotehtml: result differs from the scalar stub";;
+
+if ns_striphtml text <> ns_striphtml_scalar text then
+  ns_log "Error" "ns_striphtml: result differs from the scalar stub";;
+
+ns_return 200 "text/plain"
+  (Printf.sprintf "%d bytes, usec per call\nquotehtml: span %.2f scalar %.2f\nstriphtml: span %.2f scalar %.2f\n"
+     (String.length text)
+     (bench ns_quotehtml) (bench ns_quotehtml_scalar)
+     (bench ns_striphtml) (bench ns_striphtml_scalar));;
@@ -0,0 +1,23 @@
+open Naviserver;;
+
+(* Fetches this server's own ns_info.cmo twice concurrently, ?url=
+   overrides the target *)
+
+ns_log "Debug" "Testing ns_http...";;
+
+let url =
+  match ns_queryget "url" with
+    "" -> "http://" ^ ns_conn "host" ^ ":" ^ ns_conn "port" ^ "/ns_info.cmo"
+  | url -> url;;
+
+let t = ns_monotonic_usec ();;
+
+let responses = ns_http_run_all [ns_http_request url; ns_http_request ~timeout:5000 url];;
+
+List.iter (fun r ->
+  ns_write (Printf.sprintf "%d %d bytes, type %s\n" r.resp_status
+              (Bigarray.Array1.dim r.resp_body)
+              (try ns_http_header r "content-type" with Not_found -> "none")))
+  responses;;
+
+ns_write (Printf.sprintf "%d usec\ntest completed.\n" (ns_monotonic_usec () - t));;
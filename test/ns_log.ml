@@ -0,0 +1,16 @@
+open Naviserver;;
+
+ns_log "Debug" "Testing ns_log...";;
+
+ns_log_sev Log_notice "ns_log_sev notice";;
+
+ns_logf Log_notice "ns_logf: %d requests, %s" 10 (ns_conn "url");;
+
+(* Disabled severity costs only the ns_log_enabled check *)
+for i = 1 to 100000 do
+  ns_logf Log_dev "not formatted %d" i
+done;;
+
+ns_logkv Log_notice "request" ["url", ns_conn "url"; "agent", "ocaml test"; "debug", string_of_bool (ns_log_enabled Log_debug)];;
+
+ns_return 200 "text/plain" "test completed.";;
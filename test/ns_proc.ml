@@ -0,0 +1,11 @@
+open Naviserver;;
+
+ns_log "Debug" "Testing ns_register_proc...";;
+
+ns_register_proc "GET" "/ocaml/hello" (fun () ->
+  ns_return 200 "text/plain" ("Hello from " ^ ns_conn "url"));;
+
+ns_register_proc "GET" "/ocaml/form" (fun () ->
+  ns_return 200 "text/plain" ("name = " ^ ns_queryget "name"));;
+
+ns_return 200 "text/plain" "test completed.";;
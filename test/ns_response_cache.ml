@@ -0,0 +1,22 @@
+open Naviserver;;
+
+(* Slow page for the response cache, with
+
+     ns_section ns/server/${server}/module/nsocaml/responsecache
+     ns_param /ns_response_cache.cmo {10s query n}
+
+   repeated requests within 10s return the same time without running
+   OCaml, a different ?n= is cached separately, ?flush=1 drops them *)
+
+ns_log "Debug" "Testing response cache...";;
+
+if ns_queryget "flush" <> "" then begin
+  ns_response_nocache ();
+  ns_response_cache_flush (ns_conn "url");
+  ns_return 200 "text/plain" "flushed\n"
+end else begin
+  let n = min 30 (try int_of_string (ns_queryget "n") with Failure _ -> 20) in
+  let rec fib n = if n < 2 then n else fib (n - 1) + fib (n - 2) in
+  ns_return 200 "text/plain"
+    (Printf.sprintf "fib %d = %d at %d\n" n (fib n) (ns_time ()))
+end;;
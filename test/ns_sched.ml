@@ -0,0 +1,19 @@
+open Naviserver;;
+
+ns_log "Debug" "Testing ns_schedule_proc...";;
+
+let id = ns_schedule_proc 60 (fun () ->
+  nsv_incr "ocaml" "ticks" 1;
+  ns_log "Debug" ("tick " ^ nsv_get "ocaml" "ticks"));;
+
+ignore (ns_after 1 (fun () -> ns_log "Debug" "after 1 second"));;
+
+let job1 = ns_job_queue (fun () -> string_of_int (List.length (nsv_names "")));;
+let job2 = ns_job_queue (fun () -> ns_info "uptime");;
+
+ns_log "Debug" ("job1: " ^ ns_job_wait job1);;
+ns_log "Debug" ("job2: " ^ ns_job_wait job2);;
+
+ns_unschedule_proc id;;
+
+ns_return 200 "text/plain" "test completed.";;
@@ -0,0 +1,37 @@
+open Naviserver;;
+
+ns_log "Debug" "Testing ns_shared...";;
+
+let routes = Hashtbl.create 1000;;
+
+for i = 1 to 1000 do
+  Hashtbl.replace routes ("/route/" ^ string_of_int i) (i, [| "GET"; "POST" |])
+done;;
+
+ns_shared_publish "ocaml_routes" routes;;
+
+let (handle : (string, int * string array) Hashtbl.t shared) = ns_shared_get "ocaml_routes";;
+
+let route = ns_shared_with handle (fun table ->
+  let (id, methods) = Hashtbl.find table "/route/500" in
+  string_of_int id ^ " " ^ String.concat "," (Array.to_list methods));;
+
+ns_log "Debug" ("route 500: " ^ route);;
+
+ns_shared_publish "ocaml_routes" (Hashtbl.create 1 : (string, int * string array) Hashtbl.t);;
+
+(* The handle keeps the replaced region alive *)
+ns_log "Debug" ("old copy still valid: " ^ string_of_int (ns_shared_with handle Hashtbl.length));;
+
+(* A copy may be changed and kept *)
+let copy = ns_shared_value handle;;
+Hashtbl.replace copy "/route/new" (0, [||]);;
+
+ns_shared_with (ns_shared_get "ocaml_routes") (fun table ->
+  ns_log "Debug" ("new copy: " ^ string_of_int (Hashtbl.length table)));;
+
+(try ns_shared_publish "ocaml_bad" (fun x -> x + 1) with Invalid_argument msg -> ns_log "Debug" msg);;
+
+ns_shared_remove "ocaml_routes";;
+
+ns_return 200 "text/plain" "test completed.";;
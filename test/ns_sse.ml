@@ -0,0 +1,19 @@
+open Naviserver;;
+
+(* Streams five server-sent events 200ms apart, curl -N shows them as
+   they arrive *)
+
+ns_log "Debug" "Testing server-sent events...";;
+
+let w = ns_sse_start ();;
+
+let rec loop i =
+  ns_sse_event ~event:"tick" ~id:(string_of_int i) w (string_of_int (ns_monotonic_usec ()));
+  if ns_sse_flush w && i < 5 then begin
+    ignore (ns_eval "after 200");
+    loop (i + 1)
+  end;;
+
+loop 1;;
+
+ns_sse_close w;;
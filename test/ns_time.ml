@@ -0,0 +1,19 @@
+open Naviserver;;
+
+ns_log "Debug" "Testing ns_time...";;
+
+let now = ns_time ();;
+let usec = ns_time_usec ();;
+
+if abs (usec / 1000000 - now) > 1 then ns_log "Error" "ns_time_usec differs from ns_time";;
+
+let start = ns_monotonic_usec ();;
+
+for _ = 1 to 10000 do
+  ignore (ns_fmttime now "%a, %d %b %Y %H:%M:%S GMT")
+done;;
+
+ns_log "Debug" (Printf.sprintf "10000 ns_fmttime calls: %d usec" (ns_monotonic_usec () - start));;
+ns_log "Debug" (ns_fmttime now "%Y-%m-%d %H:%M:%S");;
+
+ns_return 200 "text/plain" "test completed.";;
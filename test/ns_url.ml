@@ -0,0 +1,19 @@
+open Naviserver;;
+
+ns_log "Debug" "Testing url encoding...";;
+
+let names = [| "plain-name_1.txt"; "with space"; "a&b=c"; "\xc3\xa4\xc3\xb6" |];;
+
+let encoded = ns_urlencode_array names;;
+
+Array.iteri (fun i s ->
+  if s <> ns_urlencode names.(i) then ns_log "Error" ("ns_urlencode_array: " ^ s);
+  if ns_urldecode s <> names.(i) then ns_log "Error" ("ns_urldecode: " ^ s)) encoded;;
+
+if ns_urldecode_list (Array.to_list encoded) <> Array.to_list names then
+  ns_log "Error" "ns_urldecode_list";;
+
+ns_write ("/search?" ^ ns_urlencode_query ["q", "ocaml & tcl"; "page", "2"] ^ "\n");;
+ns_write "/files/";;
+ns_write_urlencode "report 2024.pdf";;
+ns_write "\ntest completed.\n";;
@@ -0,0 +1,9 @@
+open Naviserver;;
+
+(* Runs the benchmarks of ../ns_bench.ml against the shim, the number
+   of iterations is the first argument *)
+
+let () =
+  let iterations = try int_of_string Sys.argv.(1) with _ -> 100000 in
+  Shim.shim_conn "GET" "/bench?iterations=1" [] "";
+  print_string (Ns_bench.run iterations (Ns_bench.conn @ Ns_bench.common));;
@@ -0,0 +1,390 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1(the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/.
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis,WITHOUT WARRANTY OF ANY KIND,either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * Alternatively,the contents of this file may be used under the terms
+ * of the GNU General Public License(the "GPL"),in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License,indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above,a recipient may use your
+ * version of this file under either the License or the GPL.
+ *
+ */
+
+/*
+ * ns.h -- Subset of the NaviServer public API used by naviserver.c and
+ *         nsocaml.c, implemented by shim.c without nsd
+ *
+ */
+
+#ifndef NS_H
+#define NS_H
+
+#include <tcl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define NS_EXPORT
+#define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#define NS_NONNULL_ASSERT(x) ((void)0)
+#define NS_TRUE 1
+#define NS_FALSE 0
+#define PRIuz "zu"
+#define PRIdz "zd"
+#define INT2PTR(x) ((void*)(intptr_t)(x))
+#define PTR2INT(x) ((int)(intptr_t)(x))
+#define NS_MAJOR_VERSION 4
+#define NS_MINOR_VERSION 99
+#define NS_PATCH_LEVEL "4.99-shim"
+#define NS_VERSION "4.99"
+#define CONST const
+
+typedef enum {
+    NS_OK = 0,
+    NS_ERROR = -1,
+    NS_TIMEOUT = -2,
+    NS_FATAL = -3,
+    NS_UNAUTHORIZED = -4,
+    NS_FORBIDDEN = -5,
+    NS_FILTER_BREAK = -6,
+    NS_FILTER_RETURN = -7
+} Ns_ReturnCode;
+
+typedef enum {
+    Notice, Warning, Error, Fatal, Bug, Debug, Dev
+} Ns_LogSeverity;
+
+/*
+ * Synchronization objects are pointers initialized on first use
+ */
+
+typedef void *Ns_Mutex;
+typedef void *Ns_Cond;
+typedef void *Ns_Thread;
+typedef void *Ns_Tls;
+
+typedef struct Ns_Time {
+    time_t sec;
+    long usec;
+} Ns_Time;
+
+typedef Tcl_DString Ns_DString;
+
+#define Ns_DStringInit Tcl_DStringInit
+#define Ns_DStringFree Tcl_DStringFree
+#define Ns_DStringAppend(d,s) Tcl_DStringAppend((d),(s),-1)
+#define Ns_DStringNAppend Tcl_DStringAppend
+#define Ns_DStringValue Tcl_DStringValue
+#define Ns_DStringLength Tcl_DStringLength
+#define Ns_DStringSetLength Tcl_DStringSetLength
+#define Ns_DStringTrunc Tcl_DStringTrunc
+#define Ns_DStringAppendElement Tcl_DStringAppendElement
+
+typedef struct Ns_SetField {
+    char *name;
+    char *value;
+} Ns_SetField;
+
+typedef struct Ns_Set {
+    char *name;
+    size_t size;
+    size_t maxSize;
+    Ns_SetField *fields;
+} Ns_Set;
+
+#define Ns_SetSize(s) ((s)->size)
+#define Ns_SetKey(s,i) ((s)->fields[(i)].name)
+#define Ns_SetValue(s,i) ((s)->fields[(i)].value)
+#define Ns_SetLast(s) (((s)->size)-1)
+
+typedef struct Ns_Request {
+    char *line;
+    char *method;
+    char *protocol;
+    char *host;
+    unsigned short port;
+    char *url;
+    char *query;
+    int urlc;
+    char **urlv;
+    double version;
+    char *fragment;
+} Ns_Request;
+
+typedef struct Ns_Conn {
+    Ns_Request request;
+    Ns_Set *headers;
+    Ns_Set *outputheaders;
+    char *auth;
+    size_t contentLength;
+    unsigned int flags;
+} Ns_Conn;
+
+typedef enum {
+    NS_FILTER_PRE_AUTH = 1,
+    NS_FILTER_POST_AUTH = 2,
+    NS_FILTER_TRACE = 4,
+    NS_FILTER_VOID_TRACE = 8
+} Ns_FilterType;
+
+typedef Ns_ReturnCode (Ns_OpProc)(const void *arg,Ns_Conn *conn);
+typedef Ns_ReturnCode (Ns_FilterProc)(const void *arg,Ns_Conn *conn,Ns_FilterType why);
+typedef void (Ns_Callback)(void *arg);
+typedef void (Ns_FreeProc)(void *arg);
+typedef void (Ns_ThreadProc)(void *arg);
+typedef void (Ns_ThreadArgProc)(Tcl_DString *dsPtr,Ns_ThreadProc *proc,const void *arg);
+typedef void (Ns_SchedProc)(void *arg,int id);
+typedef void (Ns_TlsCleanup)(void *arg);
+typedef Ns_ReturnCode (Ns_TclTraceProc)(Tcl_Interp *interp,const void *arg);
+typedef Ns_ReturnCode (Ns_ModuleInitProc)(const char *server,const char *module);
+typedef void (ns_funcptr_t)(void);
+
+#define NS_TCL_TRACE_CREATE 1
+#define NS_TCL_TRACE_DEALLOCATE 2
+#define NS_TCL_SET_STATIC 0
+#define NS_TCL_SET_DYNAMIC 1
+#define NS_SCHED_THREAD 1
+#define NS_SCHED_ONCE 2
+#define NS_SCHED_DAILY 4
+#define NS_CONN_CLOSED 0x1
+#define NS_CONN_SENTHDRS 0x10
+#define NS_CONN_STREAM 0x40
+#define NS_CONN_ZIPACCEPTED 0x10000
+#define NS_OP_NOINHERIT 2
+
+typedef struct Ns_Cache Ns_Cache;
+typedef struct Ns_Entry Ns_Entry;
+
+typedef struct Ns_CacheSearch {
+    Tcl_HashSearch hsearch;
+} Ns_CacheSearch;
+
+extern Tcl_Encoding NS_utf8Encoding;
+
+/*
+ * Memory, log and config
+ */
+
+extern void *ns_malloc(size_t size);
+extern void *ns_calloc(size_t num,size_t size);
+extern void *ns_realloc(void *ptr,size_t size);
+extern void ns_free(void *ptr);
+extern char *ns_strdup(const char *str);
+extern struct tm *ns_localtime(const time_t *clock);
+
+extern char *Ns_DStringPrintf(Ns_DString *dsPtr,const char *fmt,...) __attribute__((format(printf,2,3)));
+extern char *Ns_DStringVarAppend(Ns_DString *dsPtr,...);
+extern char *Ns_DStringAppendTime(Ns_DString *dsPtr,const Ns_Time *timePtr);
+
+extern void Ns_Log(Ns_LogSeverity severity,const char *fmt,...) __attribute__((format(printf,2,3)));
+extern bool Ns_LogSeverityEnabled(Ns_LogSeverity severity);
+
+extern const char *Ns_ConfigGetPath(const char *server,const char *module,...);
+extern const char *Ns_ConfigGetValue(const char *section,const char *key);
+extern const char *Ns_ConfigString(const char *section,const char *key,const char *def);
+extern int Ns_ConfigIntRange(const char *section,const char *key,int def,int min,int max);
+extern bool Ns_ConfigBool(const char *section,const char *key,bool def);
+extern Tcl_WideInt Ns_ConfigMemUnitRange(const char *section,const char *key,const char *def,Tcl_WideInt defInt,Tcl_WideInt min,Tcl_WideInt max);
+extern void Ns_ConfigTimeUnitRange(const char *section,const char *key,const char *def,long minSec,long minUsec,long maxSec,long maxUsec,Ns_Time *timePtr);
+extern Ns_Set *Ns_ConfigGetSection(const char *section);
+extern Ns_ReturnCode Ns_GetTimeFromString(Tcl_Interp *interp,const char *str,Ns_Time *timePtr);
+
+/*
+ * Server info and paths
+ */
+
+extern const char *Ns_InfoHomePath(void);
+extern const char *Ns_InfoAddress(void);
+extern time_t Ns_InfoBootTime(void);
+extern const char *Ns_InfoBuildDate(void);
+extern const char *Ns_InfoConfigFile(void);
+extern const char *Ns_InfoHostname(void);
+extern const char *Ns_InfoTag(void);
+extern const char *Ns_InfoErrorLog(void);
+extern const char *Ns_InfoServerName(void);
+extern pid_t Ns_InfoPid(void);
+extern const char *Ns_InfoPlatform(void);
+extern long Ns_InfoUptime(void);
+extern const char *Ns_TclLibrary(const char *server);
+extern char *Ns_MakePath(Ns_DString *dsPtr,...);
+extern char *Ns_NormalizePath(Ns_DString *dsPtr,const char *path);
+extern const char *Ns_GetMimeType(const char *file);
+extern void Ns_GetProcInfo(Tcl_DString *dsPtr,ns_funcptr_t *procAddr,const void *arg);
+
+/*
+ * Threads and time
+ */
+
+extern void Ns_MutexInit(Ns_Mutex *mutexPtr);
+extern void Ns_MutexLock(Ns_Mutex *mutexPtr);
+extern void Ns_MutexUnlock(Ns_Mutex *mutexPtr);
+extern void Ns_MutexSetName(Ns_Mutex *mutexPtr,const char *name);
+extern void Ns_MutexSetName2(Ns_Mutex *mutexPtr,const char *prefix,const char *name);
+extern void Ns_MutexList(Tcl_DString *dsPtr);
+extern void Ns_MutexDestroy(Ns_Mutex *mutexPtr);
+extern void Ns_CondInit(Ns_Cond *condPtr);
+extern void Ns_CondSignal(Ns_Cond *condPtr);
+extern void Ns_CondBroadcast(Ns_Cond *condPtr);
+extern void Ns_CondWait(Ns_Cond *condPtr,Ns_Mutex *mutexPtr);
+extern Ns_ReturnCode Ns_CondTimedWait(Ns_Cond *condPtr,Ns_Mutex *mutexPtr,const Ns_Time *timePtr);
+extern void Ns_CondDestroy(Ns_Cond *condPtr);
+extern uintptr_t Ns_ThreadId(void);
+extern void Ns_ThreadCreate(Ns_ThreadProc *proc,void *arg,ssize_t stackSize,Ns_Thread *threadPtr);
+extern void Ns_ThreadSetName(const char *fmt,...);
+extern void Ns_ThreadList(Tcl_DString *dsPtr,Ns_ThreadArgProc *proc);
+extern void Ns_TlsAlloc(Ns_Tls *tlsPtr,Ns_TlsCleanup *cleanup);
+extern void *Ns_TlsGet(const Ns_Tls *tlsPtr);
+extern void Ns_TlsSet(const Ns_Tls *tlsPtr,void *value);
+extern void Ns_GetTime(Ns_Time *timePtr);
+extern void Ns_IncrTime(Ns_Time *timePtr,time_t sec,long usec);
+extern long Ns_DiffTime(const Ns_Time *t1,const Ns_Time *t0,Ns_Time *diffPtr);
+
+/*
+ * Requests, filters, interps and scheduling
+ */
+
+extern void Ns_RegisterRequest(const char *server,const char *method,const char *url,Ns_OpProc *proc,Ns_Callback *deleteCallback,void *arg,unsigned int flags);
+extern void Ns_UnRegisterRequest(const char *server,const char *method,const char *url,bool inherit);
+extern void *Ns_RegisterFilter(const char *server,const char *method,const char *url,Ns_FilterProc *proc,Ns_FilterType when,const void *arg,bool first);
+extern Ns_ReturnCode Ns_TclRegisterTrace(const char *server,Ns_TclTraceProc *proc,const void *arg,int when);
+extern Tcl_Interp *Ns_TclAllocateInterp(const char *server);
+extern void Ns_TclDeAllocateInterp(Tcl_Interp *interp);
+extern const char *Ns_TclLogErrorInfo(Tcl_Interp *interp,const char *extraInfo);
+extern Ns_ReturnCode Ns_TclEnterSet(Tcl_Interp *interp,Ns_Set *set,unsigned int flags);
+extern Ns_Set *Ns_TclGetSet(Tcl_Interp *interp,const char *setId);
+extern Ns_ReturnCode Ns_TclFreeSet(Tcl_Interp *interp,const char *setId);
+extern int Ns_ScheduleProcEx(Ns_SchedProc *proc,void *arg,unsigned int flags,const Ns_Time *interval,Ns_SchedProc *cleanup);
+extern int Ns_ScheduleDaily(Ns_SchedProc *proc,void *arg,unsigned int flags,int hour,int minute,Ns_SchedProc *cleanup);
+extern int Ns_After(const Ns_Time *interval,Ns_Callback *proc,void *arg,Ns_Callback *deleteProc);
+extern void Ns_UnscheduleProc(int id);
+
+/*
+ * Connections
+ */
+
+extern Ns_Conn *Ns_GetConn(void);
+extern const char *Ns_ConnServer(const Ns_Conn *conn);
+extern Tcl_Interp *Ns_GetConnInterp(Ns_Conn *conn);
+extern int Ns_ConnResponseStatus(const Ns_Conn *conn);
+extern void Ns_ConnSetResponseStatus(Ns_Conn *conn,int status);
+extern void Ns_ConnSetHeaders(const Ns_Conn *conn,const char *field,const char *value);
+extern void Ns_ConnSetTypeHeader(const Ns_Conn *conn,const char *type);
+extern void Ns_ConnSetLengthHeader(Ns_Conn *conn,size_t length,bool doStream);
+extern Ns_ReturnCode Ns_ConnReturnStatus(Ns_Conn *conn,int status);
+extern Ns_ReturnCode Ns_ConnReturnNotFound(Ns_Conn *conn);
+extern Ns_ReturnCode Ns_ConnReturnInternalError(Ns_Conn *conn);
+extern Ns_ReturnCode Ns_ConnReturnForbidden(Ns_Conn *conn);
+extern Ns_ReturnCode Ns_ConnReturnUnauthorized(Ns_Conn *conn);
+extern Ns_ReturnCode Ns_ConnReturnUnavailable(Ns_Conn *conn);
+extern Ns_ReturnCode Ns_ConnReturnNotModified(Ns_Conn *conn);
+extern Ns_ReturnCode Ns_ConnReturnRedirect(Ns_Conn *conn,const char *url);
+extern Ns_ReturnCode Ns_ConnReturnData(Ns_Conn *conn,int status,const char *data,ssize_t len,const char *type);
+extern Ns_ReturnCode Ns_ConnReturnCharData(Ns_Conn *conn,int status,const char *data,ssize_t len,const char *type);
+extern Ns_ReturnCode Ns_ConnReturnFile(Ns_Conn *conn,int status,const char *type,const char *file);
+extern Ns_ReturnCode Ns_ConnPuts(Ns_Conn *conn,const char *s);
+extern Ns_ReturnCode Ns_ConnWriteData(Ns_Conn *conn,const void *buf,size_t len,unsigned int flags);
+extern Ns_ReturnCode Ns_ConnWriteVData(Ns_Conn *conn,struct iovec *bufs,int nbufs,unsigned int flags);
+extern Ns_ReturnCode Ns_ConnWriteVChars(Ns_Conn *conn,struct iovec *bufs,int nbufs,unsigned int flags);
+extern Ns_ReturnCode Ns_ConnClose(Ns_Conn *conn);
+extern void Ns_ConnSetCompression(Ns_Conn *conn,int level);
+extern int Ns_ConnGetCompression(const Ns_Conn *conn);
+extern Ns_ReturnCode Ns_CompressGzip(const char *buf,int len,Tcl_DString *outPtr,int level);
+
+typedef struct Ns_CtxMD5 {
+    uint32_t buf[4];
+    uint32_t bits[2];
+    unsigned char in[64];
+} Ns_CtxMD5;
+
+extern void Ns_CtxMD5Init(Ns_CtxMD5 *ctx);
+extern void Ns_CtxMD5Update(Ns_CtxMD5 *ctx,const unsigned char *buf,size_t len);
+extern void Ns_CtxMD5Final(Ns_CtxMD5 *ctx,unsigned char digest[16]);
+
+extern const char *Ns_ConnAuthUser(const Ns_Conn *conn);
+extern const char *Ns_ConnAuthPasswd(const Ns_Conn *conn);
+extern char *Ns_ConnContent(const Ns_Conn *conn);
+extern const char *Ns_ConnPeerAddr(const Ns_Conn *conn);
+extern unsigned short Ns_ConnPeerPort(const Ns_Conn *conn);
+extern const char *Ns_ConnHost(const Ns_Conn *conn);
+extern unsigned short Ns_ConnPort(const Ns_Conn *conn);
+extern char *Ns_ConnLocationAppend(Ns_Conn *conn,Ns_DString *dsPtr);
+extern const char *Ns_ConnDriverName(const Ns_Conn *conn);
+extern int Ns_ConnSock(const Ns_Conn *conn);
+extern uintptr_t Ns_ConnId(const Ns_Conn *conn);
+extern bool Ns_ConnGetWriteEncodedFlag(const Ns_Conn *conn);
+extern Ns_Set *Ns_ConnGetQuery(Tcl_Interp *interp,Ns_Conn *conn,void *formPtr,void *rejectPtr);
+
+/*
+ * Sets, url encoding, HTML
+ */
+
+extern Ns_Set *Ns_SetCreate(const char *name);
+extern void Ns_SetFree(Ns_Set *set);
+extern size_t Ns_SetPut(Ns_Set *set,const char *key,const char *value);
+extern int Ns_SetFind(const Ns_Set *set,const char *key);
+extern int Ns_SetIFind(const Ns_Set *set,const char *key);
+extern const char *Ns_SetGet(const Ns_Set *set,const char *key);
+extern const char *Ns_SetIGet(const Ns_Set *set,const char *key);
+extern int Ns_SetUnique(const Ns_Set *set,const char *key);
+extern int Ns_SetIUnique(const Ns_Set *set,const char *key);
+extern void Ns_SetUpdate(Ns_Set *set,const char *key,const char *value);
+extern void Ns_SetDeleteKey(Ns_Set *set,const char *key);
+extern void Ns_SetIDeleteKey(Ns_Set *set,const char *key);
+extern void Ns_SetDelete(Ns_Set *set,int index);
+extern void Ns_SetTrunc(Ns_Set *set,size_t size);
+extern void Ns_SetMerge(Ns_Set *high,const Ns_Set *low);
+extern void Ns_SetMove(Ns_Set *to,Ns_Set *from);
+extern void Ns_SetPrint(const Ns_Set *set);
+extern Ns_Set *Ns_SetCopy(const Ns_Set *old);
+extern Ns_Set **Ns_SetSplit(const Ns_Set *set,char sep);
+extern char *Ns_UrlQueryEncode(Ns_DString *dsPtr,const char *str,Tcl_Encoding encoding);
+extern char *Ns_UrlQueryDecode(Ns_DString *dsPtr,const char *str,Tcl_Encoding encoding);
+extern void Ns_QuoteHtml(Ns_DString *dsPtr,const char *html);
+
+/*
+ * Caches
+ */
+
+extern Ns_Cache *Ns_CacheCreateSz(const char *name,int keys,size_t maxSize,Ns_FreeProc *freeProc);
+extern void Ns_CacheLock(Ns_Cache *cache);
+extern void Ns_CacheUnlock(Ns_Cache *cache);
+extern Ns_Entry *Ns_CacheFindEntry(Ns_Cache *cache,const char *key);
+extern Ns_Entry *Ns_CacheCreateEntry(Ns_Cache *cache,const char *key,int *newPtr);
+extern void *Ns_CacheGetValue(const Ns_Entry *entry);
+extern void Ns_CacheSetValueSz(Ns_Entry *entry,void *value,size_t size);
+extern void Ns_CacheSetValueExpires(Ns_Entry *entry,void *value,size_t size,const Ns_Time *timeoutPtr,int cost);
+extern void Ns_CacheDeleteEntry(Ns_Entry *entry);
+extern void Ns_CacheFlushEntry(Ns_Entry *entry);
+extern int Ns_CacheFlush(Ns_Cache *cache);
+extern void Ns_CacheBroadcast(Ns_Cache *cache);
+extern char *Ns_CacheStats(Ns_Cache *cache,Ns_DString *dsPtr);
+extern Ns_Entry *Ns_CacheFirstEntry(Ns_Cache *cache,Ns_CacheSearch *search);
+extern Ns_Entry *Ns_CacheNextEntry(Ns_CacheSearch *search);
+extern const char *Ns_CacheKey(const Ns_Entry *entry);
+
+#endif
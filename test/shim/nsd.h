@@ -0,0 +1,156 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1(the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/.
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis,WITHOUT WARRANTY OF ANY KIND,either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * Alternatively,the contents of this file may be used under the terms
+ * of the GNU General Public License(the "GPL"),in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License,indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above,a recipient may use your
+ * version of this file under either the License or the GPL.
+ *
+ */
+
+/*
+ * nsd.h -- Server internals used by naviserver.c, only the fields the
+ *          stubs touch, implemented by shim.c
+ *
+ */
+
+#ifndef NSD_H
+#define NSD_H
+
+#include "ns.h"
+
+typedef struct NsServer NsServer;
+typedef struct ConnPool ConnPool;
+typedef struct Conn Conn;
+
+typedef struct ConnThreadArg {
+    Conn *connPtr;
+} ConnThreadArg;
+
+struct ConnPool {
+    const char *pool;
+    ConnPool *nextPtr;
+    struct {
+      Ns_Mutex lock;
+      struct {
+        int num;
+        Conn *firstPtr;
+      } wait;
+    } wqueue;
+    struct {
+      Ns_Mutex lock;
+      ConnThreadArg *args;
+    } tqueue;
+    struct {
+      int min, max, current, idle;
+    } threads;
+};
+
+struct NsServer {
+    const char *server;
+    struct {
+      const char *pageroot;
+    } fastpath;
+    struct {
+      Ns_Mutex lock;
+      unsigned long nextconnid;
+      ConnPool *firstPtr;
+      ConnPool *defaultPtr;
+    } pools;
+    struct {
+      int nbuckets;
+      struct Bucket *buckets;
+    } nsv;
+};
+
+typedef struct NsInterp {
+    Tcl_Interp *interp;
+    NsServer *servPtr;
+    Conn *conn;
+    Tcl_HashTable sets;
+    Tcl_HashTable httpRequests;
+    struct {
+      unsigned int flags;
+      char form[64];
+      char hdrs[64];
+      char outhdrs[64];
+    } nsconn;
+} NsInterp;
+
+/*
+ * Connection, the public part comes first like in nsd
+ */
+
+struct Conn {
+    Ns_Request request;
+    Ns_Set *headers;
+    Ns_Set *outputheaders;
+    char *auth;
+    size_t contentLength;
+    unsigned int flags;
+    Conn *nextPtr;
+    ConnPool *poolPtr;
+    void *reqPtr;
+    char idstr[16];
+    Ns_Time requestQueueTime;
+    size_t nContentSent;
+    Tcl_Encoding outputEncoding;
+    Tcl_Encoding urlEncoding;
+    Tcl_HashTable files;
+    int responseStatus;
+    char *content;
+    Ns_Set *query;
+    Tcl_Interp *interp;
+    int compress;               /* Compression level */
+    void *zstream;              /* Deflate state of a compressed stream */
+    Tcl_DString output;         /* Everything written to the client */
+};
+
+#define CONN_TCLHDRS 1
+#define CONN_TCLOUTHDRS 2
+#define CONN_TCLFORM 4
+#define NS_CONN_CONFIGURED 0x100
+
+typedef struct NsConf {
+    Tcl_DString servers;
+    const char *argv0;
+    const char *nsd;
+    const char *home;
+} NsConf;
+
+extern NsConf nsconf;
+
+struct Ns_ObjvSpec;
+typedef int (Ns_ObjvProc)(struct Ns_ObjvSpec *spec,Tcl_Interp *interp,int *objcPtr,Tcl_Obj *const* objv);
+
+typedef struct Ns_ObjvSpec {
+    const char *key;
+    Ns_ObjvProc *proc;
+    void *dest;
+    void *arg;
+} Ns_ObjvSpec;
+
+extern Ns_ObjvProc Ns_ObjvBool;
+extern Ns_ReturnCode Ns_ParseObjv(Ns_ObjvSpec *opts,Ns_ObjvSpec *args,Tcl_Interp *interp,int offset,int objc,Tcl_Obj *const* objv);
+
+extern NsServer *NsGetServer(const char *server);
+extern NsInterp *NsGetInterpData(Tcl_Interp *interp);
+extern void NsGetCallbacks(Tcl_DString *dsPtr);
+extern void NsGetScheduled(Tcl_DString *dsPtr);
+extern void NsGetSockCallbacks(Tcl_DString *dsPtr);
+extern Ns_ReturnCode NsUrlToFile(Ns_DString *dsPtr,NsServer *servPtr,const char *url);
+
+#endif
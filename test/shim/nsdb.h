@@ -0,0 +1,66 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1(the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/.
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis,WITHOUT WARRANTY OF ANY KIND,either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * Alternatively,the contents of this file may be used under the terms
+ * of the GNU General Public License(the "GPL"),in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License,indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above,a recipient may use your
+ * version of this file under either the License or the GPL.
+ *
+ */
+
+/*
+ * nsdb.h -- Subset of the nsdb pool API used by naviserver.c, implemented
+ *           by shim.c over SQLite
+ *
+ */
+
+#ifndef NSDB_H
+#define NSDB_H
+
+#include "ns.h"
+
+#define NS_DML            1
+#define NS_ROWS           2
+#define NS_END_DATA       4
+#define NS_NO_DATA        8
+
+typedef struct Ns_DbHandle {
+    const char *driver;
+    const char *datasource;
+    const char *user;
+    const char *password;
+    void       *connection;
+    const char *poolname;
+    bool        connected;
+    bool        verbose;
+    Ns_Set     *row;
+    char        cExceptionCode[6];
+    Ns_DString  dsExceptionMsg;
+    void       *context;
+    void       *statement;
+    bool        fetchingRows;
+} Ns_DbHandle;
+
+extern Ns_DbHandle *Ns_DbPoolGetHandle(const char *server,const char *pool);
+extern void Ns_DbPoolPutHandle(Ns_DbHandle *handle);
+extern const char *Ns_DbPoolDefault(const char *server);
+extern Ns_Set *Ns_DbSelect(Ns_DbHandle *handle,const char *sql);
+extern Ns_ReturnCode Ns_DbDML(Ns_DbHandle *handle,const char *sql);
+extern int Ns_DbGetRow(Ns_DbHandle *handle,Ns_Set *row);
+extern Ns_ReturnCode Ns_DbFlush(Ns_DbHandle *handle);
+extern void Ns_DbQuoteValue(Ns_DString *dsPtr,const char *chars);
+
+#endif
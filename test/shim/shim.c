@@ -0,0 +1,2220 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1(the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/.
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis,WITHOUT WARRANTY OF ANY KIND,either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * Alternatively,the contents of this file may be used under the terms
+ * of the GNU General Public License(the "GPL"),in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License,indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above,a recipient may use your
+ * version of this file under either the License or the GPL.
+ *
+ */
+
+/*
+ * shim.c -- In-memory stand-in for the parts of nsd used by the OCaml
+ *           stubs, so naviserver.c and nsocaml.c run in a standalone
+ *           executable. Connections are fake, the output is collected
+ *           in memory, scheduled procs run only when asked to.
+ *
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <sys/time.h>
+#include <sqlite3.h>
+#include <zlib.h>
+#include "nsd.h"
+#include "nsdb.h"
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/mlvalues.h>
+#include "nsocaml.h"
+
+Tcl_Encoding NS_utf8Encoding;
+NsConf nsconf;
+
+/*
+ * nsv buckets, same layout as the copy in naviserver.c
+ */
+
+typedef struct Bucket {
+    Ns_Mutex lock;
+    Tcl_HashTable arrays;
+} Bucket;
+
+#define NBUCKETS 8
+
+static NsServer server;
+static ConnPool pool;
+static Bucket buckets[NBUCKETS];
+static Conn *current;
+static Tcl_HashTable config;
+static bool logEnabled[] = {NS_TRUE,NS_TRUE,NS_TRUE,NS_TRUE,NS_TRUE,NS_FALSE,NS_FALSE};
+static Ns_Time boot;
+
+typedef struct Proc {
+    char *method;
+    char *url;
+    Ns_OpProc *proc;
+    Ns_FilterProc *filter;
+    Ns_FilterType when;
+    Ns_Callback *deleteCallback;
+    void *arg;
+    struct Proc *nextPtr;
+} Proc;
+
+static Proc *procs;
+static Proc *filters;
+
+typedef struct Trace {
+    Ns_TclTraceProc *proc;
+    const void *arg;
+    struct Trace *nextPtr;
+} Trace;
+
+static Trace *traces;
+
+typedef struct Sched {
+    int id;
+    Ns_SchedProc *proc;
+    Ns_SchedProc *cleanup;
+    Ns_Callback *callback;
+    Ns_Callback *deleteCallback;
+    void *arg;
+    unsigned int flags;
+    struct Sched *nextPtr;
+} Sched;
+
+static Sched *scheduled;
+static int nextSchedId = 1;
+
+/*
+ * Memory and strings
+ */
+
+void *ns_malloc(size_t size) { return malloc(size ? size : 1); }
+void *ns_calloc(size_t num,size_t size) { return calloc(num ? num : 1,size ? size : 1); }
+void *ns_realloc(void *ptr,size_t size) { return realloc(ptr,size ? size : 1); }
+void ns_free(void *ptr) { free(ptr); }
+char *ns_strdup(const char *str) { return strcpy(ns_malloc(strlen(str) + 1),str); }
+
+struct tm *
+ns_localtime(const time_t *clock)
+{
+    static __thread struct tm tm;
+
+    return localtime_r(clock,&tm);
+}
+
+char *
+Ns_DStringPrintf(Ns_DString *dsPtr,const char *fmt,...)
+{
+    char buf[4096];
+    va_list ap;
+    int n;
+
+    va_start(ap,fmt);
+    n = vsnprintf(buf,sizeof(buf),fmt,ap);
+    va_end(ap);
+    if(n >= (int)sizeof(buf)) {
+      char *big = ns_malloc(n + 1);
+      va_start(ap,fmt);
+      vsnprintf(big,n + 1,fmt,ap);
+      va_end(ap);
+      Tcl_DStringAppend(dsPtr,big,n);
+      ns_free(big);
+    } else {
+      Tcl_DStringAppend(dsPtr,buf,n);
+    }
+    return dsPtr->string;
+}
+
+char *
+Ns_DStringVarAppend(Ns_DString *dsPtr,...)
+{
+    const char *s;
+    va_list ap;
+
+    va_start(ap,dsPtr);
+    while((s = va_arg(ap,const char *))) Tcl_DStringAppend(dsPtr,s,-1);
+    va_end(ap);
+    return dsPtr->string;
+}
+
+char *
+Ns_DStringAppendTime(Ns_DString *dsPtr,const Ns_Time *timePtr)
+{
+    return Ns_DStringPrintf(dsPtr,"%ld.%06ld",(long)timePtr->sec,timePtr->usec);
+}
+
+/*
+ * Log, enabled severities go to stderr, see shim_log_enable
+ */
+
+void
+Ns_Log(Ns_LogSeverity severity,const char *fmt,...)
+{
+    static const char *names[] = {"Notice","Warning","Error","Fatal","Bug","Debug","Dev"};
+    va_list ap;
+
+    if(!Ns_LogSeverityEnabled(severity)) return;
+    fprintf(stderr,"[%s] ",names[severity]);
+    va_start(ap,fmt);
+    vfprintf(stderr,fmt,ap);
+    va_end(ap);
+    fputc('\n',stderr);
+}
+
+bool
+Ns_LogSeverityEnabled(Ns_LogSeverity severity)
+{
+    return severity >= 0 && severity <= Dev && logEnabled[severity];
+}
+
+/*
+ * Config, sections are sets filled by shim_config
+ */
+
+const char *
+Ns_ConfigGetPath(const char *server,const char *module,...)
+{
+    static __thread char path[256];
+
+    snprintf(path,sizeof(path),"ns/server/%s/module/%s",server ? server : "",module ? module : "");
+    return path;
+}
+
+Ns_Set *
+Ns_ConfigGetSection(const char *section)
+{
+    Tcl_HashEntry *hPtr = config.numBuckets ? Tcl_FindHashEntry(&config,section) : 0;
+
+    return hPtr ? Tcl_GetHashValue(hPtr) : 0;
+}
+
+const char *
+Ns_ConfigGetValue(const char *section,const char *key)
+{
+    Ns_Set *set = Ns_ConfigGetSection(section);
+
+    return set ? Ns_SetIGet(set,key) : 0;
+}
+
+const char *
+Ns_ConfigString(const char *section,const char *key,const char *def)
+{
+    const char *value = Ns_ConfigGetValue(section,key);
+
+    return value ? value : def;
+}
+
+int
+Ns_ConfigIntRange(const char *section,const char *key,int def,int min,int max)
+{
+    const char *value = Ns_ConfigGetValue(section,key);
+    int i = value ? atoi(value) : def;
+
+    return i < min ? min : i > max ? max : i;
+}
+
+bool
+Ns_ConfigBool(const char *section,const char *key,bool def)
+{
+    const char *value = Ns_ConfigGetValue(section,key);
+    int b;
+
+    if(!value || Tcl_GetBoolean(0,value,&b) != TCL_OK) return def;
+    return b;
+}
+
+Tcl_WideInt
+Ns_ConfigMemUnitRange(const char *section,const char *key,const char *def,Tcl_WideInt defInt,Tcl_WideInt min,Tcl_WideInt max)
+{
+    const char *value = Ns_ConfigString(section,key,def);
+    Tcl_WideInt i = defInt;
+    char *end;
+
+    if(value) {
+      i = strtoll(value,&end,10);
+      switch(toupper(*end)) {
+       case 'K': i <<= 10; break;
+       case 'M': i <<= 20; break;
+       case 'G': i <<= 30; break;
+      }
+    }
+    return i < min ? min : i > max ? max : i;
+}
+
+Ns_ReturnCode
+Ns_GetTimeFromString(Tcl_Interp *interp,const char *str,Ns_Time *timePtr)
+{
+    char *end;
+    double d = strtod(str,&end);
+
+    if(end == str) return NS_ERROR;
+    if(!strcmp(end,"ms")) d /= 1000.0; else
+    if(!strcmp(end,"m")) d *= 60.0; else
+    if(!strcmp(end,"h")) d *= 3600.0; else
+    if(!strcmp(end,"d")) d *= 86400.0;
+    timePtr->sec = (time_t)d;
+    timePtr->usec = (long)((d - (double)timePtr->sec) * 1000000.0);
+    return NS_OK;
+}
+
+void
+Ns_ConfigTimeUnitRange(const char *section,const char *key,const char *def,long minSec,long minUsec,long maxSec,long maxUsec,Ns_Time *timePtr)
+{
+    const char *value = Ns_ConfigString(section,key,def);
+
+    timePtr->sec = timePtr->usec = 0;
+    if(value) Ns_GetTimeFromString(0,value,timePtr);
+    if(timePtr->sec < minSec) timePtr->sec = minSec;
+    if(timePtr->sec > maxSec) timePtr->sec = maxSec;
+}
+
+/*
+ * Server info and paths
+ */
+
+const char *Ns_InfoHomePath(void) { return "."; }
+const char *Ns_InfoAddress(void) { return "127.0.0.1"; }
+time_t Ns_InfoBootTime(void) { return boot.sec; }
+const char *Ns_InfoBuildDate(void) { return __DATE__; }
+const char *Ns_InfoConfigFile(void) { return "shim"; }
+const char *Ns_InfoHostname(void) { return "localhost"; }
+const char *Ns_InfoTag(void) { return "shim"; }
+const char *Ns_InfoErrorLog(void) { return "stderr"; }
+const char *Ns_InfoServerName(void) { return "NaviServer"; }
+pid_t Ns_InfoPid(void) { return getpid(); }
+const char *Ns_InfoPlatform(void) { return "linux"; }
+long Ns_InfoUptime(void) { return (long)(time(0) - boot.sec); }
+const char *Ns_TclLibrary(const char *server) { return "."; }
+
+char *
+Ns_MakePath(Ns_DString *dsPtr,...)
+{
+    const char *s;
+    va_list ap;
+
+    va_start(ap,dsPtr);
+    while((s = va_arg(ap,const char *))) {
+      while(*s == '/') s++;
+      if(dsPtr->length == 0 || dsPtr->string[dsPtr->length - 1] != '/') Tcl_DStringAppend(dsPtr,"/",1);
+      Tcl_DStringAppend(dsPtr,s,-1);
+    }
+    va_end(ap);
+    return dsPtr->string;
+}
+
+char *
+Ns_NormalizePath(Ns_DString *dsPtr,const char *path)
+{
+    Tcl_DString part;
+    const char *end;
+    int len;
+
+    Tcl_DStringInit(&part);
+    for(;*path;path = end) {
+      while(*path == '/') path++;
+      if(!*path) break;
+      for(end = path;*end && *end != '/';end++);
+      len = (int)(end - path);
+      if(len == 1 && *path == '.') continue;
+      if(len == 2 && path[0] == '.' && path[1] == '.') {
+        char *slash = strrchr(part.string,'/');
+        Tcl_DStringSetLength(&part,slash ? (int)(slash - part.string) : 0);
+        continue;
+      }
+      Tcl_DStringAppend(&part,"/",1);
+      Tcl_DStringAppend(&part,path,len);
+    }
+    Tcl_DStringAppend(dsPtr,part.length ? part.string : "/",-1);
+    Tcl_DStringFree(&part);
+    return dsPtr->string;
+}
+
+const char *
+Ns_GetMimeType(const char *file)
+{
+    static const char *types[] = {
+      ".html", "text/html", ".htm", "text/html", ".txt", "text/plain",
+      ".css", "text/css", ".js", "application/javascript", ".json", "application/json",
+      ".png", "image/png", ".jpg", "image/jpeg", ".gif", "image/gif", 0
+    };
+    const char *ext = strrchr(file,'.');
+    int i;
+
+    for(i = 0;ext && types[i];i += 2) {
+      if(!strcasecmp(ext,types[i])) return types[i+1];
+    }
+    return "*/*";
+}
+
+void
+Ns_GetProcInfo(Tcl_DString *dsPtr,ns_funcptr_t *procAddr,const void *arg)
+{
+    Ns_DStringPrintf(dsPtr,"p:%p a:%p",(void*)procAddr,arg);
+}
+
+/*
+ * Threads and time over pthreads, objects are created on first use
+ */
+
+static pthread_mutex_t initLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t *
+GetMutex(Ns_Mutex *mutexPtr)
+{
+    if(!*mutexPtr) {
+      pthread_mutex_lock(&initLock);
+      if(!*mutexPtr) {
+        pthread_mutex_t *m = ns_malloc(sizeof(pthread_mutex_t));
+        pthread_mutex_init(m,0);
+        *mutexPtr = m;
+      }
+      pthread_mutex_unlock(&initLock);
+    }
+    return *mutexPtr;
+}
+
+static pthread_cond_t *
+GetCond(Ns_Cond *condPtr)
+{
+    if(!*condPtr) {
+      pthread_mutex_lock(&initLock);
+      if(!*condPtr) {
+        pthread_cond_t *c = ns_malloc(sizeof(pthread_cond_t));
+        pthread_cond_init(c,0);
+        *condPtr = c;
+      }
+      pthread_mutex_unlock(&initLock);
+    }
+    return *condPtr;
+}
+
+void Ns_MutexInit(Ns_Mutex *mutexPtr) { GetMutex(mutexPtr); }
+void Ns_MutexLock(Ns_Mutex *mutexPtr) { pthread_mutex_lock(GetMutex(mutexPtr)); }
+void Ns_MutexUnlock(Ns_Mutex *mutexPtr) { pthread_mutex_unlock(GetMutex(mutexPtr)); }
+void Ns_MutexSetName(Ns_Mutex *mutexPtr,const char *name) { GetMutex(mutexPtr); }
+void Ns_MutexSetName2(Ns_Mutex *mutexPtr,const char *prefix,const char *name) { GetMutex(mutexPtr); }
+void Ns_MutexList(Tcl_DString *dsPtr) { }
+void Ns_MutexDestroy(Ns_Mutex *mutexPtr) { if(*mutexPtr) { pthread_mutex_destroy(*mutexPtr); ns_free(*mutexPtr); *mutexPtr = 0; } }
+void Ns_CondInit(Ns_Cond *condPtr) { GetCond(condPtr); }
+void Ns_CondSignal(Ns_Cond *condPtr) { pthread_cond_signal(GetCond(condPtr)); }
+void Ns_CondBroadcast(Ns_Cond *condPtr) { pthread_cond_broadcast(GetCond(condPtr)); }
+void Ns_CondWait(Ns_Cond *condPtr,Ns_Mutex *mutexPtr) { pthread_cond_wait(GetCond(condPtr),GetMutex(mutexPtr)); }
+void Ns_CondDestroy(Ns_Cond *condPtr) { if(*condPtr) { pthread_cond_destroy(*condPtr); ns_free(*condPtr); *condPtr = 0; } }
+
+Ns_ReturnCode
+Ns_CondTimedWait(Ns_Cond *condPtr,Ns_Mutex *mutexPtr,const Ns_Time *timePtr)
+{
+    struct timespec ts;
+
+    if(!timePtr) {
+      Ns_CondWait(condPtr,mutexPtr);
+      return NS_OK;
+    }
+    ts.tv_sec = timePtr->sec;
+    ts.tv_nsec = timePtr->usec * 1000;
+    return pthread_cond_timedwait(GetCond(condPtr),GetMutex(mutexPtr),&ts) == ETIMEDOUT ? NS_TIMEOUT : NS_OK;
+}
+
+uintptr_t
+Ns_ThreadId(void)
+{
+    return (uintptr_t)pthread_self();
+}
+
+typedef struct ThreadArg {
+    Ns_ThreadProc *proc;
+    void *arg;
+} ThreadArg;
+
+static void *
+ThreadMain(void *arg)
+{
+    ThreadArg a = *(ThreadArg*)arg;
+
+    ns_free(arg);
+    a.proc(a.arg);
+    return 0;
+}
+
+void
+Ns_ThreadCreate(Ns_ThreadProc *proc,void *arg,ssize_t stackSize,Ns_Thread *threadPtr)
+{
+    ThreadArg *argPtr = ns_malloc(sizeof(ThreadArg));
+    pthread_t tid;
+
+    argPtr->proc = proc;
+    argPtr->arg = arg;
+    pthread_create(&tid,0,ThreadMain,argPtr);
+    if(threadPtr) *threadPtr = (Ns_Thread)tid; else pthread_detach(tid);
+}
+
+void Ns_ThreadSetName(const char *fmt,...) { }
+void Ns_ThreadList(Tcl_DString *dsPtr,Ns_ThreadArgProc *proc) { }
+
+void
+Ns_TlsAlloc(Ns_Tls *tlsPtr,Ns_TlsCleanup *cleanup)
+{
+    pthread_key_t *key = ns_malloc(sizeof(pthread_key_t));
+
+    pthread_key_create(key,cleanup);
+    *tlsPtr = key;
+}
+
+void *Ns_TlsGet(const Ns_Tls *tlsPtr) { return pthread_getspecific(*(pthread_key_t*)*tlsPtr); }
+void Ns_TlsSet(const Ns_Tls *tlsPtr,void *value) { pthread_setspecific(*(pthread_key_t*)*tlsPtr,value); }
+
+void
+Ns_GetTime(Ns_Time *timePtr)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv,0);
+    timePtr->sec = tv.tv_sec;
+    timePtr->usec = tv.tv_usec;
+}
+
+void
+Ns_IncrTime(Ns_Time *timePtr,time_t sec,long usec)
+{
+    timePtr->sec += sec;
+    timePtr->usec += usec;
+    while(timePtr->usec >= 1000000) {
+      timePtr->usec -= 1000000;
+      timePtr->sec++;
+    }
+}
+
+long
+Ns_DiffTime(const Ns_Time *t1,const Ns_Time *t0,Ns_Time *diffPtr)
+{
+    Ns_Time diff;
+
+    diff.sec = t1->sec - t0->sec;
+    diff.usec = t1->usec - t0->usec;
+    if(diff.usec < 0) {
+      diff.usec += 1000000;
+      diff.sec--;
+    }
+    if(diffPtr) *diffPtr = diff;
+    return diff.sec < 0 ? -1 : (diff.sec > 0 || diff.usec > 0) ? 1 : 0;
+}
+
+/*
+ * Requests and filters, dispatched by shim_request
+ */
+
+void
+Ns_RegisterRequest(const char *server,const char *method,const char *url,Ns_OpProc *proc,Ns_Callback *deleteCallback,void *arg,unsigned int flags)
+{
+    Proc *procPtr = ns_calloc(1,sizeof(Proc));
+
+    Ns_UnRegisterRequest(server,method,url,NS_TRUE);
+    procPtr->method = ns_strdup(method);
+    procPtr->url = ns_strdup(url);
+    procPtr->proc = proc;
+    procPtr->deleteCallback = deleteCallback;
+    procPtr->arg = arg;
+    procPtr->nextPtr = procs;
+    procs = procPtr;
+}
+
+void
+Ns_UnRegisterRequest(const char *server,const char *method,const char *url,bool inherit)
+{
+    Proc **procPtrPtr = &procs, *procPtr;
+
+    while((procPtr = *procPtrPtr)) {
+      if(!strcmp(procPtr->method,method) && !strcmp(procPtr->url,url)) {
+        *procPtrPtr = procPtr->nextPtr;
+        if(procPtr->deleteCallback) procPtr->deleteCallback(procPtr->arg);
+        ns_free(procPtr->method);
+        ns_free(procPtr->url);
+        ns_free(procPtr);
+      } else {
+        procPtrPtr = &procPtr->nextPtr;
+      }
+    }
+}
+
+void *
+Ns_RegisterFilter(const char *server,const char *method,const char *url,Ns_FilterProc *proc,Ns_FilterType when,const void *arg,bool first)
+{
+    Proc *procPtr = ns_calloc(1,sizeof(Proc)), **tailPtr = &filters;
+
+    procPtr->method = ns_strdup(method);
+    procPtr->url = ns_strdup(url);
+    procPtr->filter = proc;
+    procPtr->when = when;
+    procPtr->arg = (void*)arg;
+    if(!first) while(*tailPtr) tailPtr = &(*tailPtr)->nextPtr;
+    procPtr->nextPtr = *tailPtr;
+    *tailPtr = procPtr;
+    return procPtr;
+}
+
+static bool
+Match(const Proc *procPtr,const char *method,const char *url)
+{
+    size_t len = strlen(procPtr->url);
+
+    if(strcmp(procPtr->method,method)) return NS_FALSE;
+    if(Tcl_StringMatch(url,procPtr->url)) return NS_TRUE;
+    // Registered URL also matches everything below it
+    return !strncmp(url,procPtr->url,len) && (url[len] == '/' || procPtr->url[len-1] == '/');
+}
+
+static Ns_ReturnCode
+RunFilters(Conn *connPtr,Ns_FilterType when)
+{
+    Proc *procPtr;
+    Ns_ReturnCode status = NS_OK;
+
+    for(procPtr = filters;procPtr && status == NS_OK;procPtr = procPtr->nextPtr) {
+      if(procPtr->when == when && Match(procPtr,connPtr->request.method,connPtr->request.url))
+        status = procPtr->filter(procPtr->arg,(Ns_Conn*)connPtr,when);
+    }
+    return status == NS_FILTER_BREAK ? NS_OK : status;
+}
+
+/*
+ * Tcl interps get NsInterp as assoc data and the registered traces
+ */
+
+Ns_ReturnCode
+Ns_TclRegisterTrace(const char *server,Ns_TclTraceProc *proc,const void *arg,int when)
+{
+    Trace *tracePtr;
+
+    if(when != NS_TCL_TRACE_CREATE) return NS_OK;
+    tracePtr = ns_malloc(sizeof(Trace));
+    tracePtr->proc = proc;
+    tracePtr->arg = arg;
+    tracePtr->nextPtr = traces;
+    traces = tracePtr;
+    return NS_OK;
+}
+
+static void
+FreeInterpData(ClientData arg,Tcl_Interp *interp)
+{
+    NsInterp *itPtr = arg;
+    Tcl_HashSearch search;
+    Tcl_HashEntry *hPtr;
+
+    for(hPtr = Tcl_FirstHashEntry(&itPtr->sets,&search);hPtr;hPtr = Tcl_NextHashEntry(&search)) {
+      Ns_SetFree(Tcl_GetHashValue(hPtr));
+    }
+    Tcl_DeleteHashTable(&itPtr->sets);
+    ns_free(itPtr);
+}
+
+/*
+ * ns_http stand-in, queued requests are answered by wait with 200 and
+ * an echo of the request: "method url" line, then the request body.
+ * Request headers come back prefixed with X-Echo-. Waiting for a url on
+ * host fail raises an error, cancel drops a queued request.
+ */
+
+typedef struct HttpRequest {
+    Tcl_Obj *bodyObj;           /* Response body */
+    Ns_Set *headers;            /* Response headers */
+    bool fail;
+} HttpRequest;
+
+static void
+FreeHttpRequest(HttpRequest *reqPtr)
+{
+    Tcl_DecrRefCount(reqPtr->bodyObj);
+    ns_free(reqPtr);
+}
+
+static int
+ShimHttpCmd(ClientData arg,Tcl_Interp *interp,int objc,Tcl_Obj *const objv[])
+{
+    static int nextid;
+    Tcl_HashTable *requests = arg;
+    Tcl_HashEntry *hPtr;
+    HttpRequest *reqPtr;
+    Tcl_Obj *dict;
+    Tcl_DString name;
+    Ns_Set *set;
+    const char *opt, *method = "GET", *body = "";
+    char id[32];
+    size_t i;
+    int isNew, n;
+
+    if(objc < 3) {
+      Tcl_WrongNumArgs(interp,1,objv,"queue|wait|cancel ?args?");
+      return TCL_ERROR;
+    }
+    if(!strcmp(Tcl_GetString(objv[1]),"queue")) {
+      snprintf(id,sizeof(id),"http%d",nextid++);
+      reqPtr = ns_malloc(sizeof(HttpRequest));
+      reqPtr->headers = Ns_SetCreate("headers");
+      Tcl_DStringInit(&name);
+      for(n = 2;n < objc - 1;n += 2) {
+        opt = Tcl_GetString(objv[n]);
+        if(!strcmp(opt,"-method")) method = Tcl_GetString(objv[n+1]); else
+        if(!strcmp(opt,"-body")) body = Tcl_GetString(objv[n+1]); else
+        if(!strcmp(opt,"-headers") && (set = Ns_TclGetSet(interp,Tcl_GetString(objv[n+1])))) {
+          for(i = 0;i < set->size;i++) {
+            Tcl_DStringSetLength(&name,0);
+            Tcl_DStringAppend(&name,"X-Echo-",-1);
+            Tcl_DStringAppend(&name,set->fields[i].name,-1);
+            Ns_SetPut(reqPtr->headers,name.string,set->fields[i].value);
+          }
+        }
+      }
+      Tcl_DStringFree(&name);
+      Ns_SetPut(reqPtr->headers,"X-Request",id);
+      reqPtr->fail = !strncmp(Tcl_GetString(objv[objc-1]),"http://fail/",12);
+      reqPtr->bodyObj = Tcl_NewStringObj(method,-1);
+      Tcl_AppendStringsToObj(reqPtr->bodyObj," ",Tcl_GetString(objv[objc-1]),"\n",body,NULL);
+      Tcl_IncrRefCount(reqPtr->bodyObj);
+      hPtr = Tcl_CreateHashEntry(requests,id,&isNew);
+      Tcl_SetHashValue(hPtr,reqPtr);
+      Tcl_SetObjResult(interp,Tcl_NewStringObj(id,-1));
+      return TCL_OK;
+    }
+    if(!strcmp(Tcl_GetString(objv[1]),"wait")) {
+      if(!(hPtr = Tcl_FindHashEntry(requests,Tcl_GetString(objv[objc-1])))) {
+        Tcl_AppendResult(interp,"no such request: ",Tcl_GetString(objv[objc-1]),NULL);
+        return TCL_ERROR;
+      }
+      reqPtr = Tcl_GetHashValue(hPtr);
+      Tcl_DeleteHashEntry(hPtr);
+      if(reqPtr->fail) {
+        Ns_SetFree(reqPtr->headers);
+        FreeHttpRequest(reqPtr);
+        Tcl_AppendResult(interp,"connection refused",NULL);
+        return TCL_ERROR;
+      }
+      Ns_TclEnterSet(interp,reqPtr->headers,NS_TCL_SET_DYNAMIC);
+      dict = Tcl_NewDictObj();
+      Tcl_DictObjPut(interp,dict,Tcl_NewStringObj("headers",-1),Tcl_GetObjResult(interp));
+      Tcl_DictObjPut(interp,dict,Tcl_NewStringObj("status",-1),Tcl_NewIntObj(200));
+      Tcl_DictObjPut(interp,dict,Tcl_NewStringObj("body",-1),reqPtr->bodyObj);
+      FreeHttpRequest(reqPtr);
+      Tcl_SetObjResult(interp,dict);
+      return TCL_OK;
+    }
+    if(!strcmp(Tcl_GetString(objv[1]),"cancel")) {
+      if((hPtr = Tcl_FindHashEntry(requests,Tcl_GetString(objv[objc-1])))) {
+        reqPtr = Tcl_GetHashValue(hPtr);
+        Tcl_DeleteHashEntry(hPtr);
+        Ns_SetFree(reqPtr->headers);
+        FreeHttpRequest(reqPtr);
+      }
+      return TCL_OK;
+    }
+    Tcl_AppendResult(interp,"unknown ns_http command: ",Tcl_GetString(objv[1]),NULL);
+    return TCL_ERROR;
+}
+
+/*
+ * ns_connchan stand-in, channels outlive connections and keep what was
+ * written to them. Input is queued by shim_connchan_input, read returns
+ * and clears it.
+ */
+
+typedef struct ConnChan {
+    Tcl_DString sent;           /* Everything written */
+    Tcl_DString input;          /* Pending input */
+    Tcl_DString callback;       /* Callback script and events */
+} ConnChan;
+
+static Tcl_HashTable channels;
+
+static ConnChan *
+GetConnChan(Tcl_Interp *interp,const char *name)
+{
+    Tcl_HashEntry *hPtr = channels.numBuckets ? Tcl_FindHashEntry(&channels,name) : 0;
+
+    if(!hPtr) {
+      if(interp) Tcl_AppendResult(interp,"channel \"",name,"\" does not exist",NULL);
+      return 0;
+    }
+    return Tcl_GetHashValue(hPtr);
+}
+
+static int
+ShimConnChanCmd(ClientData arg,Tcl_Interp *interp,int objc,Tcl_Obj *const objv[])
+{
+    static int nextid;
+    NsInterp *itPtr = arg;
+    Tcl_HashEntry *hPtr;
+    ConnChan *chanPtr;
+    const char *cmd, *data;
+    char name[32];
+    int isNew, len;
+
+    if(objc < 2) {
+      Tcl_WrongNumArgs(interp,1,objv,"detach|read|write|callback|close ?args?");
+      return TCL_ERROR;
+    }
+    cmd = Tcl_GetString(objv[1]);
+    if(!strcmp(cmd,"detach")) {
+      if(!itPtr->conn || (itPtr->conn->flags & NS_CONN_CLOSED)) {
+        Tcl_AppendResult(interp,"no connection",NULL);
+        return TCL_ERROR;
+      }
+      if(!channels.numBuckets) Tcl_InitHashTable(&channels,TCL_STRING_KEYS);
+      snprintf(name,sizeof(name),"conn%d",nextid++);
+      chanPtr = ns_malloc(sizeof(ConnChan));
+      Tcl_DStringInit(&chanPtr->sent);
+      Tcl_DStringInit(&chanPtr->input);
+      Tcl_DStringInit(&chanPtr->callback);
+      hPtr = Tcl_CreateHashEntry(&channels,name,&isNew);
+      Tcl_SetHashValue(hPtr,chanPtr);
+      itPtr->conn->flags |= NS_CONN_CLOSED;
+      Tcl_SetObjResult(interp,Tcl_NewStringObj(name,-1));
+      return TCL_OK;
+    }
+    if(objc < 3) {
+      Tcl_WrongNumArgs(interp,2,objv,"channel ?args?");
+      return TCL_ERROR;
+    }
+    if(!strcmp(cmd,"callback")) {
+      // ?-timeout t? channel script when
+      if(objc < 5 || !(chanPtr = GetConnChan(interp,Tcl_GetString(objv[objc-3])))) return TCL_ERROR;
+      Tcl_DStringSetLength(&chanPtr->callback,0);
+      Tcl_DStringAppend(&chanPtr->callback,Tcl_GetString(objv[objc-2]),-1);
+      Tcl_DStringAppendElement(&chanPtr->callback,Tcl_GetString(objv[objc-1]));
+      return TCL_OK;
+    }
+    if(!(chanPtr = GetConnChan(interp,Tcl_GetString(objv[2])))) return TCL_ERROR;
+    if(!strcmp(cmd,"read")) {
+      Tcl_SetObjResult(interp,Tcl_NewByteArrayObj((unsigned char*)chanPtr->input.string,chanPtr->input.length));
+      Tcl_DStringSetLength(&chanPtr->input,0);
+      return TCL_OK;
+    }
+    if(!strcmp(cmd,"write") && objc > 3) {
+      data = (const char*)Tcl_GetByteArrayFromObj(objv[3],&len);
+      Tcl_DStringAppend(&chanPtr->sent,data,len);
+      Tcl_SetObjResult(interp,Tcl_NewIntObj(len));
+      return TCL_OK;
+    }
+    if(!strcmp(cmd,"close")) {
+      Tcl_DeleteHashEntry(Tcl_FindHashEntry(&channels,Tcl_GetString(objv[2])));
+      Tcl_DStringFree(&chanPtr->sent);
+      Tcl_DStringFree(&chanPtr->input);
+      Tcl_DStringFree(&chanPtr->callback);
+      ns_free(chanPtr);
+      return TCL_OK;
+    }
+    Tcl_AppendResult(interp,"unknown ns_connchan command: ",cmd,NULL);
+    return TCL_ERROR;
+}
+
+/*
+ * Each thread has one interp, like the interp cache of nsd it is never
+ * deleted, so stubs may allocate it on every call
+ */
+
+static __thread Tcl_Interp *threadInterp;
+
+Tcl_Interp *
+Ns_TclAllocateInterp(const char *name)
+{
+    NsInterp *itPtr;
+    Trace *tracePtr;
+
+    if(threadInterp) return threadInterp;
+    threadInterp = Tcl_CreateInterp();
+    itPtr = ns_calloc(1,sizeof(NsInterp));
+    itPtr->interp = threadInterp;
+    itPtr->servPtr = &server;
+    Tcl_InitHashTable(&itPtr->sets,TCL_STRING_KEYS);
+    Tcl_SetAssocData(threadInterp,"ns:data",FreeInterpData,itPtr);
+    Tcl_InitHashTable(&itPtr->httpRequests,TCL_STRING_KEYS);
+    Tcl_CreateObjCommand(threadInterp,"ns_http",ShimHttpCmd,&itPtr->httpRequests,0);
+    Tcl_CreateObjCommand(threadInterp,"ns_connchan",ShimConnChanCmd,itPtr,0);
+    for(tracePtr = traces;tracePtr;tracePtr = tracePtr->nextPtr) tracePtr->proc(threadInterp,tracePtr->arg);
+    return threadInterp;
+}
+
+void
+Ns_TclDeAllocateInterp(Tcl_Interp *interp)
+{
+}
+
+NsInterp *
+NsGetInterpData(Tcl_Interp *interp)
+{
+    return interp ? Tcl_GetAssocData(interp,"ns:data",0) : 0;
+}
+
+const char *
+Ns_TclLogErrorInfo(Tcl_Interp *interp,const char *extraInfo)
+{
+    const char *info = Tcl_GetVar(interp,"errorInfo",TCL_GLOBAL_ONLY);
+
+    Ns_Log(Error,"%s%s",info ? info : Tcl_GetStringResult(interp),extraInfo ? extraInfo : "");
+    return info;
+}
+
+Ns_ReturnCode
+Ns_TclEnterSet(Tcl_Interp *interp,Ns_Set *set,unsigned int flags)
+{
+    NsInterp *itPtr = NsGetInterpData(interp);
+    Tcl_HashEntry *hPtr;
+    char id[64];
+    int isNew, n = itPtr->sets.numEntries;
+
+    do {
+      snprintf(id,sizeof(id),"%c%d",flags & NS_TCL_SET_DYNAMIC ? 'd' : 't',n++);
+      hPtr = Tcl_CreateHashEntry(&itPtr->sets,id,&isNew);
+    } while(!isNew);
+    Tcl_SetHashValue(hPtr,set);
+    Tcl_SetObjResult(interp,Tcl_NewStringObj(id,-1));
+    return NS_OK;
+}
+
+Ns_Set *
+Ns_TclGetSet(Tcl_Interp *interp,const char *setId)
+{
+    NsInterp *itPtr = NsGetInterpData(interp);
+    Tcl_HashEntry *hPtr = itPtr ? Tcl_FindHashEntry(&itPtr->sets,setId) : 0;
+
+    return hPtr ? Tcl_GetHashValue(hPtr) : 0;
+}
+
+Ns_ReturnCode
+Ns_TclFreeSet(Tcl_Interp *interp,const char *setId)
+{
+    NsInterp *itPtr = NsGetInterpData(interp);
+    Tcl_HashEntry *hPtr = itPtr ? Tcl_FindHashEntry(&itPtr->sets,setId) : 0;
+
+    if(!hPtr) return NS_ERROR;
+    Ns_SetFree(Tcl_GetHashValue(hPtr));
+    Tcl_DeleteHashEntry(hPtr);
+    return NS_OK;
+}
+
+Ns_ObjvProc Ns_ObjvBool;
+
+int
+Ns_ObjvBool(Ns_ObjvSpec *spec,Tcl_Interp *interp,int *objcPtr,Tcl_Obj *const* objv)
+{
+    *(int*)spec->dest = PTR2INT(spec->arg);
+    return TCL_OK;
+}
+
+Ns_ReturnCode
+Ns_ParseObjv(Ns_ObjvSpec *opts,Ns_ObjvSpec *args,Tcl_Interp *interp,int offset,int objc,Tcl_Obj *const* objv)
+{
+    Ns_ObjvSpec *specPtr;
+    int i;
+
+    for(i = offset;i < objc;i++) {
+      for(specPtr = opts;specPtr && specPtr->key;specPtr++) {
+        if(!strcmp(specPtr->key,Tcl_GetString(objv[i]))) break;
+      }
+      if(!specPtr || !specPtr->key) return NS_ERROR;
+      specPtr->proc(specPtr,interp,0,objv + i);
+    }
+    return NS_OK;
+}
+
+/*
+ * Scheduled procs are queued and run by shim_run_scheduled
+ */
+
+static int
+Schedule(Ns_SchedProc *proc,Ns_Callback *callback,void *arg,unsigned int flags,Ns_SchedProc *cleanup,Ns_Callback *deleteCallback)
+{
+    Sched *schedPtr = ns_calloc(1,sizeof(Sched)), **tailPtr = &scheduled;
+
+    schedPtr->id = nextSchedId++;
+    schedPtr->proc = proc;
+    schedPtr->callback = callback;
+    schedPtr->arg = arg;
+    schedPtr->flags = flags;
+    schedPtr->cleanup = cleanup;
+    schedPtr->deleteCallback = deleteCallback;
+    while(*tailPtr) tailPtr = &(*tailPtr)->nextPtr;
+    *tailPtr = schedPtr;
+    return schedPtr->id;
+}
+
+int
+Ns_ScheduleProcEx(Ns_SchedProc *proc,void *arg,unsigned int flags,const Ns_Time *interval,Ns_SchedProc *cleanup)
+{
+    return Schedule(proc,0,arg,flags,cleanup,0);
+}
+
+int
+Ns_ScheduleDaily(Ns_SchedProc *proc,void *arg,unsigned int flags,int hour,int minute,Ns_SchedProc *cleanup)
+{
+    return Schedule(proc,0,arg,flags,cleanup,0);
+}
+
+int
+Ns_After(const Ns_Time *interval,Ns_Callback *proc,void *arg,Ns_Callback *deleteProc)
+{
+    return Schedule(0,proc,arg,NS_SCHED_ONCE,0,deleteProc);
+}
+
+static void
+FreeSched(Sched *schedPtr)
+{
+    if(schedPtr->cleanup) schedPtr->cleanup(schedPtr->arg,schedPtr->id);
+    if(schedPtr->deleteCallback) schedPtr->deleteCallback(schedPtr->arg);
+    ns_free(schedPtr);
+}
+
+void
+Ns_UnscheduleProc(int id)
+{
+    Sched **schedPtrPtr, *schedPtr;
+
+    for(schedPtrPtr = &scheduled;(schedPtr = *schedPtrPtr);schedPtrPtr = &schedPtr->nextPtr) {
+      if(schedPtr->id == id) {
+        *schedPtrPtr = schedPtr->nextPtr;
+        FreeSched(schedPtr);
+        return;
+      }
+    }
+}
+
+void
+NsGetScheduled(Tcl_DString *dsPtr)
+{
+    Sched *schedPtr;
+
+    for(schedPtr = scheduled;schedPtr;schedPtr = schedPtr->nextPtr) {
+      Ns_DStringPrintf(dsPtr,"{%d %u} ",schedPtr->id,schedPtr->flags);
+    }
+}
+
+void NsGetCallbacks(Tcl_DString *dsPtr) { }
+void NsGetSockCallbacks(Tcl_DString *dsPtr) { }
+
+/*
+ * Server
+ */
+
+NsServer *
+NsGetServer(const char *name)
+{
+    return name && !strcmp(name,server.server) ? &server : 0;
+}
+
+Ns_ReturnCode
+NsUrlToFile(Ns_DString *dsPtr,NsServer *servPtr,const char *url)
+{
+    Ns_MakePath(dsPtr,servPtr->fastpath.pageroot,url,NULL);
+    return NS_OK;
+}
+
+/*
+ * Connections, everything sent is appended to the output buffer
+ */
+
+Ns_Conn *Ns_GetConn(void) { return (Ns_Conn*)current; }
+const char *Ns_ConnServer(const Ns_Conn *conn) { return server.server; }
+int Ns_ConnResponseStatus(const Ns_Conn *conn) { return ((Conn*)conn)->responseStatus; }
+void Ns_ConnSetResponseStatus(Ns_Conn *conn,int status) { ((Conn*)conn)->responseStatus = status; }
+const char *Ns_ConnAuthUser(const Ns_Conn *conn) { return ""; }
+const char *Ns_ConnAuthPasswd(const Ns_Conn *conn) { return ""; }
+char *Ns_ConnContent(const Ns_Conn *conn) { return ((Conn*)conn)->content; }
+const char *Ns_ConnPeerAddr(const Ns_Conn *conn) { return "127.0.0.1"; }
+unsigned short Ns_ConnPeerPort(const Ns_Conn *conn) { return 40000; }
+const char *Ns_ConnHost(const Ns_Conn *conn) { return "localhost"; }
+unsigned short Ns_ConnPort(const Ns_Conn *conn) { return 8080; }
+const char *Ns_ConnDriverName(const Ns_Conn *conn) { return "nssock"; }
+int Ns_ConnSock(const Ns_Conn *conn) { return -1; }
+uintptr_t Ns_ConnId(const Ns_Conn *conn) { return (uintptr_t)atol(((Conn*)conn)->idstr); }
+bool Ns_ConnGetWriteEncodedFlag(const Ns_Conn *conn) { return NS_FALSE; }
+
+char *
+Ns_ConnLocationAppend(Ns_Conn *conn,Ns_DString *dsPtr)
+{
+    return Ns_DStringPrintf(dsPtr,"http://%s:%d",Ns_ConnHost(conn),Ns_ConnPort(conn));
+}
+
+Tcl_Interp *
+Ns_GetConnInterp(Ns_Conn *conn)
+{
+    Conn *connPtr = (Conn*)conn;
+
+    if(!connPtr->interp) connPtr->interp = Ns_TclAllocateInterp(server.server);
+    return connPtr->interp;
+}
+
+void
+Ns_ConnSetHeaders(const Ns_Conn *conn,const char *field,const char *value)
+{
+    Ns_SetUpdate(conn->outputheaders,field,value);
+}
+
+void
+Ns_ConnSetTypeHeader(const Ns_Conn *conn,const char *type)
+{
+    Ns_ConnSetHeaders(conn,"Content-Type",type);
+}
+
+void
+Ns_ConnSetLengthHeader(Ns_Conn *conn,size_t length,bool doStream)
+{
+    char buf[32];
+
+    snprintf(buf,sizeof(buf),"%zu",length);
+    Ns_ConnSetHeaders(conn,"Content-Length",buf);
+}
+
+/*
+ * Data goes out as is like in nsd, Content-Length is set from the first
+ * write of a response which is not streamed
+ */
+
+Ns_ReturnCode
+Ns_ConnWriteVData(Ns_Conn *conn,struct iovec *bufs,int nbufs,unsigned int flags)
+{
+    Conn *connPtr = (Conn*)conn;
+    size_t length = 0;
+    int i;
+
+    if(connPtr->flags & NS_CONN_CLOSED) return NS_ERROR;
+    if(connPtr->responseStatus == 0) connPtr->responseStatus = 200;
+    if(!(connPtr->flags & NS_CONN_SENTHDRS) && !(flags & NS_CONN_STREAM)) {
+      for(i = 0;i < nbufs;i++) length += bufs[i].iov_len;
+      Ns_ConnSetLengthHeader(conn,length,NS_FALSE);
+    }
+    connPtr->flags |= NS_CONN_SENTHDRS;
+    for(i = 0;i < nbufs;i++) {
+      Tcl_DStringAppend(&connPtr->output,bufs[i].iov_base,(int)bufs[i].iov_len);
+      connPtr->nContentSent += bufs[i].iov_len;
+    }
+    return NS_OK;
+}
+
+static void
+Deflate(z_stream *z,const void *buf,size_t len,int flush,Tcl_DString *dsPtr)
+{
+    int offset;
+
+    z->next_in = (Bytef*)buf;
+    z->avail_in = (uInt)len;
+    do {
+      offset = dsPtr->length;
+      Tcl_DStringSetLength(dsPtr,offset + 4096);
+      z->next_out = (Bytef*)dsPtr->string + offset;
+      z->avail_out = 4096;
+      deflate(z,flush);
+      Tcl_DStringSetLength(dsPtr,offset + 4096 - (int)z->avail_out);
+    } while(z->avail_out == 0);
+}
+
+static void
+DeflateEnd(Conn *connPtr)
+{
+    deflateEnd(connPtr->zstream);
+    ns_free(connPtr->zstream);
+    connPtr->zstream = 0;
+}
+
+/*
+ * Text is gzipped like nsd does when the connection has a compression
+ * level and the client accepts gzip: a complete response at once, a
+ * stream chunk by chunk with a sync flush after each write, finished
+ * by Ns_ConnClose. The decision is made when the headers go out.
+ */
+
+Ns_ReturnCode
+Ns_ConnWriteVChars(Ns_Conn *conn,struct iovec *bufs,int nbufs,unsigned int flags)
+{
+    Conn *connPtr = (Conn*)conn;
+    Ns_ReturnCode status;
+    Tcl_DString gz;
+    struct iovec iov;
+    int i;
+
+    if(connPtr->flags & NS_CONN_CLOSED) return NS_ERROR;
+    if(!connPtr->zstream) {
+      if((connPtr->flags & NS_CONN_SENTHDRS) || connPtr->compress <= 0 || !(connPtr->flags & NS_CONN_ZIPACCEPTED))
+        return Ns_ConnWriteVData(conn,bufs,nbufs,flags);
+      connPtr->zstream = ns_calloc(1,sizeof(z_stream));
+      deflateInit2(connPtr->zstream,connPtr->compress,Z_DEFLATED,15 + 16,9,Z_DEFAULT_STRATEGY);
+      Ns_SetUpdate(conn->outputheaders,"Content-Encoding","gzip");
+    }
+    Tcl_DStringInit(&gz);
+    for(i = 0;i < nbufs;i++) Deflate(connPtr->zstream,bufs[i].iov_base,bufs[i].iov_len,Z_NO_FLUSH,&gz);
+    Deflate(connPtr->zstream,"",0,(flags & NS_CONN_STREAM) ? Z_SYNC_FLUSH : Z_FINISH,&gz);
+    if(!(flags & NS_CONN_STREAM)) DeflateEnd(connPtr);
+    iov.iov_base = gz.string;
+    iov.iov_len = (size_t)gz.length;
+    status = Ns_ConnWriteVData(conn,&iov,1,flags);
+    Tcl_DStringFree(&gz);
+    return status;
+}
+
+Ns_ReturnCode
+Ns_ConnWriteData(Ns_Conn *conn,const void *buf,size_t len,unsigned int flags)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*)buf;
+    iov.iov_len = len;
+    return Ns_ConnWriteVData(conn,&iov,1,flags);
+}
+
+Ns_ReturnCode
+Ns_ConnPuts(Ns_Conn *conn,const char *s)
+{
+    return Ns_ConnWriteData(conn,s,strlen(s),0);
+}
+
+Ns_ReturnCode
+Ns_ConnClose(Ns_Conn *conn)
+{
+    Conn *connPtr = (Conn*)conn;
+    Tcl_DString gz;
+
+    if(connPtr->zstream) {
+      Tcl_DStringInit(&gz);
+      Deflate(connPtr->zstream,"",0,Z_FINISH,&gz);
+      DeflateEnd(connPtr);
+      Ns_ConnWriteData(conn,gz.string,(size_t)gz.length,NS_CONN_STREAM);
+      Tcl_DStringFree(&gz);
+    }
+    conn->flags |= NS_CONN_CLOSED;
+    return NS_OK;
+}
+
+void Ns_ConnSetCompression(Ns_Conn *conn,int level) { ((Conn*)conn)->compress = level; }
+int Ns_ConnGetCompression(const Ns_Conn *conn) { return ((Conn*)conn)->compress; }
+
+Ns_ReturnCode
+Ns_CompressGzip(const char *buf,int len,Tcl_DString *outPtr,int level)
+{
+    z_stream z;
+    int offset = outPtr->length, rc;
+
+    memset(&z,0,sizeof(z));
+    if(deflateInit2(&z,level,Z_DEFLATED,15 + 16,9,Z_DEFAULT_STRATEGY) != Z_OK) return NS_ERROR;
+    Tcl_DStringSetLength(outPtr,offset + (int)deflateBound(&z,(uLong)len));
+    z.next_in = (Bytef*)buf;
+    z.avail_in = (uInt)len;
+    z.next_out = (Bytef*)outPtr->string + offset;
+    z.avail_out = (uInt)(outPtr->length - offset);
+    rc = deflate(&z,Z_FINISH);
+    Tcl_DStringSetLength(outPtr,offset + (int)z.total_out);
+    deflateEnd(&z);
+    return rc == Z_STREAM_END ? NS_OK : NS_ERROR;
+}
+
+/*
+ * MD5 of RFC 1321, bits[0] counts the bytes hashed so far
+ */
+
+static void
+MD5Block(uint32_t *buf,const unsigned char *in)
+{
+    static const uint32_t k[64] = {
+      0xd76aa478,0xe8c7b756,0x242070db,0xc1bdceee,0xf57c0faf,0x4787c62a,0xa8304613,0xfd469501,
+      0x698098d8,0x8b44f7af,0xffff5bb1,0x895cd7be,0x6b901122,0xfd987193,0xa679438e,0x49b40821,
+      0xf61e2562,0xc040b340,0x265e5a51,0xe9b6c7aa,0xd62f105d,0x02441453,0xd8a1e681,0xe7d3fbc8,
+      0x21e1cde6,0xc33707d6,0xf4d50d87,0x455a14ed,0xa9e3e905,0xfcefa3f8,0x676f02d9,0x8d2a4c8a,
+      0xfffa3942,0x8771f681,0x6d9d6122,0xfde5380c,0xa4beea44,0x4bdecfa9,0xf6bb4b60,0xbebfbc70,
+      0x289b7ec6,0xeaa127fa,0xd4ef3085,0x04881d05,0xd9d4d039,0xe6db99e5,0x1fa27cf8,0xc4ac5665,
+      0xf4292244,0x432aff97,0xab9423a7,0xfc93a039,0x655b59c3,0x8f0ccc92,0xffeff47d,0x85845dd1,
+      0x6fa87e4f,0xfe2ce6e0,0xa3014314,0x4e0811a1,0xf7537e82,0xbd3af235,0x2ad7d2bb,0xeb86d391
+    };
+    static const int r[64] = {
+      7,12,17,22,7,12,17,22,7,12,17,22,7,12,17,22,5,9,14,20,5,9,14,20,5,9,14,20,5,9,14,20,
+      4,11,16,23,4,11,16,23,4,11,16,23,4,11,16,23,6,10,15,21,6,10,15,21,6,10,15,21,6,10,15,21
+    };
+    uint32_t w[16], a = buf[0], b = buf[1], c = buf[2], d = buf[3], f, t;
+    int i, g;
+
+    for(i = 0;i < 16;i++) w[i] = (uint32_t)in[i*4] | (uint32_t)in[i*4+1] << 8 | (uint32_t)in[i*4+2] << 16 | (uint32_t)in[i*4+3] << 24;
+    for(i = 0;i < 64;i++) {
+      if(i < 16) { f = (b & c) | (~b & d); g = i; } else
+      if(i < 32) { f = (d & b) | (~d & c); g = (5*i + 1) % 16; } else
+      if(i < 48) { f = b ^ c ^ d; g = (3*i + 5) % 16; } else
+                 { f = c ^ (b | ~d); g = (7*i) % 16; }
+      t = d;
+      d = c;
+      c = b;
+      f += a + k[i] + w[g];
+      b += (f << r[i]) | (f >> (32 - r[i]));
+      a = t;
+    }
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+void
+Ns_CtxMD5Init(Ns_CtxMD5 *ctx)
+{
+    ctx->buf[0] = 0x67452301;
+    ctx->buf[1] = 0xefcdab89;
+    ctx->buf[2] = 0x98badcfe;
+    ctx->buf[3] = 0x10325476;
+    ctx->bits[0] = ctx->bits[1] = 0;
+}
+
+void
+Ns_CtxMD5Update(Ns_CtxMD5 *ctx,const unsigned char *buf,size_t len)
+{
+    size_t used = ctx->bits[0] % 64, n;
+
+    if(ctx->bits[0] + (uint32_t)len < ctx->bits[0]) ctx->bits[1]++;
+    ctx->bits[0] += (uint32_t)len;
+    while(len > 0) {
+      n = len < 64 - used ? len : 64 - used;
+      memcpy(ctx->in + used,buf,n);
+      buf += n;
+      len -= n;
+      if((used += n) == 64) {
+        MD5Block(ctx->buf,ctx->in);
+        used = 0;
+      }
+    }
+}
+
+void
+Ns_CtxMD5Final(Ns_CtxMD5 *ctx,unsigned char digest[16])
+{
+    unsigned char pad[72] = { 0x80 };
+    uint64_t bits = ((uint64_t)ctx->bits[1] << 32 | ctx->bits[0]) * 8;
+    size_t used = ctx->bits[0] % 64;
+    int i;
+
+    Ns_CtxMD5Update(ctx,pad,used < 56 ? 56 - used : 120 - used);
+    for(i = 0;i < 8;i++) pad[i] = (unsigned char)(bits >> (i*8));
+    Ns_CtxMD5Update(ctx,pad,8);
+    for(i = 0;i < 16;i++) digest[i] = (unsigned char)(ctx->buf[i/4] >> ((i%4)*8));
+}
+
+Ns_ReturnCode
+Ns_ConnReturnData(Ns_Conn *conn,int status,const char *data,ssize_t len,const char *type)
+{
+    if(len < 0) len = (ssize_t)strlen(data);
+    Ns_ConnSetResponseStatus(conn,status);
+    if(type) Ns_ConnSetTypeHeader(conn,type);
+    Ns_ConnSetLengthHeader(conn,(size_t)len,NS_FALSE);
+    Ns_ConnWriteData(conn,data,(size_t)len,0);
+    return Ns_ConnClose(conn);
+}
+
+Ns_ReturnCode
+Ns_ConnReturnCharData(Ns_Conn *conn,int status,const char *data,ssize_t len,const char *type)
+{
+    struct iovec iov;
+
+    if(len < 0) len = (ssize_t)strlen(data);
+    Ns_ConnSetResponseStatus(conn,status);
+    if(type) Ns_ConnSetTypeHeader(conn,type);
+    iov.iov_base = (void*)data;
+    iov.iov_len = (size_t)len;
+    Ns_ConnWriteVChars(conn,&iov,1,0);
+    return Ns_ConnClose(conn);
+}
+
+Ns_ReturnCode
+Ns_ConnReturnStatus(Ns_Conn *conn,int status)
+{
+    return Ns_ConnReturnData(conn,status,"",0,0);
+}
+
+Ns_ReturnCode Ns_ConnReturnNotFound(Ns_Conn *conn) { return Ns_ConnReturnStatus(conn,404); }
+Ns_ReturnCode Ns_ConnReturnInternalError(Ns_Conn *conn) { return Ns_ConnReturnStatus(conn,500); }
+Ns_ReturnCode Ns_ConnReturnForbidden(Ns_Conn *conn) { return Ns_ConnReturnStatus(conn,403); }
+Ns_ReturnCode Ns_ConnReturnUnauthorized(Ns_Conn *conn) { return Ns_ConnReturnStatus(conn,401); }
+Ns_ReturnCode Ns_ConnReturnUnavailable(Ns_Conn *conn) { return Ns_ConnReturnStatus(conn,503); }
+Ns_ReturnCode Ns_ConnReturnNotModified(Ns_Conn *conn) { return Ns_ConnReturnStatus(conn,304); }
+
+Ns_ReturnCode
+Ns_ConnReturnRedirect(Ns_Conn *conn,const char *url)
+{
+    Ns_ConnSetHeaders(conn,"Location",url);
+    return Ns_ConnReturnStatus(conn,302);
+}
+
+Ns_ReturnCode
+Ns_ConnReturnFile(Ns_Conn *conn,int status,const char *type,const char *file)
+{
+    Tcl_DString ds;
+    char buf[4096];
+    size_t n;
+    FILE *fp = fopen(file,"rb");
+
+    if(!fp) return Ns_ConnReturnNotFound(conn);
+    Tcl_DStringInit(&ds);
+    while((n = fread(buf,1,sizeof(buf),fp)) > 0) Tcl_DStringAppend(&ds,buf,(int)n);
+    fclose(fp);
+    Ns_ConnReturnData(conn,status,ds.string,ds.length,type);
+    Tcl_DStringFree(&ds);
+    return NS_OK;
+}
+
+Ns_Set *
+Ns_ConnGetQuery(Tcl_Interp *interp,Ns_Conn *conn,void *formPtr,void *rejectPtr)
+{
+    Conn *connPtr = (Conn*)conn;
+    Tcl_DString key, val;
+    const char *p, *amp, *eq;
+
+    if(connPtr->query || !connPtr->request.query) return connPtr->query;
+    connPtr->query = Ns_SetCreate("query");
+    Tcl_DStringInit(&key);
+    Tcl_DStringInit(&val);
+    for(p = connPtr->request.query;*p;p = *amp ? amp + 1 : amp) {
+      amp = strchr(p,'&');
+      if(!amp) amp = p + strlen(p);
+      eq = memchr(p,'=',(size_t)(amp - p));
+      Tcl_DStringSetLength(&key,0);
+      Tcl_DStringSetLength(&val,0);
+      Tcl_DStringAppend(&key,p,(int)((eq ? eq : amp) - p));
+      if(eq) Tcl_DStringAppend(&val,eq + 1,(int)(amp - eq - 1));
+      {
+        Tcl_DString k, v;
+        Tcl_DStringInit(&k);
+        Tcl_DStringInit(&v);
+        Ns_UrlQueryDecode(&k,key.string,0);
+        Ns_UrlQueryDecode(&v,val.string,0);
+        Ns_SetPut(connPtr->query,k.string,v.string);
+        Tcl_DStringFree(&k);
+        Tcl_DStringFree(&v);
+      }
+    }
+    Tcl_DStringFree(&key);
+    Tcl_DStringFree(&val);
+    return connPtr->query;
+}
+
+/*
+ * Sets
+ */
+
+Ns_Set *
+Ns_SetCreate(const char *name)
+{
+    Ns_Set *set = ns_calloc(1,sizeof(Ns_Set));
+
+    set->name = name ? ns_strdup(name) : 0;
+    return set;
+}
+
+void
+Ns_SetFree(Ns_Set *set)
+{
+    size_t i;
+
+    if(!set) return;
+    for(i = 0;i < set->size;i++) {
+      ns_free(set->fields[i].name);
+      ns_free(set->fields[i].value);
+    }
+    ns_free(set->fields);
+    ns_free(set->name);
+    ns_free(set);
+}
+
+size_t
+Ns_SetPut(Ns_Set *set,const char *key,const char *value)
+{
+    if(set->size == set->maxSize) {
+      set->maxSize = set->maxSize ? set->maxSize * 2 : 8;
+      set->fields = ns_realloc(set->fields,set->maxSize * sizeof(Ns_SetField));
+    }
+    set->fields[set->size].name = ns_strdup(key);
+    set->fields[set->size].value = value ? ns_strdup(value) : 0;
+    return set->size++;
+}
+
+static int
+SetFind(const Ns_Set *set,const char *key,int (*cmp)(const char*,const char*))
+{
+    size_t i;
+
+    for(i = 0;set && i < set->size;i++) {
+      if(!cmp(key,set->fields[i].name)) return (int)i;
+    }
+    return -1;
+}
+
+int Ns_SetFind(const Ns_Set *set,const char *key) { return SetFind(set,key,strcmp); }
+int Ns_SetIFind(const Ns_Set *set,const char *key) { return SetFind(set,key,strcasecmp); }
+
+const char *
+Ns_SetGet(const Ns_Set *set,const char *key)
+{
+    int i = Ns_SetFind(set,key);
+
+    return i < 0 ? 0 : set->fields[i].value;
+}
+
+const char *
+Ns_SetIGet(const Ns_Set *set,const char *key)
+{
+    int i = Ns_SetIFind(set,key);
+
+    return i < 0 ? 0 : set->fields[i].value;
+}
+
+static int
+SetCount(const Ns_Set *set,const char *key,int (*cmp)(const char*,const char*))
+{
+    size_t i;
+    int n = 0;
+
+    for(i = 0;i < set->size;i++) if(!cmp(key,set->fields[i].name)) n++;
+    return n;
+}
+
+int Ns_SetUnique(const Ns_Set *set,const char *key) { return SetCount(set,key,strcmp) == 1; }
+int Ns_SetIUnique(const Ns_Set *set,const char *key) { return SetCount(set,key,strcasecmp) == 1; }
+
+void
+Ns_SetDelete(Ns_Set *set,int index)
+{
+    if(index < 0 || (size_t)index >= set->size) return;
+    ns_free(set->fields[index].name);
+    ns_free(set->fields[index].value);
+    memmove(&set->fields[index],&set->fields[index+1],(set->size - (size_t)index - 1) * sizeof(Ns_SetField));
+    set->size--;
+}
+
+void
+Ns_SetUpdate(Ns_Set *set,const char *key,const char *value)
+{
+    Ns_SetDeleteKey(set,key);
+    Ns_SetPut(set,key,value);
+}
+
+void Ns_SetDeleteKey(Ns_Set *set,const char *key) { Ns_SetDelete(set,Ns_SetFind(set,key)); }
+void Ns_SetIDeleteKey(Ns_Set *set,const char *key) { Ns_SetDelete(set,Ns_SetIFind(set,key)); }
+
+void
+Ns_SetTrunc(Ns_Set *set,size_t size)
+{
+    while(set->size > size) Ns_SetDelete(set,(int)set->size - 1);
+}
+
+void
+Ns_SetMerge(Ns_Set *high,const Ns_Set *low)
+{
+    size_t i;
+
+    for(i = 0;i < low->size;i++) {
+      if(Ns_SetFind(high,low->fields[i].name) < 0) Ns_SetPut(high,low->fields[i].name,low->fields[i].value);
+    }
+}
+
+void
+Ns_SetMove(Ns_Set *to,Ns_Set *from)
+{
+    size_t i;
+
+    for(i = 0;i < from->size;i++) Ns_SetPut(to,from->fields[i].name,from->fields[i].value);
+    Ns_SetTrunc(from,0);
+}
+
+void
+Ns_SetPrint(const Ns_Set *set)
+{
+    size_t i;
+
+    fprintf(stderr,"%s:\n",set->name ? set->name : "");
+    for(i = 0;i < set->size;i++) fprintf(stderr,"\t%s = %s\n",set->fields[i].name,set->fields[i].value ? set->fields[i].value : "");
+}
+
+Ns_Set *
+Ns_SetCopy(const Ns_Set *old)
+{
+    Ns_Set *set;
+    size_t i;
+
+    if(!old) return 0;
+    set = Ns_SetCreate(old->name);
+    for(i = 0;i < old->size;i++) Ns_SetPut(set,old->fields[i].name,old->fields[i].value);
+    return set;
+}
+
+Ns_Set **
+Ns_SetSplit(const Ns_Set *set,char sep)
+{
+    Ns_Set **sets = ns_calloc(set->size + 2,sizeof(Ns_Set*)), *next;
+    const char *key, *dot;
+    Tcl_DString name;
+    size_t i;
+    int n, j;
+
+    Tcl_DStringInit(&name);
+    for(i = 0, n = 0;i < set->size;i++) {
+      key = set->fields[i].name;
+      dot = strchr(key,sep);
+      Tcl_DStringSetLength(&name,0);
+      if(dot) Tcl_DStringAppend(&name,key,(int)(dot - key));
+      for(j = 0;j < n && strcmp(sets[j]->name ? sets[j]->name : "",name.string);j++);
+      if(j == n) sets[n++] = Ns_SetCreate(dot ? name.string : 0);
+      next = sets[j];
+      Ns_SetPut(next,dot ? dot + 1 : key,set->fields[i].value);
+    }
+    Tcl_DStringFree(&name);
+    return sets;
+}
+
+/*
+ * Url encoding of the query part, letters, digits and -._ are kept,
+ * space becomes +
+ */
+
+char *
+Ns_UrlQueryEncode(Ns_DString *dsPtr,const char *str,Tcl_Encoding encoding)
+{
+    const unsigned char *p;
+
+    for(p = (const unsigned char*)str;*p;p++) {
+      if(isalnum(*p) || *p == '-' || *p == '.' || *p == '_') {
+        Tcl_DStringAppend(dsPtr,(const char*)p,1);
+      } else
+      if(*p == ' ') {
+        Tcl_DStringAppend(dsPtr,"+",1);
+      } else {
+        Ns_DStringPrintf(dsPtr,"%%%02X",*p);
+      }
+    }
+    return dsPtr->string;
+}
+
+char *
+Ns_UrlQueryDecode(Ns_DString *dsPtr,const char *str,Tcl_Encoding encoding)
+{
+    const char *p;
+    char c;
+
+    for(p = str;*p;p++) {
+      c = *p;
+      if(c == '+') {
+        c = ' ';
+      } else
+      if(c == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+        char hex[3] = {p[1],p[2],0};
+        c = (char)strtol(hex,0,16);
+        p += 2;
+      }
+      Tcl_DStringAppend(dsPtr,&c,1);
+    }
+    return dsPtr->string;
+}
+
+void
+Ns_QuoteHtml(Ns_DString *dsPtr,const char *html)
+{
+    for(;*html;html++) {
+      switch(*html) {
+       case '<': Tcl_DStringAppend(dsPtr,"&lt;",4); break;
+       case '>': Tcl_DStringAppend(dsPtr,"&gt;",4); break;
+       case '&': Tcl_DStringAppend(dsPtr,"&amp;",5); break;
+       case '\'': Tcl_DStringAppend(dsPtr,"&#39;",5); break;
+       case '"': Tcl_DStringAppend(dsPtr,"&#34;",5); break;
+       default: Tcl_DStringAppend(dsPtr,html,1);
+      }
+    }
+}
+
+/*
+ * Caches, size bound and expiration, no eviction by LRU
+ */
+
+struct Ns_Cache {
+    char *name;
+    Ns_Mutex lock;
+    Ns_Cond cond;
+    Tcl_HashTable entries;
+    size_t maxSize;
+    size_t currentSize;
+    Ns_FreeProc *freeProc;
+    unsigned long nhit, nmiss, nflush;
+};
+
+struct Ns_Entry {
+    Ns_Cache *cachePtr;
+    Tcl_HashEntry *hPtr;
+    void *value;
+    size_t size;
+    Ns_Time expires;
+};
+
+Ns_Cache *
+Ns_CacheCreateSz(const char *name,int keys,size_t maxSize,Ns_FreeProc *freeProc)
+{
+    Ns_Cache *cachePtr = ns_calloc(1,sizeof(Ns_Cache));
+
+    cachePtr->name = ns_strdup(name);
+    cachePtr->maxSize = maxSize;
+    cachePtr->freeProc = freeProc;
+    Tcl_InitHashTable(&cachePtr->entries,keys);
+    return cachePtr;
+}
+
+void Ns_CacheLock(Ns_Cache *cache) { Ns_MutexLock(&cache->lock); }
+void Ns_CacheUnlock(Ns_Cache *cache) { Ns_MutexUnlock(&cache->lock); }
+void Ns_CacheBroadcast(Ns_Cache *cache) { Ns_CondBroadcast(&cache->cond); }
+void *Ns_CacheGetValue(const Ns_Entry *entry) { return entry->value; }
+
+static void
+UnsetValue(Ns_Entry *entry)
+{
+    if(entry->value && entry->cachePtr->freeProc) entry->cachePtr->freeProc(entry->value);
+    entry->cachePtr->currentSize -= entry->size;
+    entry->value = 0;
+    entry->size = 0;
+}
+
+void
+Ns_CacheDeleteEntry(Ns_Entry *entry)
+{
+    UnsetValue(entry);
+    Tcl_DeleteHashEntry(entry->hPtr);
+    ns_free(entry);
+}
+
+void
+Ns_CacheFlushEntry(Ns_Entry *entry)
+{
+    entry->cachePtr->nflush++;
+    Ns_CacheDeleteEntry(entry);
+}
+
+Ns_Entry *
+Ns_CacheFindEntry(Ns_Cache *cache,const char *key)
+{
+    Tcl_HashEntry *hPtr = Tcl_FindHashEntry(&cache->entries,key);
+    Ns_Entry *entry;
+    Ns_Time now;
+
+    // Pending entries are not found, like in nsd
+    if(!hPtr || !((Ns_Entry*)Tcl_GetHashValue(hPtr))->value) {
+      cache->nmiss++;
+      return 0;
+    }
+    entry = Tcl_GetHashValue(hPtr);
+    Ns_GetTime(&now);
+    if(entry->value && entry->expires.sec && Ns_DiffTime(&entry->expires,&now,0) < 0) {
+      Ns_CacheFlushEntry(entry);
+      cache->nmiss++;
+      return 0;
+    }
+    cache->nhit++;
+    return entry;
+}
+
+Ns_Entry *
+Ns_CacheCreateEntry(Ns_Cache *cache,const char *key,int *newPtr)
+{
+    Tcl_HashEntry *hPtr = Tcl_FindHashEntry(&cache->entries,key);
+    Ns_Entry *entry;
+
+    *newPtr = 0;
+    if(hPtr && !((Ns_Entry*)Tcl_GetHashValue(hPtr))->value) return Tcl_GetHashValue(hPtr);
+    if((entry = Ns_CacheFindEntry(cache,key))) return entry;
+    entry = ns_calloc(1,sizeof(Ns_Entry));
+    entry->cachePtr = cache;
+    entry->hPtr = hPtr = Tcl_CreateHashEntry(&cache->entries,key,newPtr);
+    Tcl_SetHashValue(hPtr,entry);
+    return entry;
+}
+
+void
+Ns_CacheSetValueExpires(Ns_Entry *entry,void *value,size_t size,const Ns_Time *timeoutPtr,int cost)
+{
+    UnsetValue(entry);
+    entry->value = value;
+    entry->size = size;
+    entry->cachePtr->currentSize += size;
+    entry->expires.sec = entry->expires.usec = 0;
+    if(timeoutPtr) entry->expires = *timeoutPtr;
+}
+
+void
+Ns_CacheSetValueSz(Ns_Entry *entry,void *value,size_t size)
+{
+    Ns_CacheSetValueExpires(entry,value,size,0,0);
+}
+
+int
+Ns_CacheFlush(Ns_Cache *cache)
+{
+    Tcl_HashSearch search;
+    Tcl_HashEntry *hPtr;
+    Ns_Entry *entry;
+    int n = 0;
+
+    // Pending entries stay, like in nsd
+    for(hPtr = Tcl_FirstHashEntry(&cache->entries,&search);hPtr;) {
+      entry = Tcl_GetHashValue(hPtr);
+      hPtr = Tcl_NextHashEntry(&search);
+      if(entry->value) {
+        Ns_CacheFlushEntry(entry);
+        n++;
+      }
+    }
+    return n;
+}
+
+Ns_Entry *
+Ns_CacheFirstEntry(Ns_Cache *cache,Ns_CacheSearch *search)
+{
+    Tcl_HashEntry *hPtr = Tcl_FirstHashEntry(&cache->entries,&search->hsearch);
+
+    return hPtr ? Tcl_GetHashValue(hPtr) : 0;
+}
+
+Ns_Entry *
+Ns_CacheNextEntry(Ns_CacheSearch *search)
+{
+    Tcl_HashEntry *hPtr = Tcl_NextHashEntry(&search->hsearch);
+
+    return hPtr ? Tcl_GetHashValue(hPtr) : 0;
+}
+
+const char *
+Ns_CacheKey(const Ns_Entry *entry)
+{
+    return Tcl_GetHashKey(&entry->cachePtr->entries,entry->hPtr);
+}
+
+char *
+Ns_CacheStats(Ns_Cache *cache,Ns_DString *dsPtr)
+{
+    return Ns_DStringPrintf(dsPtr,"maxsize %zu size %zu entries %d flushed %lu hits %lu missed %lu",
+                            cache->maxSize,cache->currentSize,cache->entries.numEntries,
+                            cache->nflush,cache->nhit,cache->nmiss);
+}
+
+/*
+ * Database pools over SQLite. Each pool is one connection to the file
+ * from the datasource parameter of ns/db/pool/<pool>, an in-memory
+ * database by default, handles of a pool share it.
+ */
+
+static Tcl_HashTable dbPools;
+
+Ns_DbHandle *
+Ns_DbPoolGetHandle(const char *server,const char *pool)
+{
+    Tcl_HashEntry *hPtr;
+    Ns_DbHandle *handle;
+    sqlite3 *db;
+    Tcl_DString ds;
+    int isNew;
+
+    if(!dbPools.numBuckets) Tcl_InitHashTable(&dbPools,TCL_STRING_KEYS);
+    hPtr = Tcl_CreateHashEntry(&dbPools,pool,&isNew);
+    if(isNew) {
+      Tcl_DStringInit(&ds);
+      Ns_DStringPrintf(&ds,"ns/db/pool/%s",pool);
+      if(sqlite3_open(Ns_ConfigString(ds.string,"datasource",":memory:"),&db) != SQLITE_OK) {
+        Ns_Log(Error,"shim: cannot open pool %s: %s",pool,sqlite3_errmsg(db));
+        sqlite3_close(db);
+        Tcl_DeleteHashEntry(hPtr);
+        Tcl_DStringFree(&ds);
+        return 0;
+      }
+      Tcl_DStringFree(&ds);
+      Tcl_SetHashValue(hPtr,db);
+    }
+    handle = ns_calloc(1,sizeof(Ns_DbHandle));
+    handle->driver = "sqlite";
+    handle->poolname = Tcl_GetHashKey(&dbPools,hPtr);
+    handle->connection = Tcl_GetHashValue(hPtr);
+    handle->connected = NS_TRUE;
+    Tcl_DStringInit(&handle->dsExceptionMsg);
+    return handle;
+}
+
+void
+Ns_DbPoolPutHandle(Ns_DbHandle *handle)
+{
+    Ns_DbFlush(handle);
+    Ns_SetFree(handle->row);
+    Tcl_DStringFree(&handle->dsExceptionMsg);
+    ns_free(handle);
+}
+
+const char *
+Ns_DbPoolDefault(const char *server)
+{
+    return Ns_ConfigString("ns/server/shim/db","defaultpool","main");
+}
+
+static void
+DbSetError(Ns_DbHandle *handle)
+{
+    Tcl_DStringSetLength(&handle->dsExceptionMsg,0);
+    Tcl_DStringAppend(&handle->dsExceptionMsg,sqlite3_errmsg(handle->connection),-1);
+}
+
+Ns_ReturnCode
+Ns_DbFlush(Ns_DbHandle *handle)
+{
+    if(handle->statement) sqlite3_finalize(handle->statement);
+    handle->statement = 0;
+    handle->fetchingRows = NS_FALSE;
+    return NS_OK;
+}
+
+Ns_ReturnCode
+Ns_DbDML(Ns_DbHandle *handle,const char *sql)
+{
+    Ns_DbFlush(handle);
+    if(sqlite3_exec(handle->connection,sql,0,0,0) != SQLITE_OK) {
+      DbSetError(handle);
+      return NS_ERROR;
+    }
+    return NS_OK;
+}
+
+Ns_Set *
+Ns_DbSelect(Ns_DbHandle *handle,const char *sql)
+{
+    sqlite3_stmt *stmt;
+    int i;
+
+    Ns_DbFlush(handle);
+    if(sqlite3_prepare_v2(handle->connection,sql,-1,&stmt,0) != SQLITE_OK) {
+      DbSetError(handle);
+      return 0;
+    }
+    if(!stmt || sqlite3_column_count(stmt) == 0) {
+      sqlite3_finalize(stmt);
+      Tcl_DStringSetLength(&handle->dsExceptionMsg,0);
+      Tcl_DStringAppend(&handle->dsExceptionMsg,"Query was not a statement returning rows.",-1);
+      return 0;
+    }
+    Ns_SetFree(handle->row);
+    handle->row = Ns_SetCreate(0);
+    for(i = 0;i < sqlite3_column_count(stmt);i++) Ns_SetPut(handle->row,sqlite3_column_name(stmt,i),0);
+    handle->statement = stmt;
+    handle->fetchingRows = NS_TRUE;
+    return handle->row;
+}
+
+int
+Ns_DbGetRow(Ns_DbHandle *handle,Ns_Set *row)
+{
+    const char *text;
+    size_t i;
+
+    if(!handle->fetchingRows) return NS_ERROR;
+    switch(sqlite3_step(handle->statement)) {
+     case SQLITE_ROW:
+        for(i = 0;i < row->size;i++) {
+          text = (const char*)sqlite3_column_text(handle->statement,(int)i);
+          ns_free(row->fields[i].value);
+          row->fields[i].value = text ? ns_strdup(text) : 0;
+        }
+        return NS_OK;
+     case SQLITE_DONE:
+        Ns_DbFlush(handle);
+        return NS_END_DATA;
+     default:
+        DbSetError(handle);
+        Ns_DbFlush(handle);
+        return NS_ERROR;
+    }
+}
+
+void
+Ns_DbQuoteValue(Ns_DString *dsPtr,const char *chars)
+{
+    for(;*chars;chars++) {
+      if(*chars == '\'') Tcl_DStringAppend(dsPtr,"'",1);
+      Tcl_DStringAppend(dsPtr,chars,1);
+    }
+}
+
+/*
+ * OCaml interface of the shim, see shim.ml
+ */
+
+static void
+FreeConn(Conn *connPtr)
+{
+    if(!connPtr) return;
+    if(connPtr->zstream) DeflateEnd(connPtr);
+    Ns_SetFree(connPtr->headers);
+    Ns_SetFree(connPtr->outputheaders);
+    Ns_SetFree(connPtr->query);
+    Tcl_DStringFree(&connPtr->output);
+    ns_free(connPtr->request.line);
+    ns_free(connPtr->request.method);
+    ns_free(connPtr->request.url);
+    ns_free(connPtr->request.query);
+    ns_free(connPtr->content);
+    ns_free(connPtr);
+}
+
+CAMLprim value
+Shim_Init(value opageroot)
+{
+    CAMLparam1(opageroot);
+    int i;
+
+    if(!server.server) {
+      Tcl_FindExecutable("shim");
+      Tcl_InitHashTable(&config,TCL_STRING_KEYS);
+      Ns_GetTime(&boot);
+      server.server = "shim";
+      server.fastpath.pageroot = ns_strdup(String_val(opageroot));
+      server.nsv.nbuckets = NBUCKETS;
+      server.nsv.buckets = buckets;
+      for(i = 0;i < NBUCKETS;i++) Tcl_InitHashTable(&buckets[i].arrays,TCL_STRING_KEYS);
+      pool.pool = "default";
+      pool.threads.min = pool.threads.max = 1;
+      pool.tqueue.args = ns_calloc(1,sizeof(ConnThreadArg));
+      server.pools.firstPtr = server.pools.defaultPtr = &pool;
+      Tcl_DStringInit(&nsconf.servers);
+      Tcl_DStringAppendElement(&nsconf.servers,server.server);
+      nsconf.argv0 = nsconf.nsd = "shim";
+      nsconf.home = ".";
+      NsOCamlLibInit();
+      // Module defaults, see Ns_ModuleInit
+      NsOCamlCompressInit(0,1024,10*1024*1024);
+    }
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+Shim_Config(value osection,value okey,value ovalue)
+{
+    CAMLparam3(osection,okey,ovalue);
+    Tcl_HashEntry *hPtr;
+    int isNew;
+
+    hPtr = Tcl_CreateHashEntry(&config,String_val(osection),&isNew);
+    if(isNew) Tcl_SetHashValue(hPtr,Ns_SetCreate(String_val(osection)));
+    Ns_SetUpdate(Tcl_GetHashValue(hPtr),String_val(okey),String_val(ovalue));
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+Shim_LogEnable(value osev,value oenabled)
+{
+    logEnabled[Int_val(osev)] = Bool_val(oenabled);
+    return Val_unit;
+}
+
+/*
+ * Makes a new current connection, url may have a query part
+ */
+
+CAMLprim value
+Shim_Conn(value omethod,value ourl,value oheaders,value ocontent)
+{
+    CAMLparam4(omethod,ourl,oheaders,ocontent);
+    static unsigned long nextid;
+    Conn *connPtr = ns_calloc(1,sizeof(Conn));
+    const char *url = String_val(ourl), *q = strchr(url,'?'), *accept;
+    Tcl_DString ds;
+
+    FreeConn(current);
+    Tcl_DStringInit(&connPtr->output);
+    Tcl_DStringInit(&ds);
+    Ns_DStringPrintf(&ds,"%s %s HTTP/1.1",String_val(omethod),url);
+    connPtr->request.line = ns_strdup(ds.string);
+    Tcl_DStringFree(&ds);
+    connPtr->request.method = ns_strdup(String_val(omethod));
+    connPtr->request.url = q ? strncpy(ns_calloc(1,(size_t)(q - url) + 1),url,(size_t)(q - url)) : ns_strdup(url);
+    connPtr->request.query = q ? ns_strdup(q + 1) : 0;
+    connPtr->request.protocol = "http";
+    connPtr->request.version = 1.1;
+    connPtr->headers = Ns_SetCreate("headers");
+    connPtr->outputheaders = Ns_SetCreate("outputheaders");
+    for(;oheaders != Val_emptylist;oheaders = Field(oheaders,1)) {
+      Ns_SetPut(connPtr->headers,String_val(Field(Field(oheaders,0),0)),String_val(Field(Field(oheaders,0),1)));
+    }
+    connPtr->content = ns_strdup(String_val(ocontent));
+    connPtr->contentLength = caml_string_length(ocontent);
+    connPtr->poolPtr = &pool;
+    connPtr->flags = NS_CONN_CONFIGURED;
+    if((accept = Ns_SetIGet(connPtr->headers,"Accept-Encoding")) && strstr(accept,"gzip"))
+      connPtr->flags |= NS_CONN_ZIPACCEPTED;
+    snprintf(connPtr->idstr,sizeof(connPtr->idstr),"%lu",++nextid);
+    Ns_GetTime(&connPtr->requestQueueTime);
+    current = connPtr;
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Status and body sent on the current connection
+ */
+
+CAMLprim value
+Shim_Response(value unit)
+{
+    CAMLparam1(unit);
+    CAMLlocal2(retval,obody);
+
+    obody = caml_alloc_initialized_string(current ? (mlsize_t)current->output.length : 0,current ? current->output.string : "");
+    retval = caml_alloc_tuple(2);
+    Store_field(retval,0,Val_int(current ? current->responseStatus : 0));
+    Store_field(retval,1,obody);
+    CAMLreturn(retval);
+}
+
+CAMLprim value
+Shim_Header(value oname)
+{
+    CAMLparam1(oname);
+    const char *v = current ? Ns_SetIGet(current->outputheaders,String_val(oname)) : 0;
+
+    CAMLreturn(caml_copy_string(v ? v : ""));
+}
+
+/*
+ * Runs filters and the request handler registered for the current
+ * connection like the connection thread does
+ */
+
+CAMLprim value
+Shim_Dispatch(value unit)
+{
+    Proc *procPtr;
+    Ns_ReturnCode status;
+    Conn *connPtr = current;
+
+    if(!connPtr) caml_failwith("shim_dispatch: no connection");
+    status = RunFilters(connPtr,NS_FILTER_PRE_AUTH);
+    if(status == NS_OK) status = RunFilters(connPtr,NS_FILTER_POST_AUTH);
+    if(status == NS_OK) {
+      for(procPtr = procs;procPtr && !Match(procPtr,connPtr->request.method,connPtr->request.url);procPtr = procPtr->nextPtr);
+      if(procPtr) {
+        procPtr->proc(procPtr->arg,(Ns_Conn*)connPtr);
+      } else {
+        Ns_ConnReturnNotFound((Ns_Conn*)connPtr);
+      }
+    }
+    RunFilters(connPtr,NS_FILTER_TRACE);
+    return Val_unit;
+}
+
+/*
+ * Runs every scheduled proc once, procs scheduled once are removed.
+ * Returns the number of procs run.
+ */
+
+CAMLprim value
+Shim_RunScheduled(value unit)
+{
+    Sched **schedPtrPtr = &scheduled, *schedPtr;
+    int n = 0;
+
+    while((schedPtr = *schedPtrPtr)) {
+      if(schedPtr->proc) schedPtr->proc(schedPtr->arg,schedPtr->id);
+      if(schedPtr->callback) schedPtr->callback(schedPtr->arg);
+      n++;
+      if(schedPtr->flags & NS_SCHED_ONCE) {
+        *schedPtrPtr = schedPtr->nextPtr;
+        FreeSched(schedPtr);
+      } else {
+        schedPtrPtr = &schedPtr->nextPtr;
+      }
+    }
+    return Val_int(n);
+}
+
+/*
+ * Connection channels: queue input, fetch what was written and the
+ * registered callback, both empty for a closed channel
+ */
+
+CAMLprim value
+Shim_ConnChanInput(value ochan,value odata)
+{
+    ConnChan *chanPtr = GetConnChan(0,String_val(ochan));
+
+    if(!chanPtr) caml_failwith("shim_connchan_input: no such channel");
+    Tcl_DStringAppend(&chanPtr->input,String_val(odata),(int)caml_string_length(odata));
+    return Val_unit;
+}
+
+CAMLprim value
+Shim_ConnChan(value ochan)
+{
+    CAMLparam1(ochan);
+    CAMLlocal3(retval,osent,ocallback);
+    ConnChan *chanPtr = GetConnChan(0,String_val(ochan));
+
+    osent = caml_alloc_initialized_string(chanPtr ? (mlsize_t)chanPtr->sent.length : 0,chanPtr ? chanPtr->sent.string : "");
+    ocallback = caml_copy_string(chanPtr ? chanPtr->callback.string : "");
+    retval = caml_alloc_tuple(2);
+    Store_field(retval,0,osent);
+    Store_field(retval,1,ocallback);
+    CAMLreturn(retval);
+}
+
+/*
+ * Number of ns_http requests queued and not yet waited for or cancelled
+ */
+
+CAMLprim value
+Shim_HttpPending(value unit)
+{
+    NsInterp *itPtr = Tcl_GetAssocData(Ns_TclAllocateInterp(0),"ns:data",0);
+
+    return Val_int(itPtr->httpRequests.numEntries);
+}
+
+/*
+ * Response capture of the response cache: begin, end returning the ETag
+ * and body, and serving the captured response on the current connection
+ */
+
+static NsOCamlResponse *captured;
+
+CAMLprim value
+Shim_CaptureBegin(value unit)
+{
+    if(!current) caml_failwith("shim_capture_begin: no connection");
+    NsOCamlCaptureBegin((Ns_Conn*)current);
+    return Val_unit;
+}
+
+CAMLprim value
+Shim_CaptureEnd(value unit)
+{
+    CAMLparam1(unit);
+    CAMLlocal3(retval,otuple,obody);
+
+    NsOCamlFreeResponse(captured);
+    if(!current || !(captured = NsOCamlCaptureEnd((Ns_Conn*)current))) CAMLreturn(Val_int(0));
+    obody = caml_alloc_initialized_string(captured->length,captured->data);
+    otuple = caml_alloc_tuple(2);
+    Store_field(otuple,0,caml_copy_string(captured->etag));
+    Store_field(otuple,1,obody);
+    retval = caml_alloc_small(1,0);
+    Field(retval,0) = otuple;
+    CAMLreturn(retval);
+}
+
+CAMLprim value
+Shim_ReturnCaptured(value unit)
+{
+    if(!current || !captured) caml_failwith("shim_return_captured: nothing captured");
+    NsOCamlReturnResponse((Ns_Conn*)current,captured);
+    return Val_unit;
+}
@@ -0,0 +1,40 @@
+(* Stand-in for nsd, see shim.c. Linked before the test modules, loading
+   it initializes the fake server with the current directory as pageroot *)
+
+open Naviserver;;
+
+external shim_init : string -> unit = "Shim_Init"
+
+external shim_config : string -> string -> string -> unit = "Shim_Config"
+
+external shim_log_enable : severity -> bool -> unit = "Shim_LogEnable"
+
+external shim_conn : string -> string -> (string * string) list -> string -> unit = "Shim_Conn"
+
+external shim_response : unit -> int * string = "Shim_Response"
+
+external shim_header : string -> string = "Shim_Header"
+
+external shim_dispatch : unit -> unit = "Shim_Dispatch"
+
+external shim_run_scheduled : unit -> int = "Shim_RunScheduled"
+
+external shim_http_pending : unit -> int = "Shim_HttpPending"
+
+external shim_connchan_input : string -> string -> unit = "Shim_ConnChanInput"
+
+external shim_connchan : string -> string * string = "Shim_ConnChan"
+
+external shim_capture_begin : unit -> unit = "Shim_CaptureBegin"
+
+external shim_capture_end : unit -> (string * string) option = "Shim_CaptureEnd"
+
+external shim_return_captured : unit -> unit = "Shim_ReturnCaptured"
+
+(* Runs a request through filters and registered procs, returns status and body *)
+let request ?(headers=[]) ?(content="") meth url =
+  shim_conn meth url headers content;
+  shim_dispatch ();
+  shim_response ()
+
+let () = shim_init (Sys.getcwd ())
@@ -0,0 +1,340 @@
+open Naviserver;;
+
+(* Unit tests of the stubs against the shim, exits with 1 on failure *)
+
+let failed = ref 0;;
+
+let check name ok =
+  if not ok then begin
+    incr failed;
+    prerr_endline ("FAILED: " ^ name)
+  end;;
+
+let raises name f =
+  check name (try ignore (f ()); false with _ -> true);;
+
+(* Sets *)
+
+let () =
+  let id = ns_set_create "test" in
+  ns_set_put id "a" "1";
+  ns_set_put id "B" "2";
+  check "ns_set_size" (ns_set_size id = 2);
+  check "ns_set_get" (ns_set_get id "a" = "1");
+  check "ns_set_iget" (ns_set_iget id "b" = "2");
+  check "ns_set_find" (ns_set_find id "B" = 1);
+  ns_set_update id "a" "3";
+  check "ns_set_update" (ns_set_get id "a" = "3" && ns_set_size id = 2);
+  let copy = ns_set_copy id in
+  ns_set_delkey id "a";
+  check "ns_set_delkey" (ns_set_size id = 1 && ns_set_size copy = 2);
+  ns_set_free copy;;
+
+(* Encoding *)
+
+let () =
+  check "ns_urlencode" (ns_urlencode "a b&c" = "a+b%26c");
+  check "ns_urldecode" (ns_urldecode "a+b%26c" = "a b&c");
+  check "ns_urlencode clean" (ns_urlencode "abc-1.txt" = "abc-1.txt");
+  check "ns_urlencode_query" (ns_urlencode_query ["q", "a b"; "n", "1"] = "q=a+b&n=1");
+  check "ns_urldecode_list" (ns_urldecode_list ["a%20"; "b"] = ["a "; "b"]);
+  check "ns_quotehtml" (ns_quotehtml "<a href=\"x\">&</a>" = "&lt;a href=&#34;x&#34;&gt;&amp;&lt;/a&gt;");
+  check "ns_quotehtml clean" (ns_quotehtml "plain" = "plain");
+  check "ns_striphtml" (ns_striphtml "<b>bold</b> text" = "bold text");
+  let samples = ["<p class=\"a\">x &amp; y 'z'</p>"; "a &b c; d&e;f <i>"; String.make 40 '<';
+                 String.concat "" (List.init 50 (fun i -> if i mod 17 = 0 then "&lt;" else "plain text "))] in
+  check "ns_quotehtml scalar" (List.for_all (fun s -> ns_quotehtml s = ns_quotehtml_scalar s) samples);
+  check "ns_striphtml scalar" (List.for_all (fun s -> ns_striphtml s = ns_striphtml_scalar s) samples);;
+
+(* Shared state *)
+
+let () =
+  nsv_set "test" "k" "v";
+  check "nsv_get" (nsv_get "test" "k" = "v");
+  nsv_incr "test" "n" 2;
+  nsv_incr "test" "n" 3;
+  check "nsv_incr" (nsv_get "test" "n" = "5");
+  nsv_unset "test" "k";
+  check "nsv_unset" (nsv_exists "test" "k" = 0);
+  ns_cache_create "test" 1000 0;
+  let calls = ref 0 in
+  let eval () = ns_cache_eval "test" "k" (fun () -> incr calls; "v") in
+  check "ns_cache_eval" (eval () = "v" && eval () = "v" && !calls = 1);
+  check "ns_cache_stats" (let stats = ns_cache_stats "test" and counts = "hits 1 missed 1" in
+                          let n = String.length stats and m = String.length counts in
+                          n >= m && String.sub stats (n - m) m = counts);
+  ns_cache_flush "test" "k";
+  check "ns_cache_flush" (eval () = "v" && !calls = 2);
+  raises "ns_cache_create size" (fun () -> ns_cache_create "bad" (-1) 0);
+  raises "ns_cache_create ttl" (fun () -> ns_cache_create "bad" 1000 (-1));
+  ns_shared_publish "test" [| "a"; "b" |];
+  let h = (ns_shared_get "test" : string array shared) in
+  check "ns_shared_get" (ns_shared_value h = [| "a"; "b" |]);
+  ns_shared_publish "test" [| "c" |];
+  Gc.full_major ();
+  check "ns_shared_get replaced" (ns_shared_value h = [| "a"; "b" |] &&
+                                  ns_shared_with (ns_shared_get "test") (fun v -> v = [| "c" |]));
+  let copy = ns_shared_value h in
+  copy.(0) <- "z";
+  check "ns_shared_value copy" (ns_shared_value h = [| "a"; "b" |]);
+  ns_shared_remove "test";
+  check "ns_shared_remove handle" (ns_shared_value h = [| "a"; "b" |]);
+  raises "ns_shared_remove" (fun () -> (ns_shared_get "test" : string array shared));;
+
+(* Time *)
+
+let () =
+  check "ns_time_usec" (abs (ns_time_usec () / 1000000 - ns_time ()) <= 1);
+  check "ns_fmttime" (ns_fmttime 0 "%Y" = ns_fmttime 0 "%Y");
+  let t = ns_monotonic_usec () in
+  check "ns_monotonic_usec" (ns_monotonic_usec () >= t);;
+
+(* Log *)
+
+let () =
+  Shim.shim_log_enable Log_debug false;
+  check "ns_log_enabled" (not (ns_log_enabled Log_debug) && ns_log_enabled Log_error);
+  Shim.shim_log_enable Log_debug true;
+  check "ns_log_enabled debug" (ns_log_enabled Log_debug);
+  Shim.shim_log_enable Log_debug false;;
+
+(* Connection *)
+
+let () =
+  Shim.shim_conn "GET" "/a/b.html?x=1&y=a+b" ["Host", "localhost"] "";
+  check "ns_conn url" (ns_conn "url" = "/a/b.html");
+  check "ns_conn method" (ns_conn "method" = "GET");
+  check "ns_queryget" (ns_queryget "y" = "a b");
+  check "ns_queryexists" (ns_queryexists "x" = 1 && ns_queryexists "z" = 0);
+  ns_return 201 "text/plain" "created";
+  check "ns_return" (Shim.shim_response () = (201, "created"));
+  check "ns_return type" (Shim.shim_header "Content-Type" = "text/plain");
+  Shim.shim_conn "GET" "/" [] "";
+  check "ns_conn_sent" (not (ns_conn_sent ()));
+  ns_returnv 200 "text/plain" [| "a"; "bc"; "" ; "d" |];
+  check "ns_returnv" (Shim.shim_response () = (200, "abcd"));
+  check "ns_conn_sent response" (ns_conn_sent ());
+  check "ns_returnv length" (Shim.shim_header "Content-Length" = "4");;
+
+(* Requests, filters and scheduled procs *)
+
+let () =
+  let traced = ref 0 in
+  ns_register_proc "GET" "/hello" (fun () -> ns_return 200 "text/plain" ("hello " ^ ns_queryget "name"));
+  ns_register_filter Preauth "GET" "/hello/deny*" (fun () -> ns_returnforbidden (); Filter_return);
+  ns_register_filter Trace "GET" "/hello*" (fun () -> incr traced; Filter_ok);
+  check "ns_register_proc" (Shim.request "GET" "/hello?name=shim" = (200, "hello shim"));
+  check "ns_register_filter" (fst (Shim.request "GET" "/hello/deny") = 403);
+  check "ns_register_filter trace" (!traced = 2);
+  ns_unregister_proc "GET" "/hello";
+  check "ns_unregister_proc" (fst (Shim.request "GET" "/hello") = 404);
+  let runs = ref 0 in
+  let id = ns_schedule_proc 60 (fun () -> incr runs) in
+  ignore (ns_after 1 (fun () -> incr runs));
+  ignore (Shim.shim_run_scheduled ());
+  ignore (Shim.shim_run_scheduled ());
+  check "ns_schedule_proc" (!runs = 3);
+  ns_unschedule_proc id;
+  check "ns_unschedule_proc" (Shim.shim_run_scheduled () = 0);
+  raises "ns_schedule_proc interval" (fun () -> ns_schedule_proc 0 ignore);
+  raises "ns_after delay" (fun () -> ns_after (-1) ignore);;
+
+(* Database *)
+
+let () =
+  ns_db_with "" (fun db ->
+    ns_db_dml db "create table items (id integer, name text)" [];
+    List.iter (fun (id, name) -> ns_db_dml db "insert into items values (?, ?)" [id; name])
+      ["1", "one"; "2", "it's two"; "3", "three?"];
+    check "ns_db_select" (ns_db_select db "select id, name from items" [] = [| "id"; "name" |]);
+    ns_db_flush db;
+    check "ns_db_rows" (ns_db_rows db "select name from items where id > ? order by id" ["1"] =
+                        [[| "it's two" |]; [| "three?" |]]);
+    check "ns_db_fold" (ns_db_fold db "select id from items" [] (fun n r -> n + int_of_string r.(0)) 0 = 6);
+    check "ns_db_0or1row" (ns_db_0or1row db "select name from items where name = '?'" [] = None);
+    raises "ns_db_0or1row many" (fun () -> ns_db_0or1row db "select id from items" []);
+    check "ns_db placeholders" (ns_db_rows db "select ? as \"a?\", '?' /* ? */ from items -- ?\nwhere id = ?"
+                                  ["x"; "1"] = [[| "x"; "?" |]]);
+    raises "ns_db params" (fun () -> ns_db_dml db "delete from items where id = ?" []);
+    raises "ns_db error" (fun () -> ns_db_dml db "bogus" []));
+  let db = ns_db_gethandle "" in
+  ns_db_releasehandle db;
+  raises "ns_db released" (fun () -> ns_db_select db "select 1" []);
+  let leaked = ref None in
+  ns_register_proc "GET" "/leak" (fun () -> leaked := Some (ns_db_gethandle ""); ns_return 200 "text/plain" "");
+  ignore (Shim.request "GET" "/leak");
+  ns_unregister_proc "GET" "/leak";
+  raises "ns_db request end" (fun () ->
+    match !leaked with Some db -> ns_db_select db "select 1" [] | None -> [||]);;
+
+(* HTTP client, against the ns_http stand-in of the shim *)
+
+let () =
+  let reqs = [ns_http_request "http://backend/a";
+              ns_http_request ~meth:"POST" ~headers:["Token", "t"] ~body:"data" "http://backend/b"] in
+  match ns_http_run_all reqs with
+    [a; b] ->
+      check "ns_http status" (a.resp_status = 200 && b.resp_status = 200);
+      check "ns_http body" (ns_http_body_string a = "GET http://backend/a\n");
+      check "ns_http post" (ns_http_body_string b = "POST http://backend/b\ndata");
+      check "ns_http headers" (ns_http_header b "x-echo-token" = "t")
+  | _ -> check "ns_http_run_all" false;;
+
+let () =
+  raises "ns_http_run_all error" (fun () ->
+    ns_http_run_all [ns_http_request "http://backend/a"; ns_http_request "http://fail/";
+                     ns_http_request "http://backend/c"]);
+  check "ns_http_run_all cancel" (Shim.shim_http_pending () = 0);;
+
+(* Compression, the shim gzips text like nsd, binary data is sent as is *)
+
+let () =
+  let big = String.make 4096 'x' and gzip = ["Accept-Encoding", "gzip, deflate"] in
+  let gzipped body = String.length body > 2 && String.sub body 0 2 = "\x1f\x8b" in
+  Shim.shim_conn "GET" "/" gzip "";
+  ns_compress 6;
+  ns_return 200 "text/plain" big;
+  check "ns_compress" (Shim.shim_header "Content-Encoding" = "gzip" && gzipped (snd (Shim.shim_response ())));
+  Shim.shim_conn "GET" "/" gzip "";
+  ns_compress 6;
+  ns_return 200 "text/plain" "small";
+  check "ns_compress minsize" (Shim.shim_response () = (200, "small"));
+  Shim.shim_conn "GET" "/" gzip "";
+  ns_return_precompressed "big" 200 "text/plain" big;
+  let first = snd (Shim.shim_response ()) in
+  check "ns_return_precompressed" (Shim.shim_header "Content-Encoding" = "gzip" && gzipped first);
+  Shim.shim_conn "GET" "/" gzip "";
+  ns_return_precompressed "big" 200 "text/plain" big;
+  check "ns_return_precompressed cached" (snd (Shim.shim_response ()) = first);
+  Shim.shim_conn "GET" "/" gzip "";
+  ns_return_precompressed "big" 200 "text/plain" (big ^ "y");
+  check "ns_return_precompressed changed" (snd (Shim.shim_response ()) <> first);
+  Shim.shim_conn "GET" "/" [] "";
+  ns_return_precompressed "big" 200 "text/plain" big;
+  check "ns_return_precompressed identity" (Shim.shim_response () = (200, big) && Shim.shim_header "Vary" = "Accept-Encoding");
+  Shim.shim_conn "GET" "/" gzip "";
+  ns_compress 6;
+  ignore (ns_stream_start 200 "text/plain" [] && ns_stream_write big);
+  let chunk = snd (Shim.shim_response ()) in
+  ignore (ns_stream_write big);
+  ignore (ns_conn "close");
+  check "ns_compress stream" (Shim.shim_header "Content-Encoding" = "gzip" && gzipped chunk &&
+                              String.length (snd (Shim.shim_response ())) > String.length chunk);
+  raises "ns_compress level" (fun () -> ns_compress 10);;
+
+(* Response cache, capture of a page response and serving it again *)
+
+let () =
+  Shim.shim_conn "GET" "/page.cmo" [] "";
+  Shim.shim_capture_begin ();
+  ns_set_put (ns_conn "outputheaders") "Cache-Control" "max-age=60";
+  ns_return 200 "text/plain" "cached page";
+  match Shim.shim_capture_end () with
+    None -> check "capture" false
+  | Some (etag, body) ->
+      check "capture" (body = "cached page" && Shim.shim_header "ETag" = etag);
+      check "capture etag" (etag = "\"" ^ Digest.to_hex (Digest.string body) ^ "\"");
+      Shim.shim_conn "GET" "/page.cmo" [] "";
+      Shim.shim_return_captured ();
+      check "cached response" (Shim.shim_response () = (200, "cached page") &&
+                               Shim.shim_header "ETag" = etag &&
+                               Shim.shim_header "Cache-Control" = "max-age=60");
+      Shim.shim_conn "GET" "/page.cmo" ["If-None-Match", etag] "";
+      Shim.shim_return_captured ();
+      check "cached 304" (fst (Shim.shim_response ()) = 304);
+      Shim.shim_conn "GET" "/page.cmo" ["If-None-Match", etag] "";
+      Shim.shim_capture_begin ();
+      ns_returnv 200 "text/plain" [|"cached "; "page"|];
+      check "capture 304" (fst (Shim.shim_response ()) = 304 && Shim.shim_capture_end () <> None);;
+
+let () =
+  Shim.shim_conn "GET" "/page.cmo" [] "";
+  Shim.shim_capture_begin ();
+  ns_response_nocache ();
+  ns_return 200 "text/plain" "private";
+  check "ns_response_nocache" (Shim.shim_capture_end () = None && Shim.shim_response () = (200, "private"));
+  Shim.shim_conn "GET" "/page.cmo" [] "";
+  Shim.shim_capture_begin ();
+  ns_return 404 "text/plain" "missing";
+  check "capture status" (Shim.shim_capture_end () = None);
+  List.iter (fun (key, v) ->
+    Shim.shim_conn "GET" "/page.cmo" [] "";
+    Shim.shim_capture_begin ();
+    ns_set_put (ns_conn "outputheaders") key v;
+    ns_return 200 "text/plain" "per client";
+    check ("capture " ^ v) (Shim.shim_capture_end () = None && Shim.shim_response () = (200, "per client")))
+    ["Set-Cookie", "s=1"; "Cache-Control", "private, max-age=60"; "cache-control", "No-Store"];
+  ns_response_cache_flush "/page.cmo";;
+
+(* Connection channels, against the ns_connchan stand-in of the shim,
+   events are dispatched the way ns_ocaml channel does *)
+
+let () =
+  Shim.shim_conn "GET" "/events" [] "";
+  let chan = ns_connchan_detach () in
+  raises "ns_connchan_detach twice" ns_connchan_detach;
+  check "ns_connchan_write" (ns_connchan_write chan "HTTP/1.1 200 OK\r\n\r\n" = 19);
+  ns_connchan_callback ~timeout:1000 chan (fun ev ->
+    match ev, ns_connchan_read chan with
+      Chan_readable, "" -> false
+    | Chan_readable, data -> ignore (ns_connchan_write chan (String.uppercase_ascii data)); true
+    | _ -> false);
+  check "ns_connchan_callback" (snd (Shim.shim_connchan chan) = "ns_ocaml channel " ^ chan ^ " r");
+  Shim.shim_connchan_input chan "ping";
+  check "ns_connchan readable" (ns_connchan_dispatch (chan ^ " r"));
+  check "ns_connchan_read" (fst (Shim.shim_connchan chan) = "HTTP/1.1 200 OK\r\n\r\nPING");
+  check "ns_connchan eof" (not (ns_connchan_dispatch (chan ^ " r")));
+  check "ns_connchan removed" (not (ns_connchan_dispatch (chan ^ " r")));
+  ns_connchan_close chan;
+  check "ns_connchan_close" (Shim.shim_connchan chan = ("", ""));
+  raises "ns_connchan closed" (fun () -> ns_connchan_write chan "x");;
+
+(* Server-sent events, streamed on the connection and on a channel *)
+
+let () =
+  Shim.shim_conn "GET" "/sse" [] "";
+  let w = ns_sse_start () in
+  check "ns_sse_start" (Shim.shim_header "Content-Type" = "text/event-stream");
+  ns_sse_event ~event:"tick" ~id:"1" w "a\nb";
+  check "ns_sse_event buffered" (snd (Shim.shim_response ()) = "");
+  check "ns_sse_flush" (ns_sse_flush w);
+  check "ns_sse_event" (Shim.shim_response () = (200, "event: tick\nid: 1\ndata: a\ndata: b\n\n"));
+  check "ns_sse_keepalive idle" (ns_sse_keepalive w 60 && snd (Shim.shim_response ()) = "event: tick\nid: 1\ndata: a\ndata: b\n\n");
+  ns_sse_event w "c\rd\r\ne";
+  check "ns_sse_event cr" (ns_sse_flush w &&
+                           snd (Shim.shim_response ()) = "event: tick\nid: 1\ndata: a\ndata: b\n\ndata: c\ndata: d\ndata: e\n\n");
+  raises "ns_sse_event id" (fun () -> ns_sse_event ~id:"1\rdata: x" w "y");
+  ignore (ns_conn "close");
+  ns_sse_comment w "gone";
+  check "ns_sse disconnect" (not (ns_sse_flush w) && not (ns_sse_connected w));;
+
+let () =
+  Shim.shim_conn "GET" "/sse" [] "";
+  let w = ns_sse_detach () in
+  let chan = match w.sse_chan with Some chan -> chan | None -> "" in
+  ns_sse_event ~retry:1000 w "x";
+  check "ns_sse_flush channel" (ns_sse_flush w);
+  let sent = fst (Shim.shim_connchan chan) in
+  let tail = "\r\n\r\nretry: 1000\ndata: x\n\n" in
+  check "ns_sse_detach" (String.length sent > String.length tail &&
+                         String.sub sent 0 15 = "HTTP/1.1 200 OK" &&
+                         String.sub sent (String.length sent - String.length tail) (String.length tail) = tail);
+  w.sse_sent <- w.sse_sent - 30000000;
+  ns_sse_heartbeat w 30;
+  ignore (Shim.shim_run_scheduled ());
+  let sent' = fst (Shim.shim_connchan chan) in
+  check "ns_sse_heartbeat" (String.sub sent' (String.length sent) (String.length sent' - String.length sent) = ": ping\n\n");
+  check "ns_sse client closed" (not (ns_connchan_dispatch (chan ^ " r")) && not (ns_sse_connected w) && w.sse_heartbeat = -1);
+  ns_connchan_close chan;;
+
+(* Tcl *)
+
+let () =
+  check "ns_eval" (ns_eval "string length abc" = "3");;
+
+let () =
+  if !failed > 0 then begin
+    Printf.eprintf "%d tests failed\n" !failed;
+    exit 1
+  end;
+  print_endline "all tests passed";;